@@ -8,6 +8,23 @@
 #include <stdlib.h>  // malloc, freeのため
 #include <string.h>  // memcpy, memsetのため
 #include <complex.h> // 複素数計算のため
+#include "forward_map.h" // 順写像を並列に書き込むため
+
+// 元画像の行 row の全ピクセルの行き先を求める (スレッドプールの仕事1つ分)
+void transform_row(void *ctx, int y) {
+    ForwardMap *map = ctx;
+    // 4. 画像座標(x, y)を複素数zに変換
+    //    (行の先頭の複素数から、1ピクセルごとに幅を足していく)
+    double complex z = forward_map_point(map, 0, y);
+    for (int x = 0; x < map->width; x++, z += map->view.scale_re) {
+
+        // 5. 複素関数で変換！ ★ここを変えると色々な変換が楽しめる！★
+        double complex w = z * z * z;
+
+        // 6. 結果の複素数wを新しい画像座標(nx, ny)に変換 (範囲外なら-1)
+        forward_map_set(map, y * map->width + x, w);
+    }
+}
 
 int main(int argc, char * argv[]) {
     // --- 1. 入力画像の読み込み ---
@@ -39,34 +56,23 @@ int main(int argc, char * argv[]) {
     memset(output_img, 0, img_size);
 
     // --- 3-7. 全ピクセルを変換・コピー ---
-    // 2重のforループで入力画像の全ピクセルを走査
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            // 4. 画像座標(x, y)を複素数zに変換
-            //    複素平面の範囲を(-2, -2)から(2, 2)に設定
-            double complex z = ((double)x / width * 4.0 - 2.0) +
-                               ((double)y / height * 4.0 - 2.0) * I;
-
-            // 5. 複素関数で変換！ ★ここを変えると色々な変換が楽しめる！★
-            double complex w = z * z * z; 
-
-            // 6. 結果の複素数wを新しい画像座標(nx, ny)に変換
-            int nx = (int)((creal(w) + 2.0) / 4.0 * width);
-            int ny = (int)((cimag(w) + 2.0) / 4.0 * height);
-
-            // 7. ピクセルをコピー
-            // 新しい座標が画像の範囲内にあるかチェック
-            if (nx >= 0 && nx < width && ny >= 0 && ny < height) {
-                // (x, y)のピクセルのアドレスを計算
-                int src_index = (y * width + x) * channels;
-                // (nx, ny)のピクセルのアドレスを計算
-                int dest_index = (ny * width + nx) * channels;
-
-                // memcpyでピクセルの色情報(RGB or RGBA)を丸ごとコピー
-                memcpy(output_img + dest_index, input_img + src_index, channels);
-            }
-        }
+    // 全ピクセルの行き先を行ごとに並列に求めてから、並列にコピーする
+    // (同じ場所に写るピクセルが複数あれば、1ピクセルずつ順にコピーしたときと同じく最後のピクセルが残る)
+    // 複素平面の範囲は(-2, -2)から(2, 2)
+    Viewport view;
+    viewport_init(&view, -2.0, 2.0, -2.0, 2.0, width, height);
+    ForwardMap map;
+    if (forward_map_init(&map, &view) != 0) {
+        printf("作業用メモリの確保に失敗しました。\n");
+        stbi_image_free(input_img);
+        free(output_img);
+        return 1;
     }
+    tile_pool_run(tile_pool_shared(), height, transform_row, &map);
+
+    // 7. ピクセルをコピー
+    forward_map_scatter(&map, 0, width * height, input_img, output_img, channels);
+    forward_map_free(&map);
 
     printf("複素関数を使って画像を変換しました。\n");
 
@@ -0,0 +1,140 @@
+// 変換に使う複素関数の一覧
+// 各関数は f, f' (ニュートン法用に両方を同時に計算する版も) と、分かっていれば解析的な逆関数を持つ。
+// 逆関数がある関数はニュートン法を使わずに1回の計算で逆写像を求められる。
+#ifndef COMPLEX_FUNCS_H
+#define COMPLEX_FUNCS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <complex.h>
+#include "newton.h"
+#include "simd_complex.h"
+
+#define CF_PI 3.14159265358979323846
+
+// 逆関数 (branchで何番目の枝の解を返すかを選ぶ。0が主値)
+typedef double complex (*complex_inverse_func)(double complex w, int branch);
+
+typedef struct {
+    const char *name;          // コマンドラインで指定する名前
+    const char *expr;          // 表示用の式
+    complex_func f;            // 関数
+    complex_func df;           // 1階導関数
+    complex_func_dual fdf;     // f と f' を同時に計算する関数 (ニュートン法で使う)
+    complex_inverse_func inv;  // 逆関数 (無ければNULL、ニュートン法で解く)
+    SimdFuncKind simd;         // SIMD版 (simd_complex.h、無ければSIMD_FUNC_NONE)
+} ComplexFunction;
+
+// branchの偶奇 (負の数でも0か1を返す)
+static inline int cf_parity(int branch) {
+    return ((branch % 2) + 2) % 2;
+}
+
+// --- exp(z) ---
+// 逆関数 z = log(w) + 2πik
+static inline double complex cf_exp(double complex z) { return cexp(z); }
+static inline double complex cf_exp_fdf(double complex z, double complex *df) {
+    double complex e = cexp(z);
+    *df = e;
+    return e;
+}
+static inline double complex cf_exp_inv(double complex w, int branch) {
+    return clog(w) + 2 * CF_PI * branch * I;
+}
+
+// --- exp(z) + exp(-z) = 2cosh(z) ---
+// 逆関数 z = ±acosh(w/2) + 2πik (偶数の枝は+、奇数の枝は-)
+static inline double complex cf_cosh2(double complex z) { return cexp(z) + cexp(-z); }
+static inline double complex cf_cosh2_d(double complex z) { return cexp(z) - cexp(-z); }
+static inline double complex cf_cosh2_fdf(double complex z, double complex *df) {
+    double complex a = cexp(z), b = cexp(-z);
+    *df = a - b;
+    return a + b;
+}
+static inline double complex cf_cosh2_inv(double complex w, int branch) {
+    int p = cf_parity(branch);
+    return (p ? -1 : 1) * cacosh(w / 2) + CF_PI * (branch - p) * I;
+}
+
+// --- z^2 ---
+// 逆関数 z = ±sqrt(w) (偶数の枝は+、奇数の枝は-)
+static inline double complex cf_square(double complex z) { return z * z; }
+static inline double complex cf_square_d(double complex z) { return 2 * z; }
+static inline double complex cf_square_fdf(double complex z, double complex *df) {
+    *df = 2 * z;
+    return z * z;
+}
+static inline double complex cf_square_inv(double complex w, int branch) {
+    return cf_parity(branch) ? -csqrt(w) : csqrt(w);
+}
+
+// --- z^3 ---
+// 逆関数 z = w^(1/3) * exp(2πik/3)
+static inline double complex cf_cube(double complex z) { return z * z * z; }
+static inline double complex cf_cube_d(double complex z) { return 3 * z * z; }
+static inline double complex cf_cube_fdf(double complex z, double complex *df) {
+    *df = 3 * z * z;
+    return z * z * z;
+}
+static inline double complex cf_cube_inv(double complex w, int branch) {
+    if (w == 0) {
+        return 0;
+    }
+    return cexp(clog(w) / 3 + 2 * CF_PI * branch / 3 * I);
+}
+
+// --- sin(z) ---
+// 逆関数 z = (-1)^k asin(w) + πk
+static inline double complex cf_sin(double complex z) { return csin(z); }
+static inline double complex cf_sin_d(double complex z) { return ccos(z); }
+static inline double complex cf_sin_fdf(double complex z, double complex *df) {
+    *df = ccos(z);
+    return csin(z);
+}
+static inline double complex cf_sin_inv(double complex w, int branch) {
+    return (cf_parity(branch) ? -1 : 1) * casin(w) + CF_PI * branch;
+}
+
+// --- tanh(z) ---
+// 逆関数 z = atanh(w) + πik
+static inline double complex cf_tanh(double complex z) { return ctanh(z); }
+static inline double complex cf_tanh_d(double complex z) { return 1 / (ccosh(z) * ccosh(z)); }
+static inline double complex cf_tanh_fdf(double complex z, double complex *df) {
+    double complex c = ccosh(z);
+    *df = 1 / (c * c);
+    return ctanh(z);
+}
+static inline double complex cf_tanh_inv(double complex w, int branch) {
+    return catanh(w) + CF_PI * branch * I;
+}
+
+static const ComplexFunction complex_functions[] = {
+    {"exp",    "exp(z)",           cf_exp,    cf_exp,      cf_exp_fdf,    cf_exp_inv,    SIMD_FUNC_EXP},
+    {"cosh2",  "exp(z) + exp(-z)", cf_cosh2,  cf_cosh2_d,  cf_cosh2_fdf,  cf_cosh2_inv,  SIMD_FUNC_COSH2},
+    {"square", "z^2",              cf_square, cf_square_d, cf_square_fdf, cf_square_inv, SIMD_FUNC_SQUARE},
+    {"cube",   "z^3",              cf_cube,   cf_cube_d,   cf_cube_fdf,   cf_cube_inv,   SIMD_FUNC_CUBE},
+    {"sin",    "sin(z)",           cf_sin,    cf_sin_d,    cf_sin_fdf,    cf_sin_inv,    SIMD_FUNC_SIN},
+    {"tanh",   "tanh(z)",          cf_tanh,   cf_tanh_d,   cf_tanh_fdf,   cf_tanh_inv,   SIMD_FUNC_TANH},
+};
+
+#define COMPLEX_FUNCTION_COUNT ((int) (sizeof(complex_functions) / sizeof(complex_functions[0])))
+
+// 名前から関数を探す (見つからなければNULL)
+static inline const ComplexFunction *complex_function_find(const char *name) {
+    for (int i = 0; i < COMPLEX_FUNCTION_COUNT; i++) {
+        if (strcmp(complex_functions[i].name, name) == 0) {
+            return &complex_functions[i];
+        }
+    }
+    return NULL;
+}
+
+// 使える関数の一覧を表示する
+static inline void complex_function_print_list(void) {
+    for (int i = 0; i < COMPLEX_FUNCTION_COUNT; i++) {
+        printf("  %-8s %s%s\n", complex_functions[i].name, complex_functions[i].expr,
+               complex_functions[i].inv ? "" : " (ニュートン法)");
+    }
+}
+
+#endif
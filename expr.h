@@ -0,0 +1,712 @@
+// 実行時に与える式で変換の関数を決める (コマンドラインの --expr)
+// 式を読んでレジスタ型のバイトコードにコンパイルし、ピクセルのブロックごとに実行する。
+// 命令の振り分け (switch) はブロックごとに1回だけで、各命令の中身は simd_complex.h の
+// SIMDカーネルで8ピクセルずつ計算するので、ピクセル数が多ければほぼコンパイル済みの関数と同じ速さになる。
+//
+// 書ける式
+//   z, 数値 (1.5, 2e-3), i, pi, e
+//   + - * / ^ (累乗)、括弧、単項の - と +、掛け算の省略 (2z, 3i, z z, 2(z+1), sin(z) cos(z))
+//   exp log sin cos tan sinh cosh tanh sqrt conj abs (1引数), pow(a, b)
+// 例: "exp(z) + exp(-z)", "z^3 - 1", "sin(z) / z"
+//
+// f'(z) は二重数による前進型の自動微分で f(z) と同時に求めるので、導関数を書く必要はない。
+#ifndef EXPR_H
+#define EXPR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <complex.h>
+#include <math.h>
+#include "simd_complex.h"
+
+#define EXPR_MAX_CODE 128   // 命令数の上限
+#define EXPR_MAX_CONSTS 64  // 定数の数の上限
+#define EXPR_MAX_REGS 32    // レジスタ数の上限 (レジスタ0はいつも z)
+#define EXPR_BLOCK 64       // 1回に計算するピクセル数の上限 (SIMD_LANES の倍数)
+
+typedef enum {
+    EXPR_OP_CONST,  // dst = consts[n]
+    EXPR_OP_ADD,    // dst = a + b
+    EXPR_OP_SUB,    // dst = a - b
+    EXPR_OP_MUL,    // dst = a * b
+    EXPR_OP_DIV,    // dst = a / b
+    EXPR_OP_POW,    // dst = a ^ b (主値)
+    EXPR_OP_POWI,   // dst = a ^ n (nは整数、掛け算を繰り返す)
+    EXPR_OP_NEG,    // dst = -a
+    EXPR_OP_EXP,
+    EXPR_OP_LOG,
+    EXPR_OP_SQRT,
+    EXPR_OP_SIN,
+    EXPR_OP_COS,
+    EXPR_OP_TAN,
+    EXPR_OP_SINH,
+    EXPR_OP_COSH,
+    EXPR_OP_TANH,
+    EXPR_OP_CONJ,
+    EXPR_OP_ABS
+} ExprOpcode;
+
+typedef struct {
+    unsigned char op;       // ExprOpcode
+    unsigned char dst;      // 結果を入れるレジスタ
+    unsigned char a, b;     // 引数のレジスタ (1引数の命令は b = a)
+    int n;                  // 定数の番号 (EXPR_OP_CONST) か指数 (EXPR_OP_POWI)
+} ExprInstr;
+
+typedef struct {
+    ExprInstr code[EXPR_MAX_CODE];
+    int n_code;
+    double complex consts[EXPR_MAX_CONSTS];
+    int n_consts;
+    int n_regs;             // 使うレジスタの数
+    int result;             // 結果が入るレジスタ
+} ExprProgram;
+
+// --- 1つの値の計算 (定数の畳み込みと、SIMDを使わないときの計算に使う) ---
+
+static inline double complex expr_powi(double complex a, int n) {
+    double complex r = 1, p = a;
+    for (int k = n < 0 ? -n : n; k > 0; k >>= 1) {
+        if (k & 1) {
+            r *= p;
+        }
+        p *= p;
+    }
+    return n < 0 ? 1 / r : r;
+}
+
+static inline double complex expr_apply(int op, double complex a, double complex b, int n) {
+    switch (op) {
+        case EXPR_OP_ADD:  return a + b;
+        case EXPR_OP_SUB:  return a - b;
+        case EXPR_OP_MUL:  return a * b;
+        case EXPR_OP_DIV:  return a / b;
+        case EXPR_OP_POW:  return a == 0 ? 0 : cexp(b * clog(a));
+        case EXPR_OP_POWI: return expr_powi(a, n);
+        case EXPR_OP_NEG:  return -a;
+        case EXPR_OP_EXP:  return cexp(a);
+        case EXPR_OP_LOG:  return clog(a);
+        case EXPR_OP_SQRT: return csqrt(a);
+        case EXPR_OP_SIN:  return csin(a);
+        case EXPR_OP_COS:  return ccos(a);
+        case EXPR_OP_TAN:  return ctan(a);
+        case EXPR_OP_SINH: return csinh(a);
+        case EXPR_OP_COSH: return ccosh(a);
+        case EXPR_OP_TANH: return ctanh(a);
+        case EXPR_OP_CONJ: return conj(a);
+        case EXPR_OP_ABS:  return cabs(a);
+        default:           return a;
+    }
+}
+
+// --- 構文解析とコンパイル ---
+
+// 式の途中の値 (定数ならまだ命令を出さずに値を持っておき、定数どうしの計算はその場で済ませる)
+typedef struct {
+    int is_const;
+    double complex c;
+    int reg;
+} ExprValue;
+
+typedef struct {
+    const char *text;       // 式全体 (エラー表示用)
+    const char *p;          // 読んでいる位置
+    ExprProgram *prog;
+    unsigned int used;      // 使用中のレジスタ (ビットごと)
+    char *error;
+    size_t error_size;
+    int failed;
+} ExprParser;
+
+static const struct {
+    const char *name;
+    int op;
+    int n_args;
+} expr_functions[] = {
+    {"exp", EXPR_OP_EXP, 1},   {"log", EXPR_OP_LOG, 1},   {"sqrt", EXPR_OP_SQRT, 1},
+    {"sin", EXPR_OP_SIN, 1},   {"cos", EXPR_OP_COS, 1},   {"tan", EXPR_OP_TAN, 1},
+    {"sinh", EXPR_OP_SINH, 1}, {"cosh", EXPR_OP_COSH, 1}, {"tanh", EXPR_OP_TANH, 1},
+    {"conj", EXPR_OP_CONJ, 1}, {"abs", EXPR_OP_ABS, 1},   {"pow", EXPR_OP_POW, 2},
+};
+
+static inline void expr_fail(ExprParser *ps, const char *message) {
+    if (!ps->failed) {
+        snprintf(ps->error, ps->error_size, "%s (%d文字目)", message, (int) (ps->p - ps->text) + 1);
+        ps->failed = 1;
+    }
+}
+
+static inline void expr_skip_space(ExprParser *ps) {
+    while (isspace((unsigned char) *ps->p)) {
+        ps->p++;
+    }
+}
+
+// 空いているレジスタを確保する (レジスタ0は z 専用)
+static inline int expr_alloc_reg(ExprParser *ps) {
+    for (int r = 1; r < EXPR_MAX_REGS; r++) {
+        if (!(ps->used & (1u << r))) {
+            ps->used |= 1u << r;
+            if (r + 1 > ps->prog->n_regs) {
+                ps->prog->n_regs = r + 1;
+            }
+            return r;
+        }
+    }
+    expr_fail(ps, "式が複雑すぎます");
+    return 0;
+}
+
+static inline void expr_free_value(ExprParser *ps, ExprValue v) {
+    if (!v.is_const && v.reg != 0) {
+        ps->used &= ~(1u << v.reg);
+    }
+}
+
+static inline void expr_emit(ExprParser *ps, int op, int dst, int a, int b, int n) {
+    ExprProgram *prog = ps->prog;
+    if (prog->n_code >= EXPR_MAX_CODE) {
+        expr_fail(ps, "式が長すぎます");
+        return;
+    }
+    ExprInstr *ins = &prog->code[prog->n_code++];
+    ins->op = op;
+    ins->dst = dst;
+    ins->a = a;
+    ins->b = b;
+    ins->n = n;
+}
+
+// 値をレジスタに入れる (定数なら読み込む命令を出す)
+static inline int expr_to_reg(ExprParser *ps, ExprValue *v) {
+    if (v->is_const) {
+        ExprProgram *prog = ps->prog;
+        if (prog->n_consts >= EXPR_MAX_CONSTS) {
+            expr_fail(ps, "定数が多すぎます");
+            return 0;
+        }
+        prog->consts[prog->n_consts] = v->c;
+        v->is_const = 0;
+        v->reg = expr_alloc_reg(ps);
+        expr_emit(ps, EXPR_OP_CONST, v->reg, 0, 0, prog->n_consts++);
+    }
+    return v->reg;
+}
+
+static inline ExprValue expr_const(double complex c) {
+    ExprValue v = {1, c, 0};
+    return v;
+}
+
+// 1引数の演算
+static inline ExprValue expr_unary(ExprParser *ps, int op, ExprValue a, int n) {
+    if (a.is_const) {
+        return expr_const(expr_apply(op, a.c, 0, n));
+    }
+    expr_free_value(ps, a);
+    ExprValue v = {0, 0, expr_alloc_reg(ps)};
+    expr_emit(ps, op, v.reg, a.reg, a.reg, n);
+    return v;
+}
+
+// 2引数の演算
+static inline ExprValue expr_binary(ExprParser *ps, int op, ExprValue a, ExprValue b) {
+    if (a.is_const && b.is_const) {
+        return expr_const(expr_apply(op, a.c, b.c, 0));
+    }
+    // 指数が小さな整数の定数なら掛け算の繰り返しにする (z^2 などを正確に計算するため)
+    if (op == EXPR_OP_POW && b.is_const && cimag(b.c) == 0 && creal(b.c) == rint(creal(b.c)) &&
+        fabs(creal(b.c)) <= 64) {
+        return expr_unary(ps, EXPR_OP_POWI, a, (int) creal(b.c));
+    }
+    int ra = expr_to_reg(ps, &a);
+    int rb = expr_to_reg(ps, &b);
+    expr_free_value(ps, a);
+    expr_free_value(ps, b);
+    ExprValue v = {0, 0, expr_alloc_reg(ps)};
+    expr_emit(ps, op, v.reg, ra, rb, 0);
+    return v;
+}
+
+static inline ExprValue expr_parse_sum(ExprParser *ps);
+static inline ExprValue expr_parse_unary(ExprParser *ps);
+
+// 数値、z、定数、関数呼び出し、括弧
+static inline ExprValue expr_parse_primary(ExprParser *ps) {
+    expr_skip_space(ps);
+    const char *start = ps->p;
+
+    if (isdigit((unsigned char) *ps->p) || *ps->p == '.') {
+        char *end;
+        double x = strtod(ps->p, &end);
+        if (end == ps->p) {
+            expr_fail(ps, "数値が読めません");
+            return expr_const(0);
+        }
+        ps->p = end;
+        return expr_const(x);
+    }
+
+    if (*ps->p == '(') {
+        ps->p++;
+        ExprValue v = expr_parse_sum(ps);
+        expr_skip_space(ps);
+        if (*ps->p != ')') {
+            expr_fail(ps, "')' がありません");
+            return v;
+        }
+        ps->p++;
+        return v;
+    }
+
+    if (isalpha((unsigned char) *ps->p)) {
+        while (isalnum((unsigned char) *ps->p) || *ps->p == '_') {
+            ps->p++;
+        }
+        size_t len = ps->p - start;
+        if (len == 1 && start[0] == 'z') {
+            ExprValue v = {0, 0, 0};
+            return v;
+        }
+        if (len == 1 && start[0] == 'i') {
+            return expr_const(I);
+        }
+        if (len == 1 && start[0] == 'e') {
+            return expr_const(exp(1.0));
+        }
+        if (len == 2 && strncmp(start, "pi", 2) == 0) {
+            return expr_const(SIMD_PI);
+        }
+
+        for (size_t k = 0; k < sizeof(expr_functions) / sizeof(expr_functions[0]); k++) {
+            if (strlen(expr_functions[k].name) != len || strncmp(expr_functions[k].name, start, len) != 0) {
+                continue;
+            }
+            expr_skip_space(ps);
+            if (*ps->p != '(') {
+                expr_fail(ps, "関数の後に '(' がありません");
+                return expr_const(0);
+            }
+            ps->p++;
+            ExprValue a = expr_parse_sum(ps);
+            ExprValue b = expr_const(0);
+            if (expr_functions[k].n_args == 2) {
+                expr_skip_space(ps);
+                if (*ps->p != ',') {
+                    expr_fail(ps, "引数が足りません");
+                    return a;
+                }
+                ps->p++;
+                b = expr_parse_sum(ps);
+            }
+            expr_skip_space(ps);
+            if (*ps->p != ')') {
+                expr_fail(ps, "')' がありません");
+                return a;
+            }
+            ps->p++;
+            if (expr_functions[k].n_args == 2) {
+                return expr_binary(ps, expr_functions[k].op, a, b);
+            }
+            return expr_unary(ps, expr_functions[k].op, a, 0);
+        }
+        ps->p = start;
+        expr_fail(ps, "不明な名前です");
+        return expr_const(0);
+    }
+
+    expr_fail(ps, *ps->p ? "予期しない文字です" : "式が途中で終わっています");
+    return expr_const(0);
+}
+
+// a ^ b (右結合、-z^2 は -(z^2))
+static inline ExprValue expr_parse_power(ExprParser *ps) {
+    ExprValue a = expr_parse_primary(ps);
+    expr_skip_space(ps);
+    if (*ps->p == '^') {
+        ps->p++;
+        ExprValue b = expr_parse_unary(ps);
+        return expr_binary(ps, EXPR_OP_POW, a, b);
+    }
+    return a;
+}
+
+static inline ExprValue expr_parse_unary(ExprParser *ps) {
+    expr_skip_space(ps);
+    if (*ps->p == '-') {
+        ps->p++;
+        return expr_unary(ps, EXPR_OP_NEG, expr_parse_unary(ps), 0);
+    }
+    if (*ps->p == '+') {
+        ps->p++;
+        return expr_parse_unary(ps);
+    }
+    return expr_parse_power(ps);
+}
+
+// 掛け算と割り算
+// 項の直後に名前か括弧が続けば、項の種類 (数値、名前、括弧、関数) によらず掛け算とみなす: 2z, 3i, z z, i z, z(2)
+// 省略した掛け算の右側は累乗までしか読まないので、2z^2 は 2*(z^2)、2 -z は引き算になる
+static inline ExprValue expr_parse_product(ExprParser *ps) {
+    ExprValue a = expr_parse_unary(ps);
+    while (!ps->failed) {
+        expr_skip_space(ps);
+        char c = *ps->p;
+        if (c == '*' || c == '/') {
+            ps->p++;
+            a = expr_binary(ps, c == '*' ? EXPR_OP_MUL : EXPR_OP_DIV, a, expr_parse_unary(ps));
+        } else if (isalpha((unsigned char) c) || c == '(') {
+            a = expr_binary(ps, EXPR_OP_MUL, a, expr_parse_power(ps));
+        } else {
+            break;
+        }
+    }
+    return a;
+}
+
+static inline ExprValue expr_parse_sum(ExprParser *ps) {
+    ExprValue a = expr_parse_product(ps);
+    while (!ps->failed) {
+        expr_skip_space(ps);
+        char c = *ps->p;
+        if (c != '+' && c != '-') {
+            break;
+        }
+        ps->p++;
+        a = expr_binary(ps, c == '+' ? EXPR_OP_ADD : EXPR_OP_SUB, a, expr_parse_product(ps));
+    }
+    return a;
+}
+
+// 式をコンパイルする
+// 成功すれば0、式が正しくなければerrorに理由を入れて-1を返す
+static inline int expr_compile(ExprProgram *prog, const char *text, char *error, size_t error_size) {
+    ExprParser ps = {text, text, prog, 1u, error, error_size, 0};
+    memset(prog, 0, sizeof(*prog));
+    prog->n_regs = 1;
+
+    ExprValue v = expr_parse_sum(&ps);
+    expr_skip_space(&ps);
+    if (!ps.failed && *ps.p != '\0') {
+        expr_fail(&ps, "式の後ろに余分な文字があります");
+    }
+    prog->result = expr_to_reg(&ps, &v);
+    return ps.failed ? -1 : 0;
+}
+
+// --- 実行 ---
+
+// 1点だけ計算する (SIMDを使わないとき)
+static inline double complex expr_eval(const ExprProgram *prog, double complex z) {
+    double complex reg[EXPR_MAX_REGS];
+    reg[0] = z;
+    for (int pc = 0; pc < prog->n_code; pc++) {
+        const ExprInstr *ins = &prog->code[pc];
+        if (ins->op == EXPR_OP_CONST) {
+            reg[ins->dst] = prog->consts[ins->n];
+        } else {
+            reg[ins->dst] = expr_apply(ins->op, reg[ins->a], reg[ins->b], ins->n);
+        }
+    }
+    return reg[prog->result];
+}
+
+// --- 自動微分 ---
+// 各レジスタに値 a と微分 da = da/dz の組 (二重数) を持たせ、命令ごとに連鎖律で微分を伝える。
+// f と f' が1回の計算で求まり、exp のように f' が f の値を使える命令では計算も共有する。
+// conj と abs は正則でないので、∂/∂z (ウィルティンガー微分) の z の項だけを伝える。
+
+// 1つの命令の値と微分
+static inline double complex expr_apply_dual(int op, double complex a, double complex da,
+                                             double complex b, double complex db, int n, double complex *d) {
+    double complex f, p;
+    switch (op) {
+        case EXPR_OP_ADD:  *d = da + db; return a + b;
+        case EXPR_OP_SUB:  *d = da - db; return a - b;
+        case EXPR_OP_MUL:  *d = da * b + a * db; return a * b;
+        case EXPR_OP_DIV:  f = a / b; *d = (da - f * db) / b; return f;
+        case EXPR_OP_POW:
+            if (a == 0) {
+                *d = 0;
+                return 0;
+            }
+            f = cexp(b * clog(a));
+            *d = f * (db * clog(a) + b * da / a);
+            return f;
+        case EXPR_OP_POWI:
+            if (n == 0) {
+                *d = 0;
+                return 1;
+            }
+            p = expr_powi(a, n - 1);
+            *d = n * p * da;
+            return p * a;
+        case EXPR_OP_NEG:  *d = -da; return -a;
+        case EXPR_OP_EXP:  f = cexp(a); *d = f * da; return f;
+        case EXPR_OP_LOG:  *d = da / a; return clog(a);
+        case EXPR_OP_SQRT: f = csqrt(a); *d = da / (2 * f); return f;
+        case EXPR_OP_SIN:  *d = ccos(a) * da; return csin(a);
+        case EXPR_OP_COS:  *d = -csin(a) * da; return ccos(a);
+        case EXPR_OP_TAN:  f = ctan(a); *d = (1 + f * f) * da; return f;
+        case EXPR_OP_SINH: *d = ccosh(a) * da; return csinh(a);
+        case EXPR_OP_COSH: *d = csinh(a) * da; return ccosh(a);
+        case EXPR_OP_TANH: f = ctanh(a); *d = (1 - f * f) * da; return f;
+        case EXPR_OP_CONJ: *d = 0; return conj(a);
+        case EXPR_OP_ABS:
+            f = cabs(a);
+            *d = f == 0 ? 0 : conj(a) / (2 * f) * da;
+            return f;
+        default:           *d = da; return a;
+    }
+}
+
+// 1点の f(z) と f'(z) を計算する (SIMDを使わないとき)
+static inline double complex expr_eval_dual(const ExprProgram *prog, double complex z, double complex *df) {
+    double complex reg[EXPR_MAX_REGS], der[EXPR_MAX_REGS];
+    reg[0] = z;
+    der[0] = 1;
+    for (int pc = 0; pc < prog->n_code; pc++) {
+        const ExprInstr *ins = &prog->code[pc];
+        if (ins->op == EXPR_OP_CONST) {
+            reg[ins->dst] = prog->consts[ins->n];
+            der[ins->dst] = 0;
+        } else {
+            reg[ins->dst] = expr_apply_dual(ins->op, reg[ins->a], der[ins->a], reg[ins->b], der[ins->b],
+                                            ins->n, &der[ins->dst]);
+        }
+    }
+    *df = der[prog->result];
+    return reg[prog->result];
+}
+
+// --- ブロック単位のSIMD実行 ---
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi" // simd_complex.h と同じ
+
+SIMD_INLINE simd_vc expr_powi_vec(simd_vc a, int n) {
+    simd_vc r = sc_make((simd_vd) {} + 1.0, (simd_vd) {}), p = a;
+    for (int k = n < 0 ? -n : n; k > 0; k >>= 1) {
+        if (k & 1) {
+            r = sc_mul(r, p);
+        }
+        p = sc_mul(p, p);
+    }
+    return n < 0 ? sc_div(sc_make((simd_vd) {} + 1.0, (simd_vd) {}), r) : r;
+}
+
+// 1つの命令を8ピクセル分計算する
+// dがNULLでなければ、引数の微分 da, db から結果の微分も計算して*dに入れる
+SIMD_INLINE simd_vc expr_apply_vec(int op, simd_vc a, simd_vc b, int n,
+                                   simd_vc da, simd_vc db, simd_vc *d) {
+    simd_vd zero = {};
+    simd_vc one = sc_make(zero + 1.0, zero);
+    simd_vc f, s, c, ep, em, lg;
+    switch (op) {
+        case EXPR_OP_ADD:
+            if (d) *d = sc_add(da, db);
+            return sc_add(a, b);
+        case EXPR_OP_SUB:
+            if (d) *d = sc_sub(da, db);
+            return sc_sub(a, b);
+        case EXPR_OP_MUL:
+            if (d) *d = sc_add(sc_mul(da, b), sc_mul(a, db));
+            return sc_mul(a, b);
+        case EXPR_OP_DIV:
+            f = sc_div(a, b);
+            if (d) *d = sc_div(sc_sub(da, sc_mul(f, db)), b);
+            return f;
+        case EXPR_OP_POW: {
+            simd_vl at_zero = sc_abs2(a) == 0.0;
+            lg = sc_log(a);
+            f = sc_select(at_zero, sc_make(zero, zero), sc_exp(sc_mul(b, lg)));
+            if (d) {
+                *d = sc_mul(f, sc_add(sc_mul(db, lg), sc_div(sc_mul(b, da), a)));
+                *d = sc_select(at_zero, sc_make(zero, zero), *d);
+            }
+            return f;
+        }
+        case EXPR_OP_POWI:
+            if (!d) {
+                return expr_powi_vec(a, n);
+            }
+            if (n == 0) {
+                *d = sc_make(zero, zero);
+                return one;
+            }
+            s = expr_powi_vec(a, n - 1);
+            *d = sc_mul(sc_scale(s, n), da);
+            return sc_mul(s, a);
+        case EXPR_OP_NEG:
+            if (d) *d = sc_make(-da.re, -da.im);
+            return sc_make(-a.re, -a.im);
+        case EXPR_OP_EXP:
+            f = sc_exp(a);
+            if (d) *d = sc_mul(f, da);
+            return f;
+        case EXPR_OP_LOG:
+            if (d) *d = sc_div(da, a);
+            return sc_log(a);
+        case EXPR_OP_SQRT:
+            f = sc_sqrt(a);
+            if (d) *d = sc_div(da, sc_scale(f, 2.0));
+            return f;
+        case EXPR_OP_SIN:
+            sc_sincos(a, &s, &c);
+            if (d) *d = sc_mul(c, da);
+            return s;
+        case EXPR_OP_COS:
+            sc_sincos(a, &s, &c);
+            if (d) *d = sc_mul(sc_make(-s.re, -s.im), da);
+            return c;
+        case EXPR_OP_TAN:
+            // tan(z) = -i tanh(iz)
+            s = sc_tanh(sc_make(-a.im, a.re));
+            f = sc_make(s.im, -s.re);
+            if (d) *d = sc_mul(sc_add(one, sc_mul(f, f)), da);
+            return f;
+        case EXPR_OP_SINH:
+        case EXPR_OP_COSH:
+            ep = sc_exp(a);
+            em = sc_exp(sc_make(-a.re, -a.im));
+            s = sc_scale(sc_sub(ep, em), 0.5);
+            c = sc_scale(sc_add(ep, em), 0.5);
+            if (d) *d = sc_mul(op == EXPR_OP_SINH ? c : s, da);
+            return op == EXPR_OP_SINH ? s : c;
+        case EXPR_OP_TANH:
+            f = sc_tanh(a);
+            if (d) *d = sc_mul(sc_sub(one, sc_mul(f, f)), da);
+            return f;
+        case EXPR_OP_CONJ:
+            if (d) *d = sc_make(zero, zero);
+            return sc_make(a.re, -a.im);
+        case EXPR_OP_ABS: {
+            simd_vd m = sv_sqrt(sc_abs2(a));
+            if (d) {
+                simd_vd inv = sv_select(m == 0.0, zero, 0.5 / m);
+                *d = sc_mul(sc_make(a.re * inv, -a.im * inv), da);
+            }
+            return sc_make(m, zero);
+        }
+        default:
+            if (d) *d = da;
+            return a;
+    }
+}
+
+// expr_run_body() のレジスタ (値の実部・虚部と f' の実部・虚部) を置くスレッドごとの作業領域
+// 最大で64KBになるので、プールのスレッドのスタックには置かない
+static _Thread_local double expr_scratch[4 * EXPR_MAX_REGS * EXPR_BLOCK];
+
+// n ピクセル (SIMD_LANES の倍数で EXPR_BLOCK 以下) をまとめて計算する
+// 命令ごとに1回だけ振り分け、その中で n ピクセル分をSIMDで計算する
+// dre, dim がNULLでなければ、自動微分で f'(z) も同時に計算する
+SIMD_INLINE void expr_run_body(const ExprProgram *prog, int n, const double *zre, const double *zim,
+                               double *fre, double *fim, double *dre, double *dim) {
+    // レジスタは prog->n_regs 本 x n ピクセル分だけ詰めて使う
+    int size = prog->n_regs * n;
+    double (*re)[n] = (double (*)[n]) expr_scratch;
+    double (*im)[n] = (double (*)[n]) (expr_scratch + size);
+    double (*d_re)[n] = (double (*)[n]) (expr_scratch + 2 * size);
+    double (*d_im)[n] = (double (*)[n]) (expr_scratch + 3 * size);
+    memcpy(re[0], zre, n * sizeof(double));
+    memcpy(im[0], zim, n * sizeof(double));
+    if (dre) {
+        for (int k = 0; k < n; k++) {
+            d_re[0][k] = 1.0; // dz/dz = 1
+            d_im[0][k] = 0.0;
+        }
+    }
+
+    for (int pc = 0; pc < prog->n_code; pc++) {
+        const ExprInstr *ins = &prog->code[pc];
+        int dst = ins->dst, a = ins->a, b = ins->b;
+
+        // 命令ごとに中のループを別々に展開させる
+        #define EXPR_CASE(op)                                                                   \
+            case op:                                                                            \
+                if (dre) {                                                                      \
+                    for (int k = 0; k < n; k += SIMD_LANES) {                                   \
+                        simd_vc d;                                                              \
+                        simd_vc f = expr_apply_vec(op, sc_load(re[a] + k, im[a] + k),           \
+                                                   sc_load(re[b] + k, im[b] + k), ins->n,       \
+                                                   sc_load(d_re[a] + k, d_im[a] + k),           \
+                                                   sc_load(d_re[b] + k, d_im[b] + k), &d);      \
+                        sc_store(re[dst] + k, im[dst] + k, f);                                  \
+                        sc_store(d_re[dst] + k, d_im[dst] + k, d);                              \
+                    }                                                                           \
+                } else {                                                                        \
+                    for (int k = 0; k < n; k += SIMD_LANES) {                                   \
+                        simd_vc f = expr_apply_vec(op, sc_load(re[a] + k, im[a] + k),           \
+                                                   sc_load(re[b] + k, im[b] + k), ins->n,       \
+                                                   sc_make((simd_vd) {}, (simd_vd) {}),         \
+                                                   sc_make((simd_vd) {}, (simd_vd) {}), NULL);  \
+                        sc_store(re[dst] + k, im[dst] + k, f);                                  \
+                    }                                                                           \
+                }                                                                               \
+                break;
+        switch (ins->op) {
+            case EXPR_OP_CONST:
+                for (int k = 0; k < n; k++) {
+                    re[dst][k] = creal(prog->consts[ins->n]);
+                    im[dst][k] = cimag(prog->consts[ins->n]);
+                    d_re[dst][k] = d_im[dst][k] = 0.0;
+                }
+                break;
+            EXPR_CASE(EXPR_OP_ADD)
+            EXPR_CASE(EXPR_OP_SUB)
+            EXPR_CASE(EXPR_OP_MUL)
+            EXPR_CASE(EXPR_OP_DIV)
+            EXPR_CASE(EXPR_OP_POW)
+            EXPR_CASE(EXPR_OP_POWI)
+            EXPR_CASE(EXPR_OP_NEG)
+            EXPR_CASE(EXPR_OP_EXP)
+            EXPR_CASE(EXPR_OP_LOG)
+            EXPR_CASE(EXPR_OP_SQRT)
+            EXPR_CASE(EXPR_OP_SIN)
+            EXPR_CASE(EXPR_OP_COS)
+            EXPR_CASE(EXPR_OP_TAN)
+            EXPR_CASE(EXPR_OP_SINH)
+            EXPR_CASE(EXPR_OP_COSH)
+            EXPR_CASE(EXPR_OP_TANH)
+            EXPR_CASE(EXPR_OP_CONJ)
+            EXPR_CASE(EXPR_OP_ABS)
+        }
+        #undef EXPR_CASE
+    }
+
+    memcpy(fre, re[prog->result], n * sizeof(double));
+    memcpy(fim, im[prog->result], n * sizeof(double));
+    if (dre) {
+        memcpy(dre, d_re[prog->result], n * sizeof(double));
+        memcpy(dim, d_im[prog->result], n * sizeof(double));
+    }
+}
+
+SIMD_DEFINE_KERNEL(expr_run,
+                   (const ExprProgram *prog, int n, const double *zre, const double *zim,
+                    double *fre, double *fim, double *dre, double *dim),
+                   (prog, n, zre, zim, fre, fim, dre, dim))
+
+// n ピクセル分の f(z) を計算する (n は SIMD_LANES の倍数で EXPR_BLOCK 以下)
+// dre, dim がNULLでなければ f'(z) も同時に計算する
+static inline void expr_eval_block(const ExprProgram *prog, int n, const double *zre, const double *zim,
+                                   double *fre, double *fim, double *dre, double *dim) {
+    switch (simd_level()) {
+        case 2:  expr_run_avx512(prog, n, zre, zim, fre, fim, dre, dim); break;
+        case 1:  expr_run_avx2(prog, n, zre, zim, fre, fim, dre, dim); break;
+        default: expr_run_generic(prog, n, zre, zim, fre, fim, dre, dim); break;
+    }
+}
+
+// ニュートン法用に8ピクセル分の f と f' を計算する (simd_block_func として使う)
+static inline void expr_block_func(const void *ctx, const double *zre, const double *zim,
+                                   double *fre, double *fim, double *dre, double *dim) {
+    expr_eval_block(ctx, SIMD_LANES, zre, zim, fre, fim, dre, dim);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
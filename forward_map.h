@@ -0,0 +1,390 @@
+// 順写像 (元画像のピクセルを w = f(z) の位置に書き込む) を並列に行う
+// 複数の元ピクセルが同じ出力ピクセルに写るときは、1ピクセルずつ順に書き込んだときと同じく
+// 番号の一番大きい (最後に書き込まれる) 元ピクセルが残るようにする。
+//   1. 元ピクセルごとの行き先 (target) を並列に求める (呼び出し側)
+//   2. 出力ピクセルごとに、書き込む元ピクセルの番号の最大値 (owner) をアトミックに求める
+//   3. owner が自分の元ピクセルだけがコピーする
+// なので、スレッド数や分け方によらず、結果は1スレッドで順に書き込んだときとビット単位で同じになる。
+//
+// forward_map_enable_splat を呼んでおくと、上書きの代わりに「スプラット」もできる。
+// 元ピクセルの色を行き先の周りの4ピクセルにバイリニアの重みで足し込み (重みの合計も記録する)、
+// 最後に重みで割って色を求める。何も写らなかった穴は、重みつきの画像ピラミッドを縮小しながら平均し (pull)、
+// 粗い段から細かい段へ戻りながら足りない分を埋める (push)。逆写像なしで穴のない画像ができる。
+#ifndef FORWARD_MAP_H
+#define FORWARD_MAP_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <complex.h>
+#include <math.h>
+#include "tile_pool.h"
+#include "viewport.h"
+
+#define FORWARD_MAP_CHUNK 1024 // スレッドに配る元ピクセルの区間の長さ
+#define FORWARD_SPLAT_BITS 8   // スプラットの重みの固定小数点のビット数 (x方向とy方向それぞれ)
+#define FORWARD_SPLAT_LEVELS 6 // 穴埋めのピラミッドの段数 (2^6 = 64ピクセル程度までの穴を埋める)
+
+typedef struct {
+    int width, height;       // 画像サイズ (元画像と出力画像は同じ大きさ)
+    Viewport view;           // 画像と複素平面の範囲の対応 (元画像と出力画像で同じ)
+    int *target;             // 元ピクセルごとの行き先の出力ピクセルの番号 (-1: 範囲外)
+    int *owner;              // 出力ピクセルごとに、最後に書き込む元ピクセルの番号 (-1: まだない)
+    float *splat_x, *splat_y;     // (スプラットのとき) 元ピクセルごとの行き先の座標 (出力画像のピクセル単位)
+    unsigned long long *splat_sum; // (スプラットのとき) 出力ピクセルごとの 色×重み の合計 (チャンネルごと) と重みの合計
+    int splat_channels;
+} ForwardMap;
+
+// 作業用のメモリを確保する。書き込みの記録は空にしておく
+// 成功すれば0、メモリ確保に失敗すれば-1を返す
+static inline int forward_map_init(ForwardMap *map, const Viewport *view) {
+    int width = view->width, height = view->height;
+    size_t n = (size_t) width * height;
+    map->width = width;
+    map->height = height;
+    map->view = *view;
+    map->target = malloc(n * sizeof(int));
+    map->owner = malloc(n * sizeof(int));
+    map->splat_x = map->splat_y = NULL;
+    map->splat_sum = NULL;
+    map->splat_channels = 0;
+    if (!map->target || !map->owner) {
+        free(map->target);
+        free(map->owner);
+        map->target = map->owner = NULL;
+        return -1;
+    }
+    memset(map->owner, 0xff, n * sizeof(int)); // すべて-1
+    return 0;
+}
+
+// スプラット用のバッファを確保する (足し込んだ値は0にしておく)
+// 成功すれば0、メモリ確保に失敗すれば-1を返す
+static inline int forward_map_enable_splat(ForwardMap *map, int channels) {
+    size_t n = (size_t) map->width * map->height;
+    map->splat_x = malloc(n * sizeof(float));
+    map->splat_y = malloc(n * sizeof(float));
+    map->splat_sum = calloc(n * (channels + 1), sizeof(unsigned long long));
+    if (!map->splat_x || !map->splat_y || !map->splat_sum) {
+        free(map->splat_x);
+        free(map->splat_y);
+        free(map->splat_sum);
+        map->splat_x = map->splat_y = NULL;
+        map->splat_sum = NULL;
+        return -1;
+    }
+    map->splat_channels = channels;
+    return 0;
+}
+
+static inline void forward_map_free(ForwardMap *map) {
+    free(map->target);
+    free(map->owner);
+    free(map->splat_x);
+    free(map->splat_y);
+    free(map->splat_sum);
+    map->target = map->owner = NULL;
+    map->splat_x = map->splat_y = NULL;
+    map->splat_sum = NULL;
+}
+
+// 元画像の座標(x, y)に対応する複素数z (行に沿って進むときは viewport_cursor で足し算だけで求める)
+static inline double complex forward_map_point(const ForwardMap *map, int x, int y) {
+    return viewport_point(&map->view, x, y);
+}
+
+// w が写る出力ピクセルの番号 (範囲外なら-1)
+static inline int forward_map_index(const ForwardMap *map, double complex w) {
+    int nx = (int) viewport_pixel_x(&map->view, creal(w));
+    int ny = (int) viewport_pixel_y(&map->view, cimag(w));
+    if (nx >= 0 && nx < map->width && ny >= 0 && ny < map->height) {
+        return ny * map->width + nx;
+    }
+    return -1;
+}
+
+// i 番目の元ピクセルの行き先を w にする (スプラットのときは行き先の座標も記録する)
+static inline void forward_map_set(ForwardMap *map, int i, double complex w) {
+    map->target[i] = forward_map_index(map, w);
+    if (map->splat_x) {
+        map->splat_x[i] = (float) viewport_pixel_x(&map->view, creal(w));
+        map->splat_y[i] = (float) viewport_pixel_y(&map->view, cimag(w));
+    }
+}
+
+// スレッドプールに配る仕事のデータ
+typedef struct {
+    ForwardMap *map;
+    int begin, end;                  // 元ピクセルの番号の範囲
+    const unsigned char *src_img;
+    unsigned char *dest_img;
+    int channels;
+} ForwardMapJob;
+
+// 行き先ごとに、書き込む元ピクセルの番号の最大値を残す
+static inline void forward_map_claim_task(void *ctx, int chunk) {
+    const ForwardMapJob *job = ctx;
+    int begin = job->begin + chunk * FORWARD_MAP_CHUNK;
+    int end = begin + FORWARD_MAP_CHUNK < job->end ? begin + FORWARD_MAP_CHUNK : job->end;
+    for (int i = begin; i < end; i++) {
+        int d = job->map->target[i];
+        if (d < 0) {
+            continue;
+        }
+        int *owner = &job->map->owner[d];
+        int cur = __atomic_load_n(owner, __ATOMIC_RELAXED);
+        while (cur < i && !__atomic_compare_exchange_n(owner, &cur, i, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+    }
+}
+
+// 最後に書き込む元ピクセルだけがコピーする
+static inline void forward_map_copy_task(void *ctx, int chunk) {
+    const ForwardMapJob *job = ctx;
+    int begin = job->begin + chunk * FORWARD_MAP_CHUNK;
+    int end = begin + FORWARD_MAP_CHUNK < job->end ? begin + FORWARD_MAP_CHUNK : job->end;
+    int channels = job->channels;
+    for (int i = begin; i < end; i++) {
+        int d = job->map->target[i];
+        if (d >= 0 && job->map->owner[d] == i) {
+            memcpy(job->dest_img + (long) d * channels, job->src_img + (long) i * channels, channels);
+        }
+    }
+}
+
+// begin 番目から end 番目の手前までの元ピクセルを、target[] の行き先に並列に書き込む
+// (target[] はその範囲だけ求めておけばよい)
+// 範囲を少しずつ進めて何回かに分けて呼んでもよいが、範囲は前回の続きから順に進めること
+// (前の呼び出しで書き込んだ出力ピクセルも、後の元ピクセルが上書きする)
+static inline void forward_map_scatter(ForwardMap *map, int begin, int end,
+                                       const unsigned char *src_img, unsigned char *dest_img, int channels) {
+    ForwardMapJob job = {map, begin, end, src_img, dest_img, channels};
+    int n_chunks = (end - begin + FORWARD_MAP_CHUNK - 1) / FORWARD_MAP_CHUNK;
+    // 全員が書き込みを申し出てから (tile_pool_run は全部終わるまで戻らない) コピーする
+    tile_pool_run(tile_pool_shared(), n_chunks, forward_map_claim_task, &job);
+    tile_pool_run(tile_pool_shared(), n_chunks, forward_map_copy_task, &job);
+}
+
+// --- スプラット (forward_map_enable_splat) ---
+
+// 元ピクセルの色を、行き先の周りの4ピクセルの中心までの距離に応じた重みで足し込む
+// 重みは整数なので、足し込む順番 (スレッドの分け方) によらず合計は同じになる
+static inline void forward_map_splat_task(void *ctx, int chunk) {
+    const ForwardMapJob *job = ctx;
+    ForwardMap *map = job->map;
+    int begin = job->begin + chunk * FORWARD_MAP_CHUNK;
+    int end = begin + FORWARD_MAP_CHUNK < job->end ? begin + FORWARD_MAP_CHUNK : job->end;
+    int channels = job->channels, width = map->width, height = map->height;
+    const int one = 1 << FORWARD_SPLAT_BITS;
+
+    for (int i = begin; i < end; i++) {
+        // ピクセルの中心は +0.5 の位置にあるので、左上の中心からの距離にする
+        float fx = map->splat_x[i] - 0.5f, fy = map->splat_y[i] - 0.5f;
+        if (!(fx > -1.0f && fx < width && fy > -1.0f && fy < height)) { // NaNもはじく
+            continue;
+        }
+        int x0 = (int) floorf(fx), y0 = (int) floorf(fy);
+        int ax = (int) ((fx - x0) * one + 0.5f), ay = (int) ((fy - y0) * one + 0.5f);
+        int wx[2] = {one - ax, ax}, wy[2] = {one - ay, ay};
+        const unsigned char *color = job->src_img + (long) i * channels;
+
+        for (int k = 0; k < 4; k++) {
+            int x = x0 + (k & 1), y = y0 + (k >> 1);
+            unsigned long long weight = (unsigned long long) wx[k & 1] * wy[k >> 1];
+            if (x < 0 || x >= width || y < 0 || y >= height || weight == 0) {
+                continue;
+            }
+            unsigned long long *sum = map->splat_sum + ((long) y * width + x) * (channels + 1);
+            for (int c = 0; c < channels; c++) {
+                __atomic_fetch_add(&sum[c], weight * color[c], __ATOMIC_RELAXED);
+            }
+            __atomic_fetch_add(&sum[channels], weight, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// begin 番目から end 番目の手前までの元ピクセルを、forward_map_set で記録した座標に並列にスプラットする
+static inline void forward_map_splat(ForwardMap *map, int begin, int end, const unsigned char *src_img) {
+    ForwardMapJob job = {map, begin, end, src_img, NULL, map->splat_channels};
+    int n_chunks = (end - begin + FORWARD_MAP_CHUNK - 1) / FORWARD_MAP_CHUNK;
+    tile_pool_run(tile_pool_shared(), n_chunks, forward_map_splat_task, &job);
+}
+
+// ピラミッドの1段 (ピクセルごとに channels 個の色と重み)
+typedef struct {
+    int width, height;
+    float *data;
+} ForwardSplatLevel;
+
+// 段の (x, y) の色 (範囲外は端のピクセル)
+static inline const float *forward_splat_at(const ForwardSplatLevel *level, int channels, int x, int y) {
+    x = x < 0 ? 0 : x >= level->width ? level->width - 1 : x;
+    y = y < 0 ? 0 : y >= level->height ? level->height - 1 : y;
+    return level->data + ((long) y * level->width + x) * (channels + 1);
+}
+
+// 穴埋めの1段分の仕事のデータ (fine と coarse は隣り合う2つの段)
+typedef struct {
+    const ForwardMap *map;
+    ForwardSplatLevel *fine, *coarse;
+    unsigned char *dest_img;
+} ForwardSplatJob;
+
+// 0段目の y 行目: 色は重みで割ったもの、重みは1で打ち切る
+static inline void forward_splat_normalize_task(void *ctx, int y) {
+    const ForwardSplatJob *job = ctx;
+    int channels = job->map->splat_channels, stride = channels + 1;
+    const float full = (float) (1 << (2 * FORWARD_SPLAT_BITS)); // 1ピクセル分の重み
+    long begin = (long) y * job->fine->width;
+    for (long i = begin; i < begin + job->fine->width; i++) {
+        const unsigned long long *sum = job->map->splat_sum + i * stride;
+        float *out = job->fine->data + i * stride;
+        float weight = (float) sum[channels];
+        for (int c = 0; c < channels; c++) {
+            out[c] = weight > 0 ? (float) sum[c] / weight : 0.0f;
+        }
+        out[channels] = weight < full ? weight / full : 1.0f;
+    }
+}
+
+// pull: 細かい段の 2x2 のピクセルを重みつきで平均して、粗い段の y 行目を作る
+static inline void forward_splat_pull_task(void *ctx, int y) {
+    const ForwardSplatJob *job = ctx;
+    const ForwardSplatLevel *fine = job->fine;
+    ForwardSplatLevel *coarse = job->coarse;
+    int channels = job->map->splat_channels, stride = channels + 1;
+    for (int x = 0; x < coarse->width; x++) {
+        float *out = coarse->data + ((long) y * coarse->width + x) * stride;
+        float weight = 0.0f;
+        for (int c = 0; c < channels; c++) {
+            out[c] = 0.0f;
+        }
+        for (int k = 0; k < 4; k++) {
+            int fx = 2 * x + (k & 1), fy = 2 * y + (k >> 1);
+            if (fx >= fine->width || fy >= fine->height) {
+                continue;
+            }
+            const float *in = fine->data + ((long) fy * fine->width + fx) * stride;
+            for (int c = 0; c < channels; c++) {
+                out[c] += in[c] * in[channels];
+            }
+            weight += in[channels];
+        }
+        for (int c = 0; c < channels; c++) {
+            out[c] = weight > 0 ? out[c] / weight : 0.0f;
+        }
+        out[channels] = weight < 1.0f ? weight : 1.0f;
+    }
+}
+
+// push: 細かい段の y 行目で重みが足りない分を、粗い段をバイリニア補間した色で補う
+static inline void forward_splat_push_task(void *ctx, int y) {
+    const ForwardSplatJob *job = ctx;
+    const ForwardSplatLevel *coarse = job->coarse;
+    ForwardSplatLevel *fine = job->fine;
+    int channels = job->map->splat_channels, stride = channels + 1;
+    for (int x = 0; x < fine->width; x++) {
+        float *out = fine->data + ((long) y * fine->width + x) * stride;
+        float w = out[channels];
+        if (w >= 1.0f) {
+            continue;
+        }
+        // 細かい段のピクセルの中心を粗い段の座標にする
+        float cx = (x + 0.5f) * 0.5f - 0.5f, cy = (y + 0.5f) * 0.5f - 0.5f;
+        int x0 = (int) floorf(cx), y0 = (int) floorf(cy);
+        float tx = cx - x0, ty = cy - y0;
+        const float *p00 = forward_splat_at(coarse, channels, x0, y0);
+        const float *p10 = forward_splat_at(coarse, channels, x0 + 1, y0);
+        const float *p01 = forward_splat_at(coarse, channels, x0, y0 + 1);
+        const float *p11 = forward_splat_at(coarse, channels, x0 + 1, y0 + 1);
+        // 粗い段は「色×重み」を補間する (重み0の黒をまぜない)
+        for (int c = 0; c <= channels; c++) {
+            float m00 = c < channels ? p00[c] * p00[channels] : p00[channels];
+            float m10 = c < channels ? p10[c] * p10[channels] : p10[channels];
+            float m01 = c < channels ? p01[c] * p01[channels] : p01[channels];
+            float m11 = c < channels ? p11[c] * p11[channels] : p11[channels];
+            float v = (1 - ty) * ((1 - tx) * m00 + tx * m10) + ty * ((1 - tx) * m01 + tx * m11);
+            if (c < channels) {
+                out[c] = w * out[c] + (1 - w) * v; // ここでは 色×重み (黒の上に重ねた色)
+            } else {
+                out[c] = w + (1 - w) * v;
+            }
+        }
+        // 色×重み から色に戻す
+        for (int c = 0; c < channels; c++) {
+            out[c] = out[channels] > 0 ? out[c] / out[channels] : 0.0f;
+        }
+    }
+}
+
+// 0段目の y 行目を、重みを掛けて (遠い穴ほど黒に近く) 書き込む
+static inline void forward_splat_store_task(void *ctx, int y) {
+    const ForwardSplatJob *job = ctx;
+    int channels = job->map->splat_channels, stride = channels + 1;
+    long begin = (long) y * job->fine->width;
+    for (long i = begin; i < begin + job->fine->width; i++) {
+        const float *in = job->fine->data + i * stride;
+        for (int c = 0; c < channels; c++) {
+            float v = in[c] * in[channels] + 0.5f;
+            job->dest_img[i * channels + c] = v >= 255.0f ? 255 : (unsigned char) v;
+        }
+    }
+}
+
+// 足し込んだ色を重みで割って dest_img に書き込み、穴を埋める
+// 重みが1ピクセル分に満たないところは、粗い段の色で足りない分を補う (push-pull)。
+// FORWARD_SPLAT_LEVELS 段まで粗くしても何も写っていないところは黒になる
+// 各段は行ごとに tile_pool_shared() のスレッドで並列に処理する
+// 成功すれば0、メモリ確保に失敗すれば-1を返す
+static inline int forward_map_resolve_splat(const ForwardMap *map, unsigned char *dest_img) {
+    int channels = map->splat_channels, stride = channels + 1;
+    ForwardSplatLevel levels[FORWARD_SPLAT_LEVELS + 1];
+    int n_levels = 0;
+    int result = 0;
+
+    levels[0].width = map->width;
+    levels[0].height = map->height;
+    levels[0].data = malloc((size_t) map->width * map->height * stride * sizeof(float));
+    if (!levels[0].data) {
+        return -1;
+    }
+    n_levels = 1;
+    ForwardSplatJob job = {map, &levels[0], NULL, dest_img};
+    tile_pool_run(tile_pool_shared(), levels[0].height, forward_splat_normalize_task, &job);
+
+    // pull: 半分の大きさの段を順に作る
+    while (n_levels <= FORWARD_SPLAT_LEVELS && (levels[n_levels - 1].width > 1 || levels[n_levels - 1].height > 1)) {
+        ForwardSplatLevel *fine = &levels[n_levels - 1];
+        ForwardSplatLevel *coarse = &levels[n_levels];
+        coarse->width = (fine->width + 1) / 2;
+        coarse->height = (fine->height + 1) / 2;
+        coarse->data = malloc((size_t) coarse->width * coarse->height * stride * sizeof(float));
+        if (!coarse->data) {
+            result = -1;
+            break;
+        }
+        n_levels++;
+        job.fine = fine;
+        job.coarse = coarse;
+        tile_pool_run(tile_pool_shared(), coarse->height, forward_splat_pull_task, &job);
+    }
+
+    // push: 粗い段から順に、1つ上の段で補う
+    // (一番粗い段で重みが0のところは黒のままにして、そこから遠い穴は黒に近づける)
+    for (int k = n_levels - 2; result == 0 && k >= 0; k--) {
+        job.fine = &levels[k];
+        job.coarse = &levels[k + 1];
+        tile_pool_run(tile_pool_shared(), levels[k].height, forward_splat_push_task, &job);
+    }
+
+    if (result == 0) {
+        job.fine = &levels[0];
+        job.coarse = NULL;
+        tile_pool_run(tile_pool_shared(), levels[0].height, forward_splat_store_task, &job);
+    }
+    for (int k = 0; k < n_levels; k++) {
+        free(levels[k].data);
+    }
+    return result;
+}
+
+#endif
@@ -0,0 +1,457 @@
+// 三角形メッシュによる順写像
+// 元画像の平面を三角形に分け、頂点だけを w = f(z) で写して、写った三角形を出力画像に塗る (ラスタライズ)。
+// 三角形の中のピクセルは、重心座標で元画像の座標を補間してバイリニア補間で色を取るので、穴が空かない。
+// 計算量はピクセルごとに逆関数を解く代わりに、頂点の数 + 出力ピクセル数 で済む。
+//
+// メッシュは四分木で作る。セルの中心で |f'(z)| を調べ、セルの辺が出力で FORWARD_MESH_MAX_EDGE ピクセルより
+// 長く引き伸ばされるなら4分割する。各セルは中心から扇形に三角形に分け、隣の細かいセルの角も頂点に含めるので、
+// 大きさの違うセルの境目にも隙間 (T字の割れ目) ができない。
+// 塗るときは出力画像を FORWARD_MESH_BIN 四方のビンに分け、ビンごとに並列に塗る。
+// 重なった三角形は作った順に上書きするので、結果はスレッド数によらない。
+#ifndef FORWARD_MESH_H
+#define FORWARD_MESH_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <complex.h>
+#include <math.h>
+#include "newton.h"
+#include "tile_pool.h"
+#include "viewport.h"
+
+#define FORWARD_MESH_CELL 16        // 最初のセルの大きさ (元画像のピクセル)
+#define FORWARD_MESH_MAX_EDGE 4.0   // セルの辺を出力でこれ以上 (ピクセル) 引き伸ばさない
+#define FORWARD_MESH_MAX_SPAN 256.0 // これより大きく広がった三角形は枝の切れ目をまたいだものとして塗らない
+#define FORWARD_MESH_BIN 64         // 塗るときのビンの大きさ (出力画像のピクセル)
+
+// 三角形の頂点 (出力画像での位置と、元画像の座標)
+typedef struct {
+    float x, y;
+    float u, v;
+} ForwardMeshVertex;
+
+typedef struct {
+    ForwardMeshVertex v[3];
+} ForwardMeshTriangle;
+
+// 伸びる配列 (行ごとに作って最後につなぐ)
+typedef struct {
+    ForwardMeshTriangle *data;
+    long count, capacity;
+} ForwardMeshList;
+
+typedef struct {
+    complex_func f, df;       // 写像とその導関数
+    Viewport view;            // 画像と複素平面の範囲の対応 (元画像と出力画像で同じ)
+    int width, height;        // 画像サイズ (元画像と出力画像は同じ大きさ)
+    unsigned char *corner;    // 元画像の格子点 (width x height) ごとに、セルの角になっているか
+    ForwardMeshTriangle *triangles;
+    long n_triangles;
+    long n_cells;             // 葉のセルの数
+    int failed;               // メモリ確保に失敗したら1
+} ForwardMesh;
+
+// 元画像のピクセル座標(x, y)に対応する複素数z
+static inline double complex forward_mesh_point(const ForwardMesh *mesh, double x, double y) {
+    return viewport_point(&mesh->view, x, y);
+}
+
+// 元画像のピクセル座標(x, y)の点を写し、出力画像のピクセル座標にした頂点
+static inline ForwardMeshVertex forward_mesh_vertex(const ForwardMesh *mesh, double x, double y) {
+    double complex w = mesh->f(forward_mesh_point(mesh, x, y));
+    ForwardMeshVertex v;
+    v.x = (float) viewport_pixel_x(&mesh->view, creal(w));
+    v.y = (float) viewport_pixel_y(&mesh->view, cimag(w));
+    v.u = (float) x;
+    v.v = (float) y;
+    return v;
+}
+
+static inline int forward_mesh_push(ForwardMeshList *list, const ForwardMeshTriangle *t) {
+    if (list->count == list->capacity) {
+        long capacity = list->capacity ? list->capacity * 2 : 256;
+        ForwardMeshTriangle *data = realloc(list->data, capacity * sizeof(ForwardMeshTriangle));
+        if (!data) {
+            return -1;
+        }
+        list->data = data;
+        list->capacity = capacity;
+    }
+    list->data[list->count++] = *t;
+    return 0;
+}
+
+// --- メッシュを作る ---
+
+// セル [x0, x1] x [y0, y1] (格子点の番号) を分けるかどうか
+// 中心の |f'(z)| から辺が出力で何ピクセルに伸びるかを見積もる。
+// セルの角と中心の写った先が、伸び幅を足しても画面の外なら、分けずに捨てる (-1 を返す)
+static inline int forward_mesh_should_split(const ForwardMesh *mesh, int x0, int y0, int x1, int y1) {
+    double size = x1 - x0 > y1 - y0 ? x1 - x0 : y1 - y0;
+    double complex zc = forward_mesh_point(mesh, 0.5 * (x0 + x1), 0.5 * (y0 + y1));
+    double stretch = cabs(mesh->df(zc)) * size;
+    if (!isfinite(stretch)) {
+        return size > 1;
+    }
+
+    double min_x = INFINITY, max_x = -INFINITY, min_y = INFINITY, max_y = -INFINITY;
+    const int xs[5] = {x0, x1, x0, x1, (x0 + x1) / 2}, ys[5] = {y0, y0, y1, y1, (y0 + y1) / 2};
+    for (int k = 0; k < 5; k++) {
+        ForwardMeshVertex v = forward_mesh_vertex(mesh, xs[k], ys[k]);
+        if (!isfinite(v.x) || !isfinite(v.y)) {
+            return size > 1;
+        }
+        min_x = v.x < min_x ? v.x : min_x;
+        max_x = v.x > max_x ? v.x : max_x;
+        min_y = v.y < min_y ? v.y : min_y;
+        max_y = v.y > max_y ? v.y : max_y;
+    }
+    if (max_x + stretch < 0 || min_x - stretch > mesh->width ||
+        max_y + stretch < 0 || min_y - stretch > mesh->height) {
+        return -1;
+    }
+    return size > 1 && stretch > FORWARD_MESH_MAX_EDGE;
+}
+
+// セルを再帰的に分け、葉のセルの角に印をつけて cells に記録する (x0, y0, x1, y1 の順)
+static inline int forward_mesh_subdivide(ForwardMesh *mesh, int x0, int y0, int x1, int y1, int **cells, long *n_cells,
+                                         long *capacity) {
+    int split = forward_mesh_should_split(mesh, x0, y0, x1, y1);
+    if (split < 0) {
+        return 0;
+    }
+    if (split) {
+        int xm = (x0 + x1) / 2, ym = (y0 + y1) / 2;
+        // 幅か高さが1のときは、長い方だけ分ける
+        int xs[3] = {x0, xm > x0 ? xm : x1, x1}, ys[3] = {y0, ym > y0 ? ym : y1, y1};
+        for (int j = 0; j < 2; j++) {
+            for (int i = 0; i < 2; i++) {
+                if (xs[i] < xs[i + 1] && ys[j] < ys[j + 1] &&
+                    forward_mesh_subdivide(mesh, xs[i], ys[j], xs[i + 1], ys[j + 1], cells, n_cells, capacity) != 0) {
+                    return -1;
+                }
+            }
+        }
+        return 0;
+    }
+
+    if (*n_cells == *capacity) {
+        long new_capacity = *capacity ? *capacity * 2 : 64;
+        int *data = realloc(*cells, new_capacity * 4 * sizeof(int));
+        if (!data) {
+            return -1;
+        }
+        *cells = data;
+        *capacity = new_capacity;
+    }
+    int *c = *cells + *n_cells * 4;
+    c[0] = x0;
+    c[1] = y0;
+    c[2] = x1;
+    c[3] = y1;
+    (*n_cells)++;
+    // 角の印は隣のセルからも立てるので、同じ値を書くだけ
+    __atomic_store_n(&mesh->corner[(long) y0 * mesh->width + x0], 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&mesh->corner[(long) y0 * mesh->width + x1], 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&mesh->corner[(long) y1 * mesh->width + x0], 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&mesh->corner[(long) y1 * mesh->width + x1], 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// 最初のセルの行ごとの作業データ
+typedef struct {
+    ForwardMesh *mesh;
+    int **cells;             // 行ごとの葉のセル
+    long *n_cells;
+    ForwardMeshList *lists;  // 行ごとの三角形
+} ForwardMeshJob;
+
+// 行 row の最初のセルを分ける
+static inline void forward_mesh_subdivide_task(void *ctx, int row) {
+    ForwardMeshJob *job = ctx;
+    ForwardMesh *mesh = job->mesh;
+    int y0 = row * FORWARD_MESH_CELL;
+    int y1 = y0 + FORWARD_MESH_CELL < mesh->height - 1 ? y0 + FORWARD_MESH_CELL : mesh->height - 1;
+    long capacity = 0;
+    for (int x0 = 0; x0 < mesh->width - 1; x0 += FORWARD_MESH_CELL) {
+        int x1 = x0 + FORWARD_MESH_CELL < mesh->width - 1 ? x0 + FORWARD_MESH_CELL : mesh->width - 1;
+        if (forward_mesh_subdivide(mesh, x0, y0, x1, y1, &job->cells[row], &job->n_cells[row], &capacity) != 0) {
+            mesh->failed = 1;
+            return;
+        }
+    }
+}
+
+// 行 row の葉のセルを、周りの印のついた格子点と中心を頂点にして扇形の三角形に分ける
+static inline void forward_mesh_triangulate_task(void *ctx, int row) {
+    ForwardMeshJob *job = ctx;
+    ForwardMesh *mesh = job->mesh;
+    ForwardMeshList *list = &job->lists[row];
+    for (long k = 0; k < job->n_cells[row]; k++) {
+        const int *c = job->cells[row] + k * 4;
+        int x0 = c[0], y0 = c[1], x1 = c[2], y1 = c[3];
+        ForwardMeshTriangle t;
+        t.v[0] = forward_mesh_vertex(mesh, 0.5 * (x0 + x1), 0.5 * (y0 + y1));
+
+        // 辺の上の頂点を時計回りにたどる (上辺 → 右辺 → 下辺 → 左辺)
+        int n = 2 * (x1 - x0) + 2 * (y1 - y0);
+        t.v[1] = forward_mesh_vertex(mesh, x0, y0);
+        for (int s = 1; s <= n; s++) {
+            int x, y;
+            if (s <= x1 - x0) {
+                x = x0 + s, y = y0;
+            } else if (s <= (x1 - x0) + (y1 - y0)) {
+                x = x1, y = y0 + (s - (x1 - x0));
+            } else if (s <= 2 * (x1 - x0) + (y1 - y0)) {
+                x = x1 - (s - (x1 - x0) - (y1 - y0)), y = y1;
+            } else {
+                x = x0, y = y1 - (s - 2 * (x1 - x0) - (y1 - y0));
+            }
+            if (!mesh->corner[(long) y * mesh->width + x]) {
+                continue;
+            }
+            t.v[2] = forward_mesh_vertex(mesh, x, y);
+            if (forward_mesh_push(list, &t) != 0) {
+                mesh->failed = 1;
+                return;
+            }
+            t.v[1] = t.v[2];
+        }
+    }
+}
+
+// f と f' で三角形メッシュを作る (元画像と出力画像の大きさ・複素平面の範囲は同じ)
+// 成功すれば0、メモリ確保に失敗すれば-1を返す
+static inline int forward_mesh_build(ForwardMesh *mesh, complex_func f, complex_func df, const Viewport *view) {
+    int width = view->width, height = view->height;
+    mesh->f = f;
+    mesh->df = df;
+    mesh->view = *view;
+    mesh->width = width;
+    mesh->height = height;
+    mesh->triangles = NULL;
+    mesh->n_triangles = 0;
+    mesh->n_cells = 0;
+    mesh->failed = 0;
+    if (width < 2 || height < 2) {
+        mesh->corner = NULL;
+        return 0;
+    }
+
+    int rows = (height - 1 + FORWARD_MESH_CELL - 1) / FORWARD_MESH_CELL;
+    mesh->corner = calloc((size_t) width * height, 1);
+    ForwardMeshJob job = {mesh, calloc(rows, sizeof(int *)), calloc(rows, sizeof(long)),
+                          calloc(rows, sizeof(ForwardMeshList))};
+    if (!mesh->corner || !job.cells || !job.n_cells || !job.lists) {
+        mesh->failed = 1;
+    } else {
+        // 角の印がすべてついてから三角形に分ける
+        tile_pool_run(tile_pool_shared(), rows, forward_mesh_subdivide_task, &job);
+        if (!mesh->failed) {
+            tile_pool_run(tile_pool_shared(), rows, forward_mesh_triangulate_task, &job);
+        }
+    }
+
+    // 行の順につなぐ
+    if (!mesh->failed) {
+        long total = 0;
+        for (int r = 0; r < rows; r++) {
+            total += job.lists[r].count;
+            mesh->n_cells += job.n_cells[r];
+        }
+        mesh->triangles = malloc((total > 0 ? total : 1) * sizeof(ForwardMeshTriangle));
+        if (!mesh->triangles) {
+            mesh->failed = 1;
+        } else {
+            for (int r = 0; r < rows; r++) {
+                if (job.lists[r].count == 0) {
+                    continue;  // 三角形が1つも無い行は data が NULL のまま
+                }
+                memcpy(mesh->triangles + mesh->n_triangles, job.lists[r].data,
+                       job.lists[r].count * sizeof(ForwardMeshTriangle));
+                mesh->n_triangles += job.lists[r].count;
+            }
+        }
+    }
+
+    for (int r = 0; job.cells && job.lists && r < rows; r++) {
+        free(job.cells[r]);
+        free(job.lists[r].data);
+    }
+    free(job.cells);
+    free(job.n_cells);
+    free(job.lists);
+    free(mesh->corner);
+    mesh->corner = NULL;
+    return mesh->failed ? -1 : 0;
+}
+
+static inline void forward_mesh_free(ForwardMesh *mesh) {
+    free(mesh->triangles);
+    mesh->triangles = NULL;
+    mesh->n_triangles = 0;
+}
+
+// --- 塗る ---
+
+// ビンごとの作業データ
+typedef struct {
+    const ForwardMesh *mesh;
+    const unsigned char *src_img;
+    unsigned char *dest_img;
+    int channels;
+    int bins_x;
+    const long *bin_start;   // ビンごとの三角形の番号の並び (bin_tris) の始まり
+    const long *bin_tris;
+} ForwardMeshRaster;
+
+// 三角形の範囲 (出力画像のピクセル、画面の外は切る)。塗らない三角形なら0を返す
+static inline int forward_mesh_bounds(const ForwardMeshTriangle *t, int width, int height,
+                                      int *x0, int *y0, int *x1, int *y1) {
+    float min_x = t->v[0].x, max_x = t->v[0].x, min_y = t->v[0].y, max_y = t->v[0].y;
+    for (int k = 1; k < 3; k++) {
+        min_x = t->v[k].x < min_x ? t->v[k].x : min_x;
+        max_x = t->v[k].x > max_x ? t->v[k].x : max_x;
+        min_y = t->v[k].y < min_y ? t->v[k].y : min_y;
+        max_y = t->v[k].y > max_y ? t->v[k].y : max_y;
+    }
+    // NaNと、広がりすぎた三角形は塗らない
+    if (!(max_x - min_x <= FORWARD_MESH_MAX_SPAN && max_y - min_y <= FORWARD_MESH_MAX_SPAN)) {
+        return 0;
+    }
+    // ピクセルの中心 (+0.5) が入りうる範囲
+    *x0 = (int) ceilf(min_x - 0.5f);
+    *y0 = (int) ceilf(min_y - 0.5f);
+    *x1 = (int) floorf(max_x - 0.5f);
+    *y1 = (int) floorf(max_y - 0.5f);
+    *x0 = *x0 < 0 ? 0 : *x0;
+    *y0 = *y0 < 0 ? 0 : *y0;
+    *x1 = *x1 >= width ? width - 1 : *x1;
+    *y1 = *y1 >= height ? height - 1 : *y1;
+    return *x0 <= *x1 && *y0 <= *y1;
+}
+
+// 元画像の座標(u, v)の色をバイリニア補間で取る (端は端のピクセル)
+static inline void forward_mesh_sample(const unsigned char *src_img, int width, int height, int channels,
+                                       float u, float v, unsigned char *out) {
+    u = u < 0 ? 0 : u > width - 1 ? width - 1 : u;
+    v = v < 0 ? 0 : v > height - 1 ? height - 1 : v;
+    int x = (int) u, y = (int) v;
+    int x2 = x + 1 < width ? x + 1 : x, y2 = y + 1 < height ? y + 1 : y;
+    float tx = u - x, ty = v - y;
+    const unsigned char *p00 = src_img + ((long) y * width + x) * channels;
+    const unsigned char *p10 = src_img + ((long) y * width + x2) * channels;
+    const unsigned char *p01 = src_img + ((long) y2 * width + x) * channels;
+    const unsigned char *p11 = src_img + ((long) y2 * width + x2) * channels;
+    for (int c = 0; c < channels; c++) {
+        float top = p00[c] + (p10[c] - p00[c]) * tx;
+        float bottom = p01[c] + (p11[c] - p01[c]) * tx;
+        out[c] = (unsigned char) (top + (bottom - top) * ty + 0.5f);
+    }
+}
+
+// ビン b に入る三角形を順に塗る
+static inline void forward_mesh_raster_task(void *ctx, int b) {
+    const ForwardMeshRaster *job = ctx;
+    const ForwardMesh *mesh = job->mesh;
+    int width = mesh->width, height = mesh->height;
+    int bx0 = (b % job->bins_x) * FORWARD_MESH_BIN, by0 = (b / job->bins_x) * FORWARD_MESH_BIN;
+    int bx1 = bx0 + FORWARD_MESH_BIN - 1 < width - 1 ? bx0 + FORWARD_MESH_BIN - 1 : width - 1;
+    int by1 = by0 + FORWARD_MESH_BIN - 1 < height - 1 ? by0 + FORWARD_MESH_BIN - 1 : height - 1;
+
+    for (long k = job->bin_start[b]; k < job->bin_start[b + 1]; k++) {
+        const ForwardMeshTriangle *t = &mesh->triangles[job->bin_tris[k]];
+        int x0, y0, x1, y1;
+        if (!forward_mesh_bounds(t, width, height, &x0, &y0, &x1, &y1)) {
+            continue; // ビンに入れるときに調べてあるので、ここには来ない
+        }
+        x0 = x0 < bx0 ? bx0 : x0;
+        y0 = y0 < by0 ? by0 : y0;
+        x1 = x1 > bx1 ? bx1 : x1;
+        y1 = y1 > by1 ? by1 : y1;
+
+        const ForwardMeshVertex *a = &t->v[0], *p = &t->v[1], *q = &t->v[2];
+        float area = (p->x - a->x) * (q->y - a->y) - (p->y - a->y) * (q->x - a->x);
+        if (area == 0.0f) {
+            continue;
+        }
+        float inv_area = 1.0f / area;
+        for (int y = y0; y <= y1; y++) {
+            float cy = y + 0.5f;
+            for (int x = x0; x <= x1; x++) {
+                float cx = x + 0.5f;
+                // 重心座標 (向きによらず、中なら3つとも0以上になる)
+                float l1 = ((cx - a->x) * (q->y - a->y) - (cy - a->y) * (q->x - a->x)) * inv_area;
+                float l2 = ((p->x - a->x) * (cy - a->y) - (p->y - a->y) * (cx - a->x)) * inv_area;
+                float l0 = 1.0f - l1 - l2;
+                if (l0 < 0.0f || l1 < 0.0f || l2 < 0.0f) {
+                    continue;
+                }
+                float u = l0 * a->u + l1 * p->u + l2 * q->u;
+                float v = l0 * a->v + l1 * p->v + l2 * q->v;
+                forward_mesh_sample(job->src_img, width, height, job->channels, u, v,
+                                    job->dest_img + ((long) y * width + x) * job->channels);
+            }
+        }
+    }
+}
+
+// メッシュを dest_img に塗る (三角形が掛からないピクセルはそのまま)
+// 成功すれば0、メモリ確保に失敗すれば-1を返す
+static inline int forward_mesh_render(const ForwardMesh *mesh, const unsigned char *src_img, unsigned char *dest_img,
+                                      int channels) {
+    int bins_x = (mesh->width + FORWARD_MESH_BIN - 1) / FORWARD_MESH_BIN;
+    int bins_y = (mesh->height + FORWARD_MESH_BIN - 1) / FORWARD_MESH_BIN;
+    int n_bins = bins_x * bins_y;
+    long *bin_start = calloc(n_bins + 1, sizeof(long));
+    long *bin_fill = calloc(n_bins, sizeof(long));
+    if (!bin_start || !bin_fill) {
+        free(bin_start);
+        free(bin_fill);
+        return -1;
+    }
+
+    // 三角形をビンに振り分ける (数えてから、作った順に並べる)
+    for (long t = 0; t < mesh->n_triangles; t++) {
+        int x0, y0, x1, y1;
+        if (!forward_mesh_bounds(&mesh->triangles[t], mesh->width, mesh->height, &x0, &y0, &x1, &y1)) {
+            continue;
+        }
+        for (int by = y0 / FORWARD_MESH_BIN; by <= y1 / FORWARD_MESH_BIN; by++) {
+            for (int bx = x0 / FORWARD_MESH_BIN; bx <= x1 / FORWARD_MESH_BIN; bx++) {
+                bin_start[by * bins_x + bx + 1]++;
+            }
+        }
+    }
+    for (int b = 0; b < n_bins; b++) {
+        bin_start[b + 1] += bin_start[b];
+    }
+    long *bin_tris = malloc((bin_start[n_bins] > 0 ? bin_start[n_bins] : 1) * sizeof(long));
+    if (!bin_tris) {
+        free(bin_start);
+        free(bin_fill);
+        return -1;
+    }
+    for (long t = 0; t < mesh->n_triangles; t++) {
+        int x0, y0, x1, y1;
+        if (!forward_mesh_bounds(&mesh->triangles[t], mesh->width, mesh->height, &x0, &y0, &x1, &y1)) {
+            continue;
+        }
+        for (int by = y0 / FORWARD_MESH_BIN; by <= y1 / FORWARD_MESH_BIN; by++) {
+            for (int bx = x0 / FORWARD_MESH_BIN; bx <= x1 / FORWARD_MESH_BIN; bx++) {
+                int b = by * bins_x + bx;
+                bin_tris[bin_start[b] + bin_fill[b]++] = t;
+            }
+        }
+    }
+
+    ForwardMeshRaster job = {mesh, src_img, dest_img, channels, bins_x, bin_start, bin_tris};
+    tile_pool_run(tile_pool_shared(), n_bins, forward_mesh_raster_task, &job);
+
+    free(bin_start);
+    free(bin_fill);
+    free(bin_tris);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,175 @@
+// 行の先頭を64バイトにそろえ、周りに余白 (ガード) を付けた画像
+// 余白には端の外側の色 (端を繰り返す・反対側から回り込む・端で折り返す) を前もって書いておくので、
+// 補間で画像の端から少しはみ出して読んでも、ピクセルごとに範囲を調べずに済む。
+// stbi_load で読んだ画像 (行順、隙間なし) は、読み込んだあとに1回だけこの形にコピーする。
+// 1チャンネルは8ビット (stbi_load)、16ビット (stbi_load_16)、float (stbi_loadf) のどれか。
+#ifndef IMAGE_BUFFER_H
+#define IMAGE_BUFFER_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#define IMAGE_BUFFER_ALIGN 64 // 行の先頭 (0列目のピクセル) をそろえるバイト数
+
+// 画像の外の扱い (余白の埋め方)
+typedef enum {
+    IMAGE_BORDER_CONSTANT, // 画像の外は一定の色 (余白には端のピクセルを繰り返し、外かどうかは読む側で調べる)
+    IMAGE_BORDER_CLAMP,    // 端のピクセルを繰り返す
+    IMAGE_BORDER_WRAP,     // 反対側の端から回り込む (周期的な画像)
+    IMAGE_BORDER_MIRROR,   // 端で折り返す (端のピクセルも繰り返す: ... 1 0 | 0 1 2 ...)
+    IMAGE_BORDER_COUNT
+} ImageBorder;
+
+// 1チャンネルの型
+typedef enum {
+    IMAGE_PIXEL_U8,  // 0〜255
+    IMAGE_PIXEL_U16, // 0〜65535 (16ビットのPNGなど)
+    IMAGE_PIXEL_F32, // float (HDR。0〜1が8ビットの0〜255に当たり、1を超えてもよい)
+    IMAGE_PIXEL_COUNT
+} ImagePixel;
+
+// 1チャンネルのバイト数
+static inline int image_pixel_size(ImagePixel type) {
+    return type == IMAGE_PIXEL_U8 ? 1 : type == IMAGE_PIXEL_U16 ? 2 : 4;
+}
+
+typedef struct {
+    int width, height, channels;
+    ImagePixel type;         // 1チャンネルの型
+    int pixel_bytes;         // 1ピクセルのバイト数 (channels * image_pixel_size(type))
+    int border;              // 上下左右の余白のピクセル数
+    long stride;             // 1行のバイト数 (IMAGE_BUFFER_ALIGN の倍数)
+    unsigned char *pixels;   // (0, 0) のピクセル。(x, y) は pixels + y * stride + x * pixel_bytes
+    unsigned char *buffer;   // 確保した領域の先頭
+} ImageBuffer;
+
+static inline long image_buffer_round_up(long n) {
+    return (n + IMAGE_BUFFER_ALIGN - 1) / IMAGE_BUFFER_ALIGN * IMAGE_BUFFER_ALIGN;
+}
+
+// 1チャンネルが type の width x height の画像を、上下左右に border ピクセルの余白を付けて確保する (中身は0)
+// 成功すれば0、メモリ確保に失敗すれば-1を返す
+static inline int image_buffer_alloc(ImageBuffer *img, int width, int height, int channels, ImagePixel type,
+                                     int border) {
+    int pixel_bytes = channels * image_pixel_size(type);
+    // 左の余白を64バイトの倍数に切り上げて、各行の0列目のピクセルをそろえる
+    long left = image_buffer_round_up((long) border * pixel_bytes);
+    long stride = image_buffer_round_up(left + (long) (width + border) * pixel_bytes);
+    size_t size = (size_t) stride * (height + 2 * border);
+    img->buffer = aligned_alloc(IMAGE_BUFFER_ALIGN, size > 0 ? size : IMAGE_BUFFER_ALIGN);
+    if (!img->buffer) {
+        img->pixels = NULL;
+        return -1;
+    }
+    memset(img->buffer, 0, size);
+    img->width = width;
+    img->height = height;
+    img->channels = channels;
+    img->type = type;
+    img->pixel_bytes = pixel_bytes;
+    img->border = border;
+    img->stride = stride;
+    img->pixels = img->buffer + (long) border * stride + left;
+    return 0;
+}
+
+static inline void image_buffer_free(ImageBuffer *img) {
+    free(img->buffer);
+    img->buffer = img->pixels = NULL;
+}
+
+static inline unsigned char *image_buffer_row(const ImageBuffer *img, int y) {
+    return img->pixels + (long) y * img->stride;
+}
+
+// 画像の外の位置 i (-border <= i < n + border) を、mode に従って画像の中の位置にする
+static inline int image_buffer_border_index(int i, int n, ImageBorder mode) {
+    switch (mode) {
+        case IMAGE_BORDER_WRAP:
+            return ((i % n) + n) % n;
+        case IMAGE_BORDER_MIRROR: {
+            int p = ((i % (2 * n)) + 2 * n) % (2 * n); // 折り返しの周期は 2n
+            return p < n ? p : 2 * n - 1 - p;
+        }
+        default:
+            return i < 0 ? 0 : i >= n ? n - 1 : i;
+    }
+}
+
+// 余白を横は mode_x、縦は mode_y で埋める (画像の中身を書き換えたら呼び直す)
+static inline void image_buffer_fill_border(ImageBuffer *img, ImageBorder mode_x, ImageBorder mode_y) {
+    int w = img->width, h = img->height, px = img->pixel_bytes, b = img->border;
+    if (b == 0 || w == 0 || h == 0) {
+        return;
+    }
+    // 先に各行の左右を埋めてから、上下の行を余白ごと丸ごとコピーする
+    for (int y = 0; y < h; y++) {
+        unsigned char *row = image_buffer_row(img, y);
+        for (int x = -b; x < 0; x++) {
+            memcpy(row + (long) x * px, row + (long) image_buffer_border_index(x, w, mode_x) * px, px);
+        }
+        for (int x = w; x < w + b; x++) {
+            memcpy(row + (long) x * px, row + (long) image_buffer_border_index(x, w, mode_x) * px, px);
+        }
+    }
+    size_t row_bytes = (size_t) (w + 2 * b) * px;
+    for (int y = -b; y < 0; y++) {
+        memcpy(image_buffer_row(img, y) - (long) b * px,
+               image_buffer_row(img, image_buffer_border_index(y, h, mode_y)) - (long) b * px, row_bytes);
+    }
+    for (int y = h; y < h + b; y++) {
+        memcpy(image_buffer_row(img, y) - (long) b * px,
+               image_buffer_row(img, image_buffer_border_index(y, h, mode_y)) - (long) b * px, row_bytes);
+    }
+}
+
+// 行順で隙間なく並んだ画像 (stbi_load, stbi_load_16, stbi_loadf の結果など) を、
+// 余白付きの画像にコピーして余白を mode_x, mode_y で埋める
+// 成功すれば0、メモリ確保に失敗すれば-1を返す
+static inline int image_buffer_load(ImageBuffer *img, const void *src, int width, int height, int channels,
+                                    ImagePixel type, int border, ImageBorder mode_x, ImageBorder mode_y) {
+    if (image_buffer_alloc(img, width, height, channels, type, border) != 0) {
+        return -1;
+    }
+    size_t row_bytes = (size_t) width * img->pixel_bytes;
+    for (int y = 0; y < height; y++) {
+        memcpy(image_buffer_row(img, y), (const unsigned char *) src + y * row_bytes, row_bytes);
+    }
+    image_buffer_fill_border(img, mode_x, mode_y);
+    return 0;
+}
+
+// 名前 (constant, clamp, wrap, mirror) から画像の外の扱いを探す。見つからなければ-1を返す
+static inline int image_border_find(const char *name, ImageBorder *mode) {
+    static const char *names[IMAGE_BORDER_COUNT] = {"constant", "clamp", "wrap", "mirror"};
+    for (int m = 0; m < IMAGE_BORDER_COUNT; m++) {
+        if (strcmp(name, names[m]) == 0) {
+            *mode = (ImageBorder) m;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// "X" または "X,Y" (例: constant,wrap) の形で、横と縦の画像の外の扱いを読む。1つだけなら縦も同じにする
+// 読めなければ-1を返す
+static inline int image_border_parse(const char *arg, ImageBorder *mode_x, ImageBorder *mode_y) {
+    char x[16];
+    const char *comma = strchr(arg, ',');
+    size_t len = comma ? (size_t) (comma - arg) : strlen(arg);
+    if (len >= sizeof(x)) {
+        return -1;
+    }
+    memcpy(x, arg, len);
+    x[len] = '\0';
+    if (image_border_find(x, mode_x) != 0) {
+        return -1;
+    }
+    if (!comma) {
+        *mode_y = *mode_x;
+        return 0;
+    }
+    return image_border_find(comma + 1, mode_y);
+}
+
+#endif
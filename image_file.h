@@ -0,0 +1,139 @@
+// 8ビット・16ビット・float の画像ファイルの読み書き
+// 読むのは stb_image の stbi_load, stbi_load_16, stbi_loadf、書くのは stb_image_write の PNG (8ビット) と
+// Radiance HDR (float)。stb_image_write は16ビットのPNGを書けないので、圧縮だけ stbi_zlib_compress を借りて自分で書く。
+// stb_image.h と stb_image_write.h を実装ごと (STB_IMAGE_IMPLEMENTATION, STB_IMAGE_WRITE_IMPLEMENTATION) 読み込んだ
+// ファイルからインクルードすること
+#ifndef IMAGE_FILE_H
+#define IMAGE_FILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image_buffer.h"
+
+// 名前 (8, 16, float) からチャンネルの型を探す。見つからなければ-1を返す
+static inline int image_pixel_find(const char *name, ImagePixel *type) {
+    static const char *names[IMAGE_PIXEL_COUNT] = {"8", "16", "float"};
+    for (int t = 0; t < IMAGE_PIXEL_COUNT; t++) {
+        if (strcmp(name, names[t]) == 0) {
+            *type = (ImagePixel) t;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// ファイルそのもののチャンネルの型 (HDR なら float、16ビットのPNGなら16ビット、ほかは8ビット)
+static inline ImagePixel image_file_pixel(const char *filename) {
+    if (stbi_is_hdr(filename)) {
+        return IMAGE_PIXEL_F32;
+    }
+    return stbi_is_16_bit(filename) ? IMAGE_PIXEL_U16 : IMAGE_PIXEL_U8;
+}
+
+// 画像を type の型で読む (行順、隙間なし)。型が違えば stb_image が変換する
+// (8ビットから float にするときは stb_image の決まりでガンマ 2.2 を外して 0〜1 にする)
+// 使い終わったら stbi_image_free すること。読めなければNULLを返す
+static inline void *image_file_load(const char *filename, ImagePixel type, int *width, int *height, int *channels) {
+    if (type == IMAGE_PIXEL_F32) {
+        return stbi_loadf(filename, width, height, channels, 0);
+    }
+    if (type == IMAGE_PIXEL_U16) {
+        return stbi_load_16(filename, width, height, channels, 0);
+    }
+    return stbi_load(filename, width, height, channels, 0);
+}
+
+// PNGのチャンクの CRC-32
+static inline unsigned int image_file_crc32(unsigned int crc, const unsigned char *p, size_t n) {
+    crc = ~crc;
+    for (size_t i = 0; i < n; i++) {
+        crc ^= p[i];
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xEDB88320U & (0U - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+static inline void image_file_put32(unsigned char *p, unsigned int v) {
+    p[0] = (unsigned char) (v >> 24);
+    p[1] = (unsigned char) (v >> 16);
+    p[2] = (unsigned char) (v >> 8);
+    p[3] = (unsigned char) v;
+}
+
+// PNGのチャンク (長さ、種類、中身、CRC) を1つ書く
+static inline int image_file_write_chunk(FILE *fp, const char *tag, const unsigned char *data, size_t n) {
+    unsigned char head[8], tail[4];
+    image_file_put32(head, (unsigned int) n);
+    memcpy(head + 4, tag, 4);
+    image_file_put32(tail, image_file_crc32(image_file_crc32(0, head + 4, 4), data, n));
+    return fwrite(head, 1, 8, fp) == 8 && (n == 0 || fwrite(data, 1, n, fp) == n) && fwrite(tail, 1, 4, fp) == 4;
+}
+
+// 16ビットの画像 (行順、隙間なし、ホストのバイト順) を16ビットのPNGで書く
+// 各行は差分をとらずに (フィルタ0) そのまま、PNGの決まりのビッグエンディアンにして圧縮する
+// 書けなければ0を返す (stbi_write_png と同じ)
+static inline int image_file_write_png16(const char *filename, int width, int height, int channels,
+                                         const unsigned short *data) {
+    static const unsigned char color_types[5] = {0, 0, 4, 2, 6}; // グレー, グレー+α, RGB, RGBA
+    size_t row_bytes = (size_t) width * channels * 2;
+    unsigned char *raw = malloc((row_bytes + 1) * height);
+    if (!raw) {
+        return 0;
+    }
+    for (int y = 0; y < height; y++) {
+        unsigned char *r = raw + (row_bytes + 1) * y;
+        const unsigned short *s = data + (size_t) y * width * channels;
+        r[0] = 0;
+        for (size_t k = 0; k < (size_t) width * channels; k++) {
+            r[1 + 2 * k] = (unsigned char) (s[k] >> 8);
+            r[2 + 2 * k] = (unsigned char) s[k];
+        }
+    }
+    int packed_len;
+    unsigned char *packed = stbi_zlib_compress(raw, (int) ((row_bytes + 1) * height), &packed_len, 8);
+    free(raw);
+    if (!packed) {
+        return 0;
+    }
+
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    unsigned char ihdr[13];
+    image_file_put32(ihdr, (unsigned int) width);
+    image_file_put32(ihdr + 4, (unsigned int) height);
+    ihdr[8] = 16;                       // 1チャンネルのビット数
+    ihdr[9] = color_types[channels];
+    ihdr[10] = ihdr[11] = ihdr[12] = 0; // 圧縮・フィルタ・インターレースの方式
+    FILE *fp = fopen(filename, "wb");
+    int ok = fp && fwrite(signature, 1, 8, fp) == 8 && image_file_write_chunk(fp, "IHDR", ihdr, 13) &&
+             image_file_write_chunk(fp, "IDAT", packed, (size_t) packed_len) &&
+             image_file_write_chunk(fp, "IEND", NULL, 0);
+    if (fp && fclose(fp) != 0) {
+        ok = 0;
+    }
+    free(packed);
+    return ok;
+}
+
+// type の型の画像 (行順、隙間なし) を書く。8ビットと16ビットはPNG、float は Radiance HDR
+// (HDR は RGB だけなので、アルファは落とし、グレーは3チャンネルに広げて書かれる)
+// 書けなければ0を返す
+static inline int image_file_write(const char *filename, ImagePixel type, int width, int height, int channels,
+                                   const void *data) {
+    if (type == IMAGE_PIXEL_F32) {
+        return stbi_write_hdr(filename, width, height, channels, data);
+    }
+    if (type == IMAGE_PIXEL_U16) {
+        return image_file_write_png16(filename, width, height, channels, data);
+    }
+    return stbi_write_png(filename, width, height, channels, data, 0);
+}
+
+// type の型で書くときのファイルの拡張子
+static inline const char *image_file_extension(ImagePixel type) {
+    return type == IMAGE_PIXEL_F32 ? "hdr" : "png";
+}
+
+#endif
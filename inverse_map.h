@@ -0,0 +1,1962 @@
+// 逆写像の座標マップ
+// 出力ピクセル(nx, ny)ごとに、元画像のどの座標(sx, sy)を参照するかを保存しておく。
+// マップは (逆関数, 複素平面の範囲, 画像サイズ) だけで決まり画像には依存しないので、
+// 一度作っておけば別の画像や2回目以降の変換はサンプリングだけで済む。
+#ifndef INVERSE_MAP_H
+#define INVERSE_MAP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <complex.h>
+#include <math.h>
+#include <float.h>
+#include <sys/mman.h>
+#include "newton.h"
+#include "simd_float.h"
+#include "tile_pool.h"
+#include "mip_pyramid.h"
+#include "resample_filter.h"
+#include "image_buffer.h"
+#include "viewport.h"
+
+#define INVERSE_MAP_SEGMENT 64 // ニュートン法で行を並列に解くときの区間の幅
+#define INVERSE_MAP_WARM_CELL 4 // 四隅が別々の枝にあるセルは、この大きさまで分けてから隣のピクセルの解から順に解く
+#define INVERSE_MAP_SEAM 1.0f  // 左の解からこれ (元画像のピクセル) より離れた解は、区間の境目で枝が変わったとみなす
+#define INVERSE_SOURCE_TILE 8  // 元画像をタイル状に並べるときのタイルの大きさ
+#define INVERSE_MAP_SAMPLE_CHUNK 256 // タイルを使わずに描くとき、スレッドに配る1行の区間の幅
+#define INVERSE_MAP_MAX_SUPERSAMPLE 8 // 超標本化で1ピクセルに取る点の数の上限 (縦横それぞれ)
+#define INVERSE_MAP_SOURCE_BORDER 3 // 行順の元画像に要る余白 (Lanczos-3 は端から3ピクセル先まで読む)
+
+// 描くときに読む元画像のメモリ上の並べ方
+typedef enum {
+    INVERSE_SOURCE_LINEAR, // stbi_load のまま (行順)
+    INVERSE_SOURCE_TILED,  // 8x8 のタイルごとに連続して並べる
+    INVERSE_SOURCE_MORTON  // 画像全体をモートン順 (Z字) に並べる
+} InverseSourceLayout;
+
+// 元画像の外を読むときの扱い (1つの軸)
+// どの扱いも「周期で回り込む → 折り返す → 範囲に収める」という同じ式で、係数だけを変えて表す
+// (描くときに扱いの種類で分岐しない)
+typedef struct {
+    ImageBorder mode;
+    int size;                 // 元画像の幅または高さ
+    float period, inv_period; // 回り込む周期とその逆数 (回り込まなければどちらも0)
+    float fold;               // この位置で折り返す (折り返さなければ無限大)
+    float lo, hi;             // 最後に収める範囲
+    float draw_lo, draw_hi;   // この範囲の外 (と無限大・NaN) は黒で塗る (黒で塗らない軸は float の最大値まで)
+    int constant;             // 1なら範囲外は黒で塗る
+} InverseMapBorder;
+
+typedef struct {
+    complex_func inv;        // マップの計算に使った逆関数
+    complex_func_dual fdf;   // 設定されていれば (f と f' を同時に計算する関数)、隣のピクセルの解を初期値にしてニュートン法で解く
+    NewtonParams newton;     // ニュートン法の設定
+    SimdFuncKind simd;       // SIMD版があれば8ピクセルずつまとめて計算する
+    int simd_branch;         // SIMD版の解析的な逆関数で使う枝
+    simd_block_func block_func; // 8ピクセルずつ f, f' を計算する関数 (実行時に作った式など)
+    const void *block_ctx;      // block_func に渡すデータ
+    Viewport view;           // 出力画像・元画像と複素平面の範囲の対応 (どちらも同じ)
+    int width, height;       // 画像サイズ
+    float *sx, *sy;          // 出力ピクセルに対応する元画像の座標 (幅16kピクセルでも0.001ピクセル程度の精度)
+    unsigned char *valid;    // 1: 元画像の範囲内, 0: 範囲外 (黒で塗る)
+    int built_rows;          // 先頭から何行目まで計算済みか
+    void *mapping;           // キャッシュファイルをmmapした領域 (NULLならmallocしたメモリ)
+    size_t mapping_size;
+    unsigned short *iterations; // (任意) ピクセルごとのニュートン法の反復回数の合計
+    float *residual;            // (任意) ピクセルごとの最後の残差 |f(z) - w|
+    unsigned char *converged;   // (任意) ピクセルごとにニュートン法が収束したか (解かずに補間したピクセルは1)
+    int adaptive_cell;          // 0より大きければ、この大きさのセルから適応的に分割して計算する
+    double adaptive_tol;        // 補間してよい誤差 (元画像のピクセル単位)
+    double complex *adaptive_corners; // 計算中の帯の上端と下端の格子点の解 (2行分)
+    unsigned char *adaptive_ok;       // 格子点の解が収束したか
+    NewtonStats *adaptive_stats;      // 格子点を解いたときの反復回数と残差
+    long exact_solves;          // 適応的に計算したときに厳密に解いた点の数
+    int tile_size;              // 0より大きければ、描くときにこの大きさのタイルごとに進む
+    int *tile_order;            // モートン順のときのタイル内のピクセルのオフセット (NULLならタイル内も行順)
+    InverseSourceLayout source_layout; // 元画像の並べ方
+    long *source_col, *source_row;     // 元画像の(x, y)のピクセルは source_col[x] + source_row[y] 番目 (行順ならNULL)
+                                       // (画像の外の INVERSE_MAP_SOURCE_BORDER ピクセルまで引ける)
+    long *source_tables;               // source_col と source_row をまとめて確保した領域
+    long source_pixels;                // 並べ替えた元画像のピクセル数 (余白を含む)
+    const MipPyramid *mip;             // 設定されていれば、元画像の代わりにミップマップからトライリニア補間で描く
+    const ResampleKernel *filter;      // 設定されていれば、バイリニアの代わりにこのフィルタ (双3次, Lanczos) で描く
+    int supersample;                   // 1より大きければ、縮んで写るピクセルを最大 supersample x supersample 点で平均する
+    complex_func scale_df;             // 縮小率を求める f' (出力1ピクセルに入る元画像のピクセル数は 1/|f'(z)|)
+    InverseMapBorder border_x, border_y; // 元画像の外を読むときの扱い (横と縦)
+} InverseMap;
+
+// base + offsets[k] 番目 (offsetsがNULLなら base + k 番目) のピクセルを描く関数 (チャンネルの型と数は関数ごとに決まっている)
+typedef void (*inverse_map_span_func)(const InverseMap *map, const ImageBuffer *src, unsigned char *dest_img,
+                                      long base, const int *offsets, long count);
+
+// スレッドプール (tile_pool.h) に配る仕事の共通のデータ
+typedef struct {
+    InverseMap *map;
+    int row_begin, row_end;          // 対象の行 (1行だけのときは row_begin)
+    int n_cols;                      // 1行を何個の仕事に分けたか
+    const ImageBuffer *src;          // 描くときの元画像
+    unsigned char *dest_img;
+    int channels;
+    inverse_map_span_func span;      // 描くときに使う関数 (inverse_map_span_func_for で選ぶ)
+    const double complex *top, *bottom;                // 適応的に計算するときの帯の上端と下端の格子点
+    const unsigned char *top_ok, *bottom_ok;
+    const NewtonStats *top_stats, *bottom_stats;
+    int y0, y1;                                        // 帯の上端と下端の行
+} InverseMapJob;
+
+// 軸の長さが size のとき、mode の扱いの係数を求める
+static inline void inverse_map_border_axis(InverseMapBorder *b, ImageBorder mode, int size) {
+    b->mode = mode;
+    b->size = size;
+    b->period = mode == IMAGE_BORDER_WRAP ? size : mode == IMAGE_BORDER_MIRROR ? 2.0f * size : 0;
+    b->inv_period = b->period > 0 ? 1.0f / b->period : 0;
+    b->fold = mode == IMAGE_BORDER_MIRROR ? 2.0f * size : __builtin_inff();
+    b->constant = mode == IMAGE_BORDER_CONSTANT;
+    // 収めた座標の整数部分が最後の列 (行) を超えないように、上限は size の直前の値にする
+    b->lo = b->constant ? -__builtin_inff() : 0;
+    b->hi = b->constant ? __builtin_inff() : nextafterf((float) size, 0);
+    b->draw_lo = b->constant ? 0 : -FLT_MAX;
+    b->draw_hi = b->constant ? nextafterf((float) size, 0) : FLT_MAX;
+}
+
+// マップのフィールドを、何も設定していない状態 (逆関数 inv で view の範囲、座標はまだない) にする
+// inverse_map_init と map_cache_load の共通部分。InverseMap にフィールドを足したらここで初期化する
+static inline void inverse_map_defaults(InverseMap *map, complex_func inv, const Viewport *view) {
+    static const NewtonParams newton_defaults = NEWTON_DEFAULT_PARAMS;
+    int width = view->width, height = view->height;
+    map->inv = inv;
+    map->fdf = NULL;
+    map->newton = newton_defaults;
+    map->simd = SIMD_FUNC_NONE;
+    map->simd_branch = 0;
+    map->block_func = NULL;
+    map->block_ctx = NULL;
+    map->view = *view;
+    map->width = width;
+    map->height = height;
+    map->sx = map->sy = NULL;
+    map->valid = NULL;
+    map->built_rows = 0;
+    map->mapping = NULL;
+    map->mapping_size = 0;
+    map->iterations = NULL;
+    map->residual = NULL;
+    map->converged = NULL;
+    map->adaptive_cell = 0;
+    map->adaptive_tol = 0;
+    map->adaptive_corners = NULL;
+    map->adaptive_ok = NULL;
+    map->adaptive_stats = NULL;
+    map->exact_solves = 0;
+    map->tile_size = 0;
+    map->tile_order = NULL;
+    map->source_layout = INVERSE_SOURCE_LINEAR;
+    map->source_col = map->source_row = NULL;
+    map->source_tables = NULL;
+    map->source_pixels = (long) width * height;
+    map->mip = NULL;
+    map->filter = NULL;
+    map->supersample = 1;
+    map->scale_df = NULL;
+    inverse_map_border_axis(&map->border_x, IMAGE_BORDER_CONSTANT, width);
+    inverse_map_border_axis(&map->border_y, IMAGE_BORDER_CONSTANT, height);
+}
+
+// マップ用のメモリを確保する (まだ何も計算しない)
+// 成功すれば0、メモリ確保に失敗すれば-1を返す
+static inline int inverse_map_init(InverseMap *map, complex_func inv, const Viewport *view) {
+    size_t n = (size_t) view->width * view->height;
+    inverse_map_defaults(map, inv, view);
+    map->sx = malloc(n * sizeof(float));
+    map->sy = malloc(n * sizeof(float));
+    map->valid = malloc(n);
+
+    if (!map->sx || !map->sy || !map->valid) {
+        free(map->sx);
+        free(map->sy);
+        free(map->valid);
+        map->sx = map->sy = NULL;
+        map->valid = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// 逆関数の代わりに f と f' (fdf で同時に計算する) からニュートン法でマップを計算するようにする
+// 各ピクセルは左か上のピクセルの解を初期値にするので、反復回数が大幅に減り、
+// 隣り合うピクセルで同じ枝 (分岐) の解が選ばれやすくなる
+// paramsがNULLならデフォルトの設定を使う
+static inline void inverse_map_use_newton(InverseMap *map, complex_func_dual fdf, const NewtonParams *params) {
+    NewtonParams defaults = NEWTON_DEFAULT_PARAMS;
+    map->fdf = fdf;
+    map->newton = params ? *params : defaults;
+}
+
+// SIMD版の関数でマップを計算するようにする (simd_complex.h)
+// fdf が設定されていればSIMD版のニュートン法、なければSIMD版の解析的な逆関数を使う
+static inline void inverse_map_use_simd(InverseMap *map, SimdFuncKind kind, int branch) {
+    map->simd = kind;
+    map->simd_branch = branch;
+}
+
+// 8ピクセルずつ f, f' を計算する関数でニュートン法を解くようにする (expr.h の式など)
+// fdf も設定しておくこと (行の修復などでは1ピクセルずつ fdf を使う)
+static inline void inverse_map_use_block_func(InverseMap *map, simd_block_func func, const void *ctx) {
+    map->block_func = func;
+    map->block_ctx = ctx;
+}
+
+// 全ピクセルを解く代わりに、粗い格子の点だけを解いて残りを補間するようにする
+// cell×cell のセルごとに、辺の中点と中心で補間の誤差を調べ、誤差が tol (元画像のピクセル単位) を
+// 超えるセルだけを4分割して解き直す (四分木)。cexp のような滑らかな写像では厳密に解く点がごく一部で済む
+// 成功すれば0、メモリ確保に失敗すれば-1を返す
+static inline int inverse_map_use_adaptive(InverseMap *map, int cell, double tol) {
+    int n_corners = (map->width - 1 + cell - 1) / cell + 2;
+    free(map->adaptive_corners);
+    free(map->adaptive_ok);
+    free(map->adaptive_stats);
+    map->adaptive_corners = malloc(2 * n_corners * sizeof(double complex));
+    map->adaptive_ok = malloc(2 * n_corners);
+    map->adaptive_stats = malloc(2 * n_corners * sizeof(NewtonStats));
+    if (!map->adaptive_corners || !map->adaptive_ok || !map->adaptive_stats) {
+        free(map->adaptive_corners);
+        free(map->adaptive_ok);
+        free(map->adaptive_stats);
+        map->adaptive_corners = NULL;
+        map->adaptive_ok = NULL;
+        map->adaptive_stats = NULL;
+        return -1;
+    }
+    map->adaptive_cell = cell;
+    map->adaptive_tol = tol;
+    return 0;
+}
+
+// 描くときに出力画像を tile×tile のタイルごとに進むようにする (0なら行順に戻す)
+// 強く歪む写像では行順に隣り合う出力ピクセルが元画像の離れた場所を読むので、
+// タイルごとに進めて読む範囲をキャッシュとTLBに収める。mortonが1ならタイルの中もモートン順 (Z字) に進む
+// 成功すれば0、モートン順でtileが2の累乗でないときとメモリ確保に失敗したときは-1を返す
+static inline int inverse_map_use_tiles(InverseMap *map, int tile, int morton) {
+    free(map->tile_order);
+    map->tile_order = NULL;
+    map->tile_size = tile > 0 ? tile : 0;
+    if (tile <= 0 || !morton) {
+        return 0;
+    }
+    if ((tile & (tile - 1)) != 0) {
+        map->tile_size = 0;
+        return -1;
+    }
+    map->tile_order = malloc((size_t) tile * tile * sizeof(int));
+    if (!map->tile_order) {
+        map->tile_size = 0;
+        return -1;
+    }
+    for (int d = 0; d < tile * tile; d++) {
+        // モートン番号の偶数ビットがx、奇数ビットがy
+        int x = 0, y = 0;
+        for (int b = 0; (1 << b) < tile; b++) {
+            x |= ((d >> (2 * b)) & 1) << b;
+            y |= ((d >> (2 * b + 1)) & 1) << b;
+        }
+        map->tile_order[d] = y * map->width + x;
+    }
+    return 0;
+}
+
+// 並べ方の表の画像の外の部分を、画像の外の扱いに従って埋める
+static inline void inverse_map_fill_source_border(InverseMap *map) {
+    const int b = INVERSE_MAP_SOURCE_BORDER;
+    int width = map->width, height = map->height;
+    if (!map->source_col) {
+        return;
+    }
+    for (int x = -b; x < 0; x++) {
+        map->source_col[x] = map->source_col[image_buffer_border_index(x, width, map->border_x.mode)];
+        map->source_col[width - 1 - x] =
+            map->source_col[image_buffer_border_index(width - 1 - x, width, map->border_x.mode)];
+    }
+    for (int y = -b; y < 0; y++) {
+        map->source_row[y] = map->source_row[image_buffer_border_index(y, height, map->border_y.mode)];
+        map->source_row[height - 1 - y] =
+            map->source_row[image_buffer_border_index(height - 1 - y, height, map->border_y.mode)];
+    }
+}
+
+// 描くときに読む元画像を layout の並べ方にする (元画像は inverse_map_layout_source で並べ替えておく)
+// 強く歪む写像では出力の隣り合うピクセルが元画像を縦にも横にも離れて読むので、
+// 2次元で近いピクセルをメモリ上でも近くに置くと、バイリニア補間の4点がキャッシュに乗りやすくなる
+// タイルとモートン順では、画像の幅と高さをそれぞれタイルの大きさ・2の累乗に切り上げた分の余白ができる
+// (表は上下左右に INVERSE_MAP_SOURCE_BORDER ずつ長くして、画像の外の扱いに従って中のピクセルを指しておく)
+// 成功すれば0、メモリ確保に失敗すれば-1を返す
+static inline int inverse_map_use_source_layout(InverseMap *map, InverseSourceLayout layout) {
+    int width = map->width, height = map->height;
+    const int b = INVERSE_MAP_SOURCE_BORDER;
+    free(map->source_tables);
+    map->source_tables = NULL;
+    map->source_col = map->source_row = NULL;
+    map->source_layout = INVERSE_SOURCE_LINEAR;
+    map->source_pixels = (long) width * height;
+    if (layout == INVERSE_SOURCE_LINEAR) {
+        return 0;
+    }
+
+    map->source_tables = malloc(((size_t) width + height + 4 * b) * sizeof(long));
+    if (!map->source_tables) {
+        return -1;
+    }
+    map->source_col = map->source_tables + b;
+    map->source_row = map->source_tables + width + 3 * b;
+
+    if (layout == INVERSE_SOURCE_TILED) {
+        const int t = INVERSE_SOURCE_TILE;
+        long tiles_x = (width + t - 1) / t, tiles_y = (height + t - 1) / t;
+        for (int x = 0; x < width; x++) {
+            map->source_col[x] = (long) (x / t) * t * t + x % t;
+        }
+        for (int y = 0; y < height; y++) {
+            map->source_row[y] = (y / t) * tiles_x * t * t + (long) (y % t) * t;
+        }
+        map->source_pixels = tiles_x * tiles_y * t * t;
+    } else {
+        // 幅と高さを2の累乗 (2^bx, 2^by) に切り上げ、下位の min(bx, by) ビットずつを交互に並べる
+        // 長い方の残りのビットはその上に置く
+        int bx = 0, by = 0;
+        while ((1L << bx) < width) bx++;
+        while ((1L << by) < height) by++;
+        int k = bx < by ? bx : by;
+        for (int x = 0; x < width; x++) {
+            long o = 0;
+            for (int b = 0; b < bx; b++) {
+                o |= (long) ((x >> b) & 1) << (b < k ? 2 * b : b + k);
+            }
+            map->source_col[x] = o;
+        }
+        for (int y = 0; y < height; y++) {
+            long o = 0;
+            for (int b = 0; b < by; b++) {
+                o |= (long) ((y >> b) & 1) << (b < k ? 2 * b + 1 : b + k);
+            }
+            map->source_row[y] = o;
+        }
+        map->source_pixels = 1L << (bx + by);
+    }
+    map->source_layout = layout;
+    inverse_map_fill_source_border(map);
+    return 0;
+}
+
+// 元画像の y 行目を、並べ替えたコピーの各ピクセルの位置に書き込む (inverse_map_layout_source の仕事1つ分)
+static inline void inverse_map_layout_row_task(void *ctx, int y) {
+    const InverseMapJob *job = ctx;
+    const InverseMap *map = job->map;
+    int px = job->src->pixel_bytes;
+    const unsigned char *p = image_buffer_row(job->src, y);
+    for (int x = 0; x < map->width; x++) {
+        memcpy(job->dest_img + (map->source_col[x] + map->source_row[y]) * px, p + (long) x * px, px);
+    }
+}
+
+// 元画像 src を inverse_map_use_source_layout で決めた並べ方にしたコピーを out に作る
+// 行順なら余白と行の幅も src と同じにし、タイルとモートン順なら out は source_pixels ピクセルの1行にする (隙間は0)
+// 使い終わったら image_buffer_free すること。成功すれば0、メモリ確保に失敗すれば-1を返す
+static inline int inverse_map_layout_source(const InverseMap *map, const ImageBuffer *src, ImageBuffer *out) {
+    if (!map->source_col) {
+        if (image_buffer_alloc(out, src->width, src->height, src->channels, src->type, src->border) != 0) {
+            return -1;
+        }
+        memcpy(out->buffer, src->buffer, (size_t) src->stride * (src->height + 2 * src->border));
+        return 0;
+    }
+    if (image_buffer_alloc(out, (int) map->source_pixels, 1, src->channels, src->type, 0) != 0) {
+        return -1;
+    }
+    InverseMapJob job = {.map = (InverseMap *) map, .src = src, .dest_img = out->pixels};
+    tile_pool_run(tile_pool_shared(), map->height, inverse_map_layout_row_task, &job);
+    return 0;
+}
+
+// 描くときに元画像の代わりにミップマップ pyr から読むようにする (NULLなら元に戻す)
+// 出力ピクセルごとに、写像のヤコビアン (元画像と出力画像は同じ範囲・同じ大きさなので dz/dw = 1/f'(z)) から
+// 縮小率を求めて段を選ぶ。正則関数の写像は局所的には回転と拡大縮小だけ (等方的) なので、
+// 縦横で縮小率が違う場合の異方性フィルタは要らず、トライリニア補間で足りる
+// pyr はマップより長く使えるように呼び出し側で持っておくこと (inverse_map_free では解放しない)
+static inline void inverse_map_use_mip(InverseMap *map, const MipPyramid *pyr, complex_func df) {
+    map->mip = pyr;
+    if (pyr) {
+        map->scale_df = df;
+    }
+}
+
+// 描くときの補間フィルタを選ぶ (resample_filter.h。RESAMPLE_BILINEAR ならバイリニアに戻す)
+// 双3次は4x4、Lanczos-3 は6x6 ピクセルを読む。元画像の端からはみ出すところは余白から読む
+// (タイルとモートン順では端のピクセルを繰り返す)
+// ミップマップが設定されていればそちらを使う (超標本化の各点はバイリニアで読むので、超標本化とは一緒に使えない)
+static inline void inverse_map_use_filter(InverseMap *map, ResampleFilter filter) {
+    map->filter = filter == RESAMPLE_BILINEAR ? NULL : resample_kernel(filter);
+}
+
+// 元画像の外を読むときの扱いを、横 (実部) と縦 (虚部) で別々に決める (デフォルトはどちらも IMAGE_BORDER_CONSTANT で黒)
+// cexp のように虚部の方向にだけ周期的な写像では、縦だけ IMAGE_BORDER_WRAP にすると周期の先にも元画像が並ぶ
+// 行順の元画像の余白は同じ扱いで埋めておくこと (image_buffer_load に同じ mode_x, mode_y を渡す)
+static inline void inverse_map_use_border(InverseMap *map, ImageBorder mode_x, ImageBorder mode_y) {
+    inverse_map_border_axis(&map->border_x, mode_x, map->width);
+    inverse_map_border_axis(&map->border_y, mode_y, map->height);
+    inverse_map_fill_source_border(map);
+}
+
+// 描くときに、縮んで写るピクセルだけを複数の点で平均するようにする (超標本化。max_n が1以下なら元に戻す)
+// 点の数はピクセルごとに f' から決める (左右の隣の元画像の座標が1ピクセル以内なら f' は計算せず1点のまま)。
+// 出力1ピクセルが元画像の s = 1/|f'(z)| ピクセルに当たるとき、
+// 縦横それぞれ s 以上の2の累乗 n (1, 2, 4, ... max_n) 個ずつ、n x n 点を取る (1, 4, 16, ... 点)
+// 点は格子を atan(1/2) だけ回した位置 (回転格子) に置き、縦横どちらの線に対しても点の位置がそろわないようにする
+// 各点の元画像の座標は、ピクセルの中心の解から 1/f'(z) (ヤコビアン) で1次近似して求める (ニュートン法は解き直さない)
+// 縮んでいないピクセル (n = 1) は通常のバイリニア補間と同じ色になる。ミップマップが設定されていればそちらを使う
+// f'(z) = 0 のピクセル (1/f'(z) が有限でない) は描き直さない
+// 各点はバイリニアで読むので、inverse_map_use_filter の双3次・Lanczos とは一緒に使わないこと
+static inline void inverse_map_use_supersample(InverseMap *map, int max_n, complex_func df) {
+    int n = 1;
+    while (n < max_n && n < INVERSE_MAP_MAX_SUPERSAMPLE) {
+        n *= 2;
+    }
+    map->supersample = n;
+    if (n > 1) {
+        map->scale_df = df;
+    }
+}
+
+// ピクセルごとの反復回数と残差、収束したかを記録するバッファを確保する (ニュートン法のときだけ記録される)
+// 成功すれば0、メモリ確保に失敗すれば-1を返す
+static inline int inverse_map_enable_stats(InverseMap *map) {
+    size_t n = (size_t) map->width * map->height;
+    map->iterations = calloc(n, sizeof(unsigned short));
+    map->residual = calloc(n, sizeof(float));
+    map->converged = malloc(n);
+    if (!map->iterations || !map->residual || !map->converged) {
+        free(map->iterations);
+        free(map->residual);
+        free(map->converged);
+        map->iterations = NULL;
+        map->residual = NULL;
+        map->converged = NULL;
+        return -1;
+    }
+    memset(map->converged, 1, n);
+    return 0;
+}
+
+static inline void inverse_map_free(InverseMap *map) {
+    if (map->mapping) {
+        // キャッシュから読み込んだマップは読み取り専用なのでmunmapで解放する
+        munmap(map->mapping, map->mapping_size);
+        map->mapping = NULL;
+        map->mapping_size = 0;
+    } else {
+        free(map->sx);
+        free(map->sy);
+        free(map->valid);
+    }
+    free(map->iterations);
+    free(map->residual);
+    free(map->converged);
+    free(map->adaptive_corners);
+    free(map->adaptive_ok);
+    free(map->adaptive_stats);
+    free(map->tile_order);
+    free(map->source_tables);
+    map->sx = map->sy = NULL;
+    map->valid = NULL;
+    map->iterations = NULL;
+    map->residual = NULL;
+    map->converged = NULL;
+    map->adaptive_corners = NULL;
+    map->adaptive_ok = NULL;
+    map->adaptive_stats = NULL;
+    map->tile_order = NULL;
+    map->source_col = map->source_row = NULL;
+    map->source_tables = NULL;
+    map->source_layout = INVERSE_SOURCE_LINEAR;
+    map->mip = NULL;
+    map->filter = NULL;
+    map->supersample = 1;
+    map->scale_df = NULL;
+    map->built_rows = 0;
+}
+
+// 同じ条件で作られたマップなら使い回せる
+static inline int inverse_map_matches(const InverseMap *map, complex_func inv, const Viewport *view) {
+    return map->sx != NULL && map->inv == inv && viewport_equal(&map->view, view);
+}
+
+// 出力座標(nx, ny)に対応する複素数w
+// (行に沿って順に求めるときは、行の先頭から view.scale_re を足していく)
+static inline double complex inverse_map_point(const InverseMap *map, int nx, int ny) {
+    return viewport_point(&map->view, nx, ny);
+}
+
+// 元画像の座標(sx, sy)に対応する複素数z (inverse_map_store の逆)
+static inline double complex inverse_map_source_point(const InverseMap *map, double sx, double sy) {
+    return viewport_point(&map->view, sx, sy);
+}
+
+// 計算した z をマップのi番目に書き込む
+static inline void inverse_map_store(InverseMap *map, long i, double complex z) {
+    int width = map->width, height = map->height;
+
+    // 複素数zを元画像の座標(sx, sy)に変換
+    // (範囲の判定は、丸めで width - 1 ちょうどになることがあるのでfloatにしてから行う)
+    float sx = (float) viewport_pixel_x(&map->view, creal(z));
+    float sy = (float) viewport_pixel_y(&map->view, cimag(z));
+
+    map->sx[i] = sx;
+    map->sy[i] = sy;
+    // 最後の行と列の右下の隣は元画像の余白 (INVERSE_MAP_SOURCE_BORDER) から読む
+    map->valid[i] = (sx >= 0 && sx < width && sy >= 0 && sy < height);
+}
+
+// zが元画像の範囲内にあるか
+static inline int inverse_map_in_source(const InverseMap *map, double complex z) {
+    double sx = viewport_pixel_x(&map->view, creal(z));
+    double sy = viewport_pixel_y(&map->view, cimag(z));
+    return sx >= 0 && sx < map->width && sy >= 0 && sy < map->height;
+}
+
+// 反復回数と残差、収束したかを記録する (記録用のバッファがあるときだけ)
+static inline void inverse_map_store_stats(InverseMap *map, long i, const NewtonStats *stats) {
+    if (map->iterations) {
+        map->iterations[i] = stats->iterations < 65535 ? stats->iterations : 65535;
+        map->residual[i] = (float) stats->residual;
+        map->converged[i] = (unsigned char) stats->converged;
+    }
+}
+
+// 隣のピクセル (マップのseed番目) の解を初期値にして解く
+// 隣の解が元画像の範囲内で、そこから範囲内の解に収束したときだけ1を返す
+// 反復回数はstatsに足し込み、残差と収束したかはstatsに入れる
+static inline int inverse_map_solve_from(const InverseMap *map, long seed, double complex w,
+                                         double complex *z, NewtonStats *stats) {
+    if (!map->valid[seed]) {
+        return 0;
+    }
+    NewtonStats s;
+    *z = inverse_map_source_point(map, map->sx[seed], map->sy[seed]);
+    int converged = newton_solve(map->fdf, &map->newton, w, z, map->newton.warm_iter, &s);
+    stats->iterations += s.iterations;
+    stats->residual = s.residual;
+    stats->converged = s.converged;
+    return converged && inverse_map_in_source(map, *z);
+}
+
+// 出力座標 (nx, ny) (マップの i 番目) の解が、左の範囲内の解から INVERSE_MAP_SEAM ピクセルより離れているか
+// 左の2ピクセルが範囲内なら、その2つから1次式で延ばした位置と比べる
+// (f' が小さくて解が1ピクセルより大きく動くところでも、滑らかにつながっていれば離れているとみなさない)
+static inline int inverse_map_seam(const InverseMap *map, long i, int nx) {
+    if (!map->valid[i - 1]) {
+        return 0;
+    }
+    float px = map->sx[i - 1], py = map->sy[i - 1];
+    if (nx >= 2 && map->valid[i - 2]) {
+        px += map->sx[i - 1] - map->sx[i - 2];
+        py += map->sy[i - 1] - map->sy[i - 2];
+    }
+    float dx = map->sx[i] - px, dy = map->sy[i] - py;
+    return dx * dx + dy * dy > INVERSE_MAP_SEAM * INVERSE_MAP_SEAM;
+}
+
+// 区間の境目をまたいで解をつなぐため、左から右へ進みながら
+// 範囲外のまま残ったピクセルと、左の解から離れた (区間の先頭が別の枝に収束した) ピクセルを左隣の解から解き直す。
+// 解き直した解とその右隣も離れていれば続けて解き直すので、別の枝は区間の終わりまで左隣の枝に直る
+// (1行を左から順に解いたときと同じ枝になる)。最後に、範囲外のまま残ったピクセルだけ右隣の解から解き直す
+static inline void inverse_map_repair_row(InverseMap *map, int ny) {
+    int width = map->width;
+    long row = (long) ny * width;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int k = 1; k < width; k++) {
+            int nx = pass == 0 ? k : width - 1 - k;    // 1回目は左→右、2回目は右→左
+            long seed = row + (pass == 0 ? nx - 1 : nx + 1);
+            double complex z;
+            NewtonStats stats = {0, 0.0, 0};
+
+            if (map->valid[row + nx] && (pass == 1 || !inverse_map_seam(map, row + nx, nx))) {
+                continue;
+            }
+            int ok = inverse_map_solve_from(map, seed, inverse_map_point(map, nx, ny), &z, &stats);
+            if (ok) {
+                inverse_map_store(map, row + nx, z);
+            }
+            // 解き直しにかかった反復回数も記録する
+            if (map->iterations) {
+                stats.iterations += map->iterations[row + nx];
+                if (!ok) {
+                    stats.residual = map->residual[row + nx];
+                    stats.converged = map->converged[row + nx];
+                }
+            }
+            inverse_map_store_stats(map, row + nx, &stats);
+        }
+    }
+}
+
+// 出力座標 (nx, ny) のピクセルを、左のピクセルの解 → 上のピクセルの解 → w そのもの の順に初期値を試して解き、
+// マップに入れる (use_left が0なら左の解は使わない)。stats にはそれまでにかかった反復回数を入れておく
+static inline void inverse_map_solve_pixel(InverseMap *map, int nx, int ny, int use_left, double complex w,
+                                           NewtonStats *stats) {
+    long i = (long) ny * map->width + nx;
+    double complex z;
+    int ok = use_left && inverse_map_solve_from(map, i - 1, w, &z, stats);
+    if (!ok && ny > 0) {
+        ok = inverse_map_solve_from(map, i - map->width, w, &z, stats);
+    }
+    if (!ok) {
+        NewtonStats cold;
+        z = w;
+        newton_solve(map->fdf, &map->newton, w, &z, map->newton.max_iter, &cold);
+        stats->iterations += cold.iterations;
+        stats->residual = cold.residual;
+        stats->converged = cold.converged;
+    }
+    inverse_map_store(map, i, z);
+    inverse_map_store_stats(map, i, stats);
+}
+
+// ニュートン法で job->row_begin 行目の seg 番目の区間を左から順に解く (inverse_map_build_row_newton の仕事1つ分)
+static inline void inverse_map_newton_segment_task(void *ctx, int seg) {
+    const InverseMapJob *job = ctx;
+    InverseMap *map = job->map;
+    int width = map->width, ny = job->row_begin;
+    int x_begin = seg * INVERSE_MAP_SEGMENT;
+    int x_end = x_begin + INVERSE_MAP_SEGMENT < width ? x_begin + INVERSE_MAP_SEGMENT : width;
+    double w_re = viewport_re(&map->view, x_begin), w_im = viewport_im(&map->view, ny);
+
+    for (int nx = x_begin; nx < x_end; nx++, w_re += map->view.scale_re) {
+        NewtonStats stats = {0, 0.0, 0};
+        inverse_map_solve_pixel(map, nx, ny, nx > x_begin, w_re + w_im * I, &stats);
+    }
+}
+
+// ニュートン法で1行分を計算する
+// 行をINVERSE_MAP_SEGMENTごとの区間に分け、区間ごとに並列に左から順に解く。
+// 初期値は 左のピクセルの解 → 上のピクセルの解 → w そのもの の順に試す。
+// 区間の先頭は左隣がまだ解けていないので上の解から始まり、別の枝に収束することがある。
+// それは inverse_map_repair_row で左隣の枝につなぎ直す。区間の幅は固定なので、スレッド数によらず結果は同じになる
+static inline void inverse_map_build_row_newton(InverseMap *map, int ny) {
+    InverseMapJob job = {.map = map, .row_begin = ny};
+    int n_segments = (map->width + INVERSE_MAP_SEGMENT - 1) / INVERSE_MAP_SEGMENT;
+    tile_pool_run(tile_pool_shared(), n_segments, inverse_map_newton_segment_task, &job);
+    inverse_map_repair_row(map, ny);
+}
+
+// SIMD版のニュートン法で1ブロックを解く (NewtonParams.precision に合わせて double か float で解く)
+// float で解けるのは SIMD版の関数 (map->simd) だけで、block_func のときはいつも double で解く
+static inline int inverse_map_simd_lanes(const InverseMap *map) {
+    int use_float = map->newton.precision != NEWTON_PRECISION_DOUBLE &&
+                    map->simd != SIMD_FUNC_NONE && !map->block_func;
+    return use_float ? SIMD_LANES_F : SIMD_LANES;
+}
+
+static inline void inverse_map_newton_block(const InverseMap *map, int max_iter,
+                                            const double *wre, const double *wim, double *zre, double *zim,
+                                            int *iterations, double *residual, int *converged) {
+    if (inverse_map_simd_lanes(map) == SIMD_LANES_F) {
+        simd_newton_block_f(map->simd, &map->newton, max_iter, map->newton.precision == NEWTON_PRECISION_MIXED,
+                            wre, wim, zre, zim, iterations, residual, converged);
+    } else {
+        simd_newton_block(map->simd, map->block_func, map->block_ctx, &map->newton, max_iter,
+                          wre, wim, zre, zim, iterations, residual, converged);
+    }
+}
+
+// SIMD版のニュートン法で job->row_begin 行目の seg 番目の区間を解く (inverse_map_build_row_simd の仕事1つ分)
+static inline void inverse_map_simd_segment_task(void *ctx, int seg) {
+    const InverseMapJob *job = ctx;
+    InverseMap *map = job->map;
+    int width = map->width, ny = job->row_begin;
+    int lanes = inverse_map_simd_lanes(map);
+    long row = (long) ny * width;
+    int x_begin = seg * INVERSE_MAP_SEGMENT;
+    int x_end = x_begin + INVERSE_MAP_SEGMENT < width ? x_begin + INVERSE_MAP_SEGMENT : width;
+    double w_re = viewport_re(&map->view, x_begin), w_im = viewport_im(&map->view, ny);
+
+    for (int x0 = x_begin; x0 < x_end; x0 += lanes) {
+        int n = x_end - x0 < lanes ? x_end - x0 : lanes;
+        double wre[SIMD_LANES_F], wim[SIMD_LANES_F], zre[SIMD_LANES_F], zim[SIMD_LANES_F];
+        double residual[SIMD_LANES_F] = {0};
+        int iterations[SIMD_LANES_F], converged[SIMD_LANES_F];
+        // 残差は記録するときだけ求める (混合精度では残差に f の計算がもう1回要る)
+        double *res = map->residual ? residual : NULL;
+        // ブロックの中の左隣はまだ解けていないので、ブロックの左の2ピクセルの解から1次式で延ばした値を使う
+        // (左の2つ目が範囲外なら、左隣の解をそのまま使う)
+        long left = row + x0 - 1;
+        int use_left = x0 > x_begin && map->valid[left];
+        double complex z_left = 0, dz_left = 0;
+        if (use_left) {
+            z_left = inverse_map_source_point(map, map->sx[left], map->sy[left]);
+            if (x0 - 1 > x_begin && map->valid[left - 1]) {
+                dz_left = z_left - inverse_map_source_point(map, map->sx[left - 1], map->sy[left - 1]);
+            }
+        }
+
+        for (int k = 0; k < lanes; k++) {
+            int nx = x0 + (k < n ? k : n - 1); // 余ったレーンは最後のピクセルを繰り返す
+            long i = row + nx;
+            double complex w = w_re + w_im * I;
+            double complex z = w;
+            if (k < n - 1) {
+                w_re += map->view.scale_re;
+            }
+            if (use_left) {
+                z = z_left + dz_left * (nx - x0 + 1);
+            } else if (ny > 0 && map->valid[i - width]) {
+                z = inverse_map_source_point(map, map->sx[i - width], map->sy[i - width]);
+            }
+            wre[k] = creal(w);
+            wim[k] = cimag(w);
+            zre[k] = creal(z);
+            zim[k] = cimag(z);
+        }
+        w_re += map->view.scale_re; // 次のブロックの先頭
+        inverse_map_newton_block(map, map->newton.warm_iter, wre, wim, zre, zim, iterations, res, converged);
+
+        // 収束しなかったレーンと範囲外に出たレーンは、左から順に1ピクセルずつ
+        // 行ごとの計算と同じ順 (左のピクセル (同じブロックで解けたレーン) → 上 → w) で解き直す
+        for (int k = 0; k < n; k++) {
+            NewtonStats stats = {iterations[k], residual[k], converged[k]};
+            if (converged[k] && inverse_map_in_source(map, zre[k] + zim[k] * I)) {
+                inverse_map_store(map, row + x0 + k, zre[k] + zim[k] * I);
+                inverse_map_store_stats(map, row + x0 + k, &stats);
+            } else {
+                inverse_map_solve_pixel(map, x0 + k, ny, x0 + k > x_begin, wre[k] + wim[k] * I, &stats);
+            }
+        }
+    }
+}
+
+// ニュートン法で1行分をSIMD版で計算する (8ピクセル、floatなら16ピクセルずつレーンごとにマスクをかけて解く)
+// 初期値は行ごとの計算 (inverse_map_build_row_newton) と同じく 左 → 上 → w の順に選ぶ。
+// 各レーンの初期値は ブロックの左の解を延ばした値 → そのピクセルの上の解 → w の順に試し、
+// 収束しなかったレーンと範囲外に出たレーンは1ピクセルずつ 左 → 上 → w の順に解き直す。
+// 最後に同じ inverse_map_repair_row で、左隣と別の枝に収束したレーンを左隣の枝につなぎ直すので、
+// SIMDを使うかどうかで選ばれる枝は変わらない
+static inline void inverse_map_build_row_simd(InverseMap *map, int ny) {
+    InverseMapJob job = {.map = map, .row_begin = ny};
+    int n_segments = (map->width + INVERSE_MAP_SEGMENT - 1) / INVERSE_MAP_SEGMENT;
+    tile_pool_run(tile_pool_shared(), n_segments, inverse_map_simd_segment_task, &job);
+    inverse_map_repair_row(map, ny);
+}
+
+// --- 適応的な計算 (inverse_map_use_adaptive) ---
+
+// 出力座標(nx, ny)の解を1点だけ求める
+// ニュートン法のときは seeds[0], seeds[1], ... を順に初期値にして、元画像の範囲内に収束した最初の解を使う。
+// どれもだめなら w からも解き、それでも範囲外なら、初期値から収束した範囲外の解を使う
+// (行ごとの計算と同じく、範囲内の解を優先する)
+// 収束すれば1を返す (解析的な逆関数はいつも1)
+static inline int inverse_map_solve_point(const InverseMap *map, int nx, int ny, const double complex *seeds,
+                                          int n_seeds, double complex *z, NewtonStats *stats) {
+    double complex w = inverse_map_point(map, nx, ny);
+    double complex fallback = 0;
+    double fallback_residual = 0.0;
+    int has_fallback = 0;
+    int iterations = 0;
+    if (!map->fdf) {
+        *z = map->inv(w);
+        stats->iterations = 0;
+        stats->residual = 0.0;
+        stats->converged = 1;
+        return 1;
+    }
+    for (int k = 0; k < n_seeds; k++) {
+        double complex x = seeds[k];
+        int ok = newton_solve(map->fdf, &map->newton, w, &x, map->newton.warm_iter, stats);
+        iterations += stats->iterations;
+        if (ok && inverse_map_in_source(map, x)) {
+            *z = x;
+            stats->iterations = iterations;
+            return 1;
+        }
+        if (ok && !has_fallback) {
+            fallback = x;
+            fallback_residual = stats->residual;
+            has_fallback = 1;
+        }
+    }
+    *z = w;
+    int ok = newton_solve(map->fdf, &map->newton, w, z, map->newton.max_iter, stats);
+    stats->iterations += iterations;
+    if (has_fallback && !(ok && inverse_map_in_source(map, *z))) {
+        *z = fallback;
+        stats->residual = fallback_residual;
+        stats->converged = 1;
+        return 1;
+    }
+    return ok;
+}
+
+// inverse_map_solve_point を n 点 (inverse_map_simd_lanes(map) 以下) まとめて解く
+// 点 j は出力座標 (xs[j], ys[j]) で、初期値は predicted[j] → shared[0], shared[1], ... の順に試す。
+// SIMD版の関数か block_func があれば、SIMD版のニュートン法 (float の精度の設定も使う) で全点をまとめて解く
+static inline void inverse_map_solve_points(const InverseMap *map, int n, const int *xs, const int *ys,
+                                            const double complex *predicted, const double complex *shared,
+                                            int n_shared, double complex *z, unsigned char *ok,
+                                            NewtonStats *stats) {
+    if (!map->fdf || (map->simd == SIMD_FUNC_NONE && !map->block_func)) {
+        double complex seeds[5];
+        for (int s = 0; s < n_shared; s++) {
+            seeds[s + 1] = shared[s];
+        }
+        for (int j = 0; j < n; j++) {
+            seeds[0] = predicted[j];
+            ok[j] = inverse_map_solve_point(map, xs[j], ys[j], seeds, n_shared + 1, &z[j], &stats[j]);
+        }
+        return;
+    }
+
+    // 各点の状態 (done: 範囲内に収束した、has_fallback: 範囲外に収束した解がある)
+    int lanes = inverse_map_simd_lanes(map);
+    double wre[SIMD_LANES_F], wim[SIMD_LANES_F], zre[SIMD_LANES_F], zim[SIMD_LANES_F];
+    double residual[SIMD_LANES_F] = {0}, fallback_residual[SIMD_LANES_F];
+    int iterations[SIMD_LANES_F], converged[SIMD_LANES_F];
+    double complex fallback[SIMD_LANES_F];
+    unsigned char done[SIMD_LANES_F] = {0}, has_fallback[SIMD_LANES_F] = {0};
+    double *res = map->residual ? residual : NULL;
+    int n_done = 0;
+    for (int k = 0; k < lanes; k++) {
+        int j = k < n ? k : n - 1; // 余ったレーンは最後の点を繰り返す
+        double complex w = inverse_map_point(map, xs[j], ys[j]);
+        wre[k] = creal(w);
+        wim[k] = cimag(w);
+    }
+    for (int j = 0; j < n; j++) {
+        stats[j].iterations = 0;
+    }
+
+    // 初期値を順に試す (解けた点は解を初期値にするので、すぐ止まる)
+    for (int s = 0; s <= n_shared && n_done < n; s++) {
+        for (int k = 0; k < lanes; k++) {
+            int j = k < n ? k : n - 1;
+            double complex seed = done[j] ? z[j] : s == 0 ? predicted[j] : shared[s - 1];
+            zre[k] = creal(seed);
+            zim[k] = cimag(seed);
+        }
+        inverse_map_newton_block(map, map->newton.warm_iter, wre, wim, zre, zim, iterations, res, converged);
+        for (int j = 0; j < n; j++) {
+            if (done[j]) {
+                continue;
+            }
+            double complex x = zre[j] + zim[j] * I;
+            stats[j].iterations += iterations[j];
+            if (converged[j] && inverse_map_in_source(map, x)) {
+                z[j] = x;
+                ok[j] = done[j] = 1;
+                stats[j].residual = residual[j];
+                stats[j].converged = 1;
+                n_done++;
+            } else if (converged[j] && !has_fallback[j]) {
+                fallback[j] = x;
+                fallback_residual[j] = residual[j];
+                has_fallback[j] = 1;
+            }
+        }
+    }
+    if (n_done == n) {
+        return;
+    }
+
+    // 残った点は w からも解き、それでも範囲外なら初期値から収束した範囲外の解を使う
+    for (int k = 0; k < lanes; k++) {
+        int j = k < n ? k : n - 1;
+        zre[k] = done[j] ? creal(z[j]) : wre[k];
+        zim[k] = done[j] ? cimag(z[j]) : wim[k];
+    }
+    inverse_map_newton_block(map, map->newton.max_iter, wre, wim, zre, zim, iterations, res, converged);
+    for (int j = 0; j < n; j++) {
+        if (done[j]) {
+            continue;
+        }
+        z[j] = zre[j] + zim[j] * I;
+        ok[j] = (unsigned char) converged[j];
+        stats[j].iterations += iterations[j];
+        stats[j].residual = residual[j];
+        stats[j].converged = converged[j];
+        if (has_fallback[j] && !(converged[j] && inverse_map_in_source(map, z[j]))) {
+            z[j] = fallback[j];
+            ok[j] = 1;
+            stats[j].residual = fallback_residual[j];
+            stats[j].converged = 1;
+        }
+    }
+}
+
+// セルの四隅 c[0]=(x0,y0), c[1]=(x1,y0), c[2]=(x0,y1), c[3]=(x1,y1) の解をバイリニア補間する
+static inline double complex inverse_map_bilerp(const double complex c[4], double tx, double ty) {
+    double complex top = c[0] + (c[1] - c[0]) * tx;
+    double complex bottom = c[2] + (c[3] - c[2]) * tx;
+    return top + (bottom - top) * ty;
+}
+
+// 2つの解の差を元画像のピクセル単位で測る
+static inline double inverse_map_source_distance(const InverseMap *map, double complex a, double complex b) {
+    double dx = creal(a - b) * map->view.inv_scale_re;
+    double dy = cimag(a - b) * map->view.inv_scale_im;
+    return sqrt(dx * dx + dy * dy);
+}
+
+// 出力座標 (xs[j], ys[j]) の n 点をまとめて解いてマップに入れる (inverse_map_adaptive_cell の小さいセル用)
+static inline void inverse_map_adaptive_solve_pixels(InverseMap *map, int n, const int *xs, const int *ys,
+                                                     const double complex *predicted,
+                                                     const double complex *seeds, int n_seeds) {
+    double complex z[SIMD_LANES_F];
+    unsigned char ok[SIMD_LANES_F];
+    NewtonStats stats[SIMD_LANES_F];
+    inverse_map_solve_points(map, n, xs, ys, predicted, seeds, n_seeds, z, ok, stats);
+    for (int j = 0; j < n; j++) {
+        long i = (long) ys[j] * map->width + xs[j];
+        inverse_map_store(map, i, z[j]);
+        inverse_map_store_stats(map, i, &stats[j]);
+    }
+}
+
+// セルの四隅の解が、補間の予測に使えるように同じ枝にそろっているか
+// 四隅が (x1 - x0) x (y1 - y0) の長方形を回して拡大・縮小した形に並んでいれば1
+// (正則な写像は局所的に回転と拡大・縮小なので、1つでも別の枝の解が混じると形が崩れる)
+// 元画像の範囲外や収束しなかった隅があるセルは、枝を比べられないので1を返す (今までどおり分けて解く)
+static inline int inverse_map_corners_agree(const InverseMap *map, int x0, int y0, int x1, int y1,
+                                            const double complex c[4], const unsigned char ok[4]) {
+    for (int k = 0; k < 4; k++) {
+        if (!ok[k] || !inverse_map_in_source(map, c[k])) {
+            return 1;
+        }
+    }
+    if (x1 == x0 && y1 == y0) {
+        return 1;
+    }
+    // 出力の1ピクセルあたりの w の変化と、上の辺 (幅がなければ左の辺) から求めた dz/dw
+    double complex dw_x = map->view.scale_re;
+    double complex dw_y = inverse_map_point(map, x0, y0 + 1) - inverse_map_point(map, x0, y0);
+    double complex dz = x1 > x0 ? (c[1] - c[0]) / ((x1 - x0) * dw_x) : (c[2] - c[0]) / ((y1 - y0) * dw_y);
+    double err = 0.0, span = 0.0;
+    for (int k = 1; k < 4; k++) {
+        int x = k & 1 ? x1 : x0, y = k & 2 ? y1 : y0;
+        double complex expected = c[0] + dz * ((x - x0) * dw_x + (y - y0) * dw_y);
+        double e = inverse_map_source_distance(map, c[k], expected), d = inverse_map_source_distance(map, c[k], c[0]);
+        err = e > err ? e : err;
+        span = d > span ? d : span;
+    }
+    return err <= INVERSE_MAP_SEAM + 0.5 * span;
+}
+
+// 四隅が別々の枝にあるセルの [x0, last_x] × [y0, last_y] を、行ごとの計算と同じく左上から順に1ピクセルずつ解く
+// 初期値は 左のピクセルの解 → 上のピクセルの解 → 範囲内に解けている四隅の解 → w の順に試す。
+// 四分木は左上・右上・左下・右下の順に進むので、左と上のピクセルはもう解けている
+// (帯のセルの左端より左は別の仕事が解いているので使わない)
+// 厳密に解いた点の数を返す
+static inline long inverse_map_adaptive_warm_cell(InverseMap *map, int x0, int y0, int last_x, int last_y,
+                                                  const double complex *seeds, int n_seeds) {
+    int width = map->width;
+    for (int y = y0; y <= last_y; y++) {
+        for (int x = x0; x <= last_x; x++) {
+            long i = (long) y * width + x;
+            double complex s[6], z;
+            int n = 0;
+            NewtonStats stats;
+            if (x % map->adaptive_cell != 0 && map->valid[i - 1]) {
+                s[n++] = inverse_map_source_point(map, map->sx[i - 1], map->sy[i - 1]);
+            }
+            if (y > 0 && map->valid[i - width]) {
+                s[n++] = inverse_map_source_point(map, map->sx[i - width], map->sy[i - width]);
+            }
+            for (int k = 0; k < n_seeds; k++) {
+                s[n++] = seeds[k];
+            }
+            inverse_map_solve_point(map, x, y, s, n, &z, &stats);
+            inverse_map_store(map, i, z);
+            inverse_map_store_stats(map, i, &stats);
+        }
+    }
+    return (long) (last_x - x0 + 1) * (last_y - y0 + 1);
+}
+
+// セル [x0, x1] × [y0, y1] (四隅は解いてある) の中を埋める
+// 隣のセルと重ならないよう、書き込むのは右端と下端を除いた範囲 (画像の端のセルだけは端も含める)
+// 四隅のピクセルには四隅を解いたときの反復回数と残差 cs を記録する
+// 厳密に解いた点の数を返す
+static inline long inverse_map_adaptive_cell(InverseMap *map, int x0, int y0, int x1, int y1,
+                                             const double complex c[4], const unsigned char ok[4],
+                                             const NewtonStats cs[4]) {
+    int last_x = x1 == map->width - 1 ? x1 : x1 - 1;
+    int last_y = y1 == map->height - 1 ? y1 : y1 - 1;
+    double sx = x1 > x0 ? 1.0 / (x1 - x0) : 0.0;
+    double sy = y1 > y0 ? 1.0 / (y1 - y0) : 0.0;
+    long solves = 0;
+
+    // 初期値は 補間で予測した値 → 範囲内に解けている四隅の解 の順に試す
+    // (四隅が枝の切れ目をまたいでいると、予測した値から別の枝に収束することがあるため)
+    double complex seeds[4];
+    int n_seeds = 0;
+    for (int k = 0; k < 4; k++) {
+        if (ok[k] && inverse_map_in_source(map, c[k])) {
+            seeds[n_seeds++] = c[k];
+        }
+    }
+
+    // 四隅が別々の枝にあると、補間で予測した値から解く点 (中点や小さいセルの中) が枝の間を行き来する。
+    // そういうセルは INVERSE_MAP_WARM_CELL の大きさまで分け、そこからは隣のピクセルの解から順に解く
+    int agree = inverse_map_corners_agree(map, x0, y0, x1, y1, c, ok);
+    if (!agree && (x1 - x0 <= INVERSE_MAP_WARM_CELL || y1 - y0 <= INVERSE_MAP_WARM_CELL)) {
+        return inverse_map_adaptive_warm_cell(map, x0, y0, last_x, last_y, seeds, n_seeds);
+    }
+    if (x1 - x0 <= 2 || y1 - y0 <= 2) {
+        // 小さいセルは、四隅以外の全ピクセルを補間で予測した値から解く (SIMDのレーン数ずつまとめて解く)
+        int lanes = inverse_map_simd_lanes(map), n = 0;
+        int xs[SIMD_LANES_F], ys[SIMD_LANES_F];
+        double complex predicted[SIMD_LANES_F];
+        for (int y = y0; y <= last_y; y++) {
+            for (int x = x0; x <= last_x; x++) {
+                int corner = (x == x0 || x == x1) && (y == y0 || y == y1);
+                if (corner) {
+                    int k = (x == x1) + 2 * (y == y1);
+                    inverse_map_store(map, (long) y * map->width + x, c[k]);
+                    inverse_map_store_stats(map, (long) y * map->width + x, &cs[k]);
+                    continue;
+                }
+                xs[n] = x;
+                ys[n] = y;
+                predicted[n] = inverse_map_bilerp(c, (x - x0) * sx, (y - y0) * sy);
+                n++;
+                if (n == lanes) {
+                    inverse_map_adaptive_solve_pixels(map, n, xs, ys, predicted, seeds, n_seeds);
+                    solves += n;
+                    n = 0;
+                }
+            }
+        }
+        if (n > 0) {
+            inverse_map_adaptive_solve_pixels(map, n, xs, ys, predicted, seeds, n_seeds);
+            solves += n;
+        }
+        return solves;
+    }
+
+    // 辺の中点4つと中心をまとめて解き、補間した値との差を調べる
+    // (四隅が別々の枝にあるときは、補間した値の代わりに同じ辺の隅の解から解き、補間せずに分ける)
+    int xm = (x0 + x1) / 2, ym = (y0 + y1) / 2;
+    static const int px[5] = {1, 0, 1, 2, 1}, py[5] = {0, 1, 1, 1, 2}; // 0:端 1:中 2:端
+    int mx[5], my[5];
+    double complex predicted[5], m[5];
+    unsigned char m_ok[5];
+    NewtonStats m_stats[5];
+    double err = 0.0;
+    int all_ok = ok[0] && ok[1] && ok[2] && ok[3];
+    for (int k = 0; k < 5; k++) {
+        mx[k] = px[k] == 0 ? x0 : px[k] == 1 ? xm : x1;
+        my[k] = py[k] == 0 ? y0 : py[k] == 1 ? ym : y1;
+        predicted[k] = inverse_map_bilerp(c, (mx[k] - x0) * sx, (my[k] - y0) * sy);
+    }
+    static const int near_corner[5] = {0, 0, 0, 1, 2}; // 上の中点と左の中点と中心は左上、右の中点は右上、下の中点は左下
+    double complex m_seed[5];
+    for (int k = 0; k < 5; k++) {
+        m_seed[k] = agree ? predicted[k] : c[near_corner[k]];
+    }
+    inverse_map_solve_points(map, 5, mx, my, m_seed, seeds, n_seeds, m, m_ok, m_stats);
+    for (int k = 0; k < 5; k++) {
+        all_ok = all_ok && m_ok[k];
+        double e = inverse_map_source_distance(map, m[k], predicted[k]);
+        if (!(e <= err)) {
+            err = e; // NaN も誤差が大きいとみなす
+        }
+        solves++;
+    }
+
+    if (agree && all_ok && err <= map->adaptive_tol) {
+        // 補間で十分なので、セルの中をバイリニア補間で埋める
+        for (int y = y0; y <= last_y; y++) {
+            for (int x = x0; x <= last_x; x++) {
+                long i = (long) y * map->width + x;
+                int corner = (x == x0 || x == x1) && (y == y0 || y == y1);
+                NewtonStats stats = {0, 0.0, 1}; // 解いていないので、収束しなかったことにはしない
+                inverse_map_store(map, i, inverse_map_bilerp(c, (x - x0) * sx, (y - y0) * sy));
+                inverse_map_store_stats(map, i, corner ? &cs[(x == x1) + 2 * (y == y1)] : &stats);
+            }
+        }
+        return solves;
+    }
+
+    // 誤差が大きいので4つに分ける (m: 0=上の中点 1=左の中点 2=中心 3=右の中点 4=下の中点)
+    double complex c00[4] = {c[0], m[0], m[1], m[2]};
+    double complex c10[4] = {m[0], c[1], m[2], m[3]};
+    double complex c01[4] = {m[1], m[2], c[2], m[4]};
+    double complex c11[4] = {m[2], m[3], m[4], c[3]};
+    unsigned char o00[4] = {ok[0], m_ok[0], m_ok[1], m_ok[2]};
+    unsigned char o10[4] = {m_ok[0], ok[1], m_ok[2], m_ok[3]};
+    unsigned char o01[4] = {m_ok[1], m_ok[2], ok[2], m_ok[4]};
+    unsigned char o11[4] = {m_ok[2], m_ok[3], m_ok[4], ok[3]};
+    NewtonStats s00[4] = {cs[0], m_stats[0], m_stats[1], m_stats[2]};
+    NewtonStats s10[4] = {m_stats[0], cs[1], m_stats[2], m_stats[3]};
+    NewtonStats s01[4] = {m_stats[1], m_stats[2], cs[2], m_stats[4]};
+    NewtonStats s11[4] = {m_stats[2], m_stats[3], m_stats[4], cs[3]};
+    solves += inverse_map_adaptive_cell(map, x0, y0, xm, ym, c00, o00, s00);
+    solves += inverse_map_adaptive_cell(map, xm, y0, x1, ym, c10, o10, s10);
+    solves += inverse_map_adaptive_cell(map, x0, ym, xm, y1, c01, o01, s01);
+    solves += inverse_map_adaptive_cell(map, xm, ym, x1, y1, c11, o11, s11);
+    return solves;
+}
+
+// y 行目の格子点 (x = 0, cell, 2*cell, ..., width-1) を解く
+// 上の格子点の解 (aboveがNULLでなければ) → 左の格子点の解 → w の順に、元画像の範囲内の解を初期値にする。
+// 行ごとの計算と同じく、最後に範囲外のまま残った点を左右の隣の解から解き直す
+// z_stats には各点を解いたときの反復回数 (解き直しの分も足す) と残差を入れる
+// 厳密に解いた点の数を返す
+static inline long inverse_map_adaptive_corner_row(const InverseMap *map, int y, double complex *z,
+                                                   unsigned char *z_ok, NewtonStats *z_stats,
+                                                   const double complex *above, int n_corners) {
+    int cell = map->adaptive_cell;
+    long solves = 0;
+    for (int k = 0; k < n_corners; k++) {
+        int x = k * cell < map->width - 1 ? k * cell : map->width - 1;
+        if (above && inverse_map_in_source(map, above[k])) {
+            z_ok[k] = inverse_map_solve_point(map, x, y, &above[k], 1, &z[k], &z_stats[k]);
+        } else {
+            int left = k > 0 && inverse_map_in_source(map, z[k - 1]);
+            z_ok[k] = inverse_map_solve_point(map, x, y, left ? &z[k - 1] : NULL, left, &z[k], &z_stats[k]);
+        }
+        solves++;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        for (int j = 1; j < n_corners; j++) {
+            int k = pass == 0 ? j : n_corners - 1 - j;    // 1回目は左→右、2回目は右→左
+            int seed = pass == 0 ? k - 1 : k + 1;
+            if (inverse_map_in_source(map, z[k]) || !inverse_map_in_source(map, z[seed])) {
+                continue;
+            }
+            int x = k * cell < map->width - 1 ? k * cell : map->width - 1;
+            double complex zk;
+            NewtonStats stats;
+            int iterations = z_stats[k].iterations;
+            if (inverse_map_solve_point(map, x, y, &z[seed], 1, &zk, &stats) && inverse_map_in_source(map, zk)) {
+                z[k] = zk;
+                z_ok[k] = 1;
+                z_stats[k] = stats;
+            }
+            z_stats[k].iterations = iterations + stats.iterations;
+            solves++;
+        }
+    }
+    return solves;
+}
+
+// 帯の k 番目のセルを計算する (inverse_map_build_band_adaptive の仕事1つ分)
+static inline void inverse_map_adaptive_cell_task(void *ctx, int k) {
+    const InverseMapJob *job = ctx;
+    InverseMap *map = job->map;
+    int cell = map->adaptive_cell, width = map->width;
+    int x0 = k * cell < width - 1 ? k * cell : width - 1;
+    int x1 = (k + 1) * cell < width - 1 ? (k + 1) * cell : width - 1;
+    double complex c[4] = {job->top[k], job->top[k + 1], job->bottom[k], job->bottom[k + 1]};
+    unsigned char ok[4] = {job->top_ok[k], job->top_ok[k + 1], job->bottom_ok[k], job->bottom_ok[k + 1]};
+    NewtonStats cs[4] = {job->top_stats[k], job->top_stats[k + 1], job->bottom_stats[k], job->bottom_stats[k + 1]};
+    long solves = inverse_map_adaptive_cell(map, x0, job->y0, x1, job->y1, c, ok, cs);
+    __atomic_fetch_add(&map->exact_solves, solves, __ATOMIC_RELAXED);
+}
+
+// y0 行目から始まる高さ adaptive_cell の帯を計算し、計算し終わった行数を返す
+static inline int inverse_map_build_band_adaptive(InverseMap *map, int y0) {
+    int cell = map->adaptive_cell;
+    int width = map->width;
+    int y1 = y0 + cell < map->height - 1 ? y0 + cell : map->height - 1;
+    int n_cells = width > 1 ? (width - 1 + cell - 1) / cell : 1;
+    int n_corners = n_cells + 1;
+    double complex *top = map->adaptive_corners, *bottom = top + n_corners;
+    unsigned char *top_ok = map->adaptive_ok, *bottom_ok = top_ok + n_corners;
+    NewtonStats *top_stats = map->adaptive_stats, *bottom_stats = top_stats + n_corners;
+    long solves = 0;
+
+    // 格子点を解く (最初の帯だけは上端も解く。2本目以降は前の帯の下端を使う)
+    if (y0 == 0) {
+        solves += inverse_map_adaptive_corner_row(map, y0, top, top_ok, top_stats, NULL, n_corners);
+    }
+    solves += inverse_map_adaptive_corner_row(map, y1, bottom, bottom_ok, bottom_stats, top, n_corners);
+
+    map->exact_solves += solves;
+
+    // セルごとに並列に解く (解いた点の数は各セルが exact_solves に足す)
+    InverseMapJob job = {.map = map, .top = top, .bottom = bottom, .top_ok = top_ok, .bottom_ok = bottom_ok,
+                         .top_stats = top_stats, .bottom_stats = bottom_stats, .y0 = y0, .y1 = y1};
+    tile_pool_run(tile_pool_shared(), n_cells, inverse_map_adaptive_cell_task, &job);
+
+    // 下端を次の帯の上端にする
+    memcpy(top, bottom, n_corners * sizeof(double complex));
+    memcpy(top_ok, bottom_ok, n_corners);
+    memcpy(top_stats, bottom_stats, n_corners * sizeof(NewtonStats));
+    return y1 == map->height - 1 ? map->height : y1;
+}
+
+// 解析的な逆関数で row_begin + row 行目を計算する (SIMD版があれば8ピクセルずつ)
+static inline void inverse_map_analytic_row_task(void *ctx, int row) {
+    const InverseMapJob *job = ctx;
+    InverseMap *map = job->map;
+    int width = map->width, ny = job->row_begin + row;
+    long begin = (long) ny * width;
+    // 出力座標(nx, ny)の複素数wは、行の先頭から1ピクセルごとに幅を足して求める
+    double w_re = map->view.re_min, w_im = viewport_im(&map->view, ny);
+
+    if (map->simd == SIMD_FUNC_NONE) {
+        for (int nx = 0; nx < width; nx++, w_re += map->view.scale_re) {
+            // 逆関数で元の点zを求める
+            inverse_map_store(map, begin + nx, map->inv(w_re + w_im * I));
+        }
+        return;
+    }
+    for (int x0 = 0; x0 < width; x0 += SIMD_LANES) {
+        int n = width - x0 < SIMD_LANES ? width - x0 : SIMD_LANES;
+        double wre[SIMD_LANES], wim[SIMD_LANES], zre[SIMD_LANES], zim[SIMD_LANES];
+
+        for (int k = 0; k < SIMD_LANES; k++) {
+            wre[k] = w_re; // 余ったレーンは最後のピクセルを繰り返す
+            wim[k] = w_im;
+            if (k < n - 1) {
+                w_re += map->view.scale_re;
+            }
+        }
+        w_re += map->view.scale_re; // 次のブロックの先頭
+        simd_inverse_block(map->simd, map->simd_branch, wre, wim, zre, zim);
+        for (int k = 0; k < n; k++) {
+            inverse_map_store(map, begin + x0 + k, zre[k] + zim[k] * I);
+        }
+    }
+}
+
+// 先頭からrow_end行目までのマップを計算する (計算済みの行は飛ばす)
+// 適応的に計算するときは帯ごとに計算するので、row_end より先の行まで計算することがある
+static inline void inverse_map_build_rows(InverseMap *map, int row_end) {
+    if (row_end > map->height) {
+        row_end = map->height;
+    }
+    if (row_end <= map->built_rows) {
+        return;
+    }
+
+    if (map->adaptive_cell > 0) {
+        while (map->built_rows < row_end) {
+            map->built_rows = inverse_map_build_band_adaptive(map, map->built_rows);
+        }
+        return;
+    }
+
+    if (map->fdf) {
+        // 上の行の解を使うので、1行ずつ順番に計算する
+        for (int ny = map->built_rows; ny < row_end; ny++) {
+            if (map->simd != SIMD_FUNC_NONE || map->block_func) {
+                inverse_map_build_row_simd(map, ny);
+            } else {
+                inverse_map_build_row_newton(map, ny);
+            }
+        }
+        map->built_rows = row_end;
+        return;
+    }
+
+    // 解析的な逆関数は行どうしが独立なので、まとめて1行ずつの仕事にする
+    InverseMapJob job = {.map = map, .row_begin = map->built_rows};
+    tile_pool_run(tile_pool_shared(), row_end - map->built_rows, inverse_map_analytic_row_task, &job);
+    map->built_rows = row_end;
+}
+
+static inline void inverse_map_build(InverseMap *map) {
+    inverse_map_build_rows(map, map->height);
+}
+
+// 2つのマップの違い (inverse_map_compare)
+typedef struct {
+    long compared;          // 両方とも範囲内で、同じ枝の解とみなしたピクセル数
+    long branch_mismatch;   // 両方とも範囲内だが、1ピクセル以上離れている (別の枝の解) ピクセル数
+    long valid_mismatch;    // 片方だけ範囲内のピクセル数
+    double max_error;       // 同じ枝の解の座標の差の最大値 (元画像のピクセル単位)
+    double mean_error;      // 同じ枝の解の座標の差の平均
+} InverseMapDiff;
+
+#define INVERSE_MAP_COMPARE_CHUNKS 64 // 比べるときに行を分ける数 (仕事ごとに数えてから最後に足す)
+
+// inverse_map_compare に配る仕事のデータ
+typedef struct {
+    const InverseMap *a, *b;
+    int n_chunks;
+    InverseMapDiff part[INVERSE_MAP_COMPARE_CHUNKS]; // 仕事ごとに数えた結果
+    double sum[INVERSE_MAP_COMPARE_CHUNKS];          // 仕事ごとの同じ枝の解の座標の差の合計
+} InverseMapCompareJob;
+
+// k 番目の区間の行を比べる (inverse_map_compare の仕事1つ分)
+static inline void inverse_map_compare_task(void *ctx, int k) {
+    InverseMapCompareJob *job = ctx;
+    const InverseMap *a = job->a, *b = job->b;
+    long begin = (long) a->height * k / job->n_chunks * a->width;
+    long end = (long) a->height * (k + 1) / job->n_chunks * a->width;
+    InverseMapDiff d = {0};
+    double sum = 0.0;
+    for (long i = begin; i < end; i++) {
+        if (a->valid[i] != b->valid[i]) {
+            d.valid_mismatch++;
+            continue;
+        }
+        if (!a->valid[i]) {
+            continue;
+        }
+        double dx = (double) a->sx[i] - b->sx[i], dy = (double) a->sy[i] - b->sy[i];
+        double e = sqrt(dx * dx + dy * dy);
+        if (e >= 1.0) {
+            d.branch_mismatch++;
+            continue;
+        }
+        d.compared++;
+        sum += e;
+        if (e > d.max_error) {
+            d.max_error = e;
+        }
+    }
+    job->part[k] = d;
+    job->sum[k] = sum;
+}
+
+// 同じ範囲・サイズで計算した2つのマップを比べる (精度を変えたときの誤差を調べる)
+static inline void inverse_map_compare(const InverseMap *a, const InverseMap *b, InverseMapDiff *diff) {
+    InverseMapCompareJob job = {.a = a, .b = b};
+    job.n_chunks = a->height < INVERSE_MAP_COMPARE_CHUNKS ? a->height : INVERSE_MAP_COMPARE_CHUNKS;
+    tile_pool_run(tile_pool_shared(), job.n_chunks, inverse_map_compare_task, &job);
+
+    // 区間の順に足すので、スレッド数によらず同じ結果になる
+    InverseMapDiff d = {0};
+    double sum = 0.0;
+    for (int k = 0; k < job.n_chunks; k++) {
+        d.compared += job.part[k].compared;
+        d.branch_mismatch += job.part[k].branch_mismatch;
+        d.valid_mismatch += job.part[k].valid_mismatch;
+        if (job.part[k].max_error > d.max_error) {
+            d.max_error = job.part[k].max_error;
+        }
+        sum += job.sum[k];
+    }
+    d.mean_error = d.compared > 0 ? sum / d.compared : 0.0;
+    *diff = d;
+}
+
+// 反復回数 (which = 0) か残差 (which = 1) をRGBのヒートマップにする
+// 反復回数は log(1 + 回数) を最大値で、残差は log10 で 1e-16〜1 の範囲で正規化する
+// (黒→青→赤→黄→白)
+static inline void inverse_map_stats_heatmap(const InverseMap *map, int which, unsigned char *rgb) {
+    static const unsigned char ramp[5][3] = {
+        {0, 0, 0}, {40, 0, 160}, {220, 40, 40}, {255, 220, 0}, {255, 255, 255}
+    };
+    long n = (long) map->width * map->height;
+    int max_iter = 1;
+
+    for (long i = 0; i < n; i++) {
+        if (map->iterations[i] > max_iter) {
+            max_iter = map->iterations[i];
+        }
+    }
+
+    for (long i = 0; i < n; i++) {
+        double t;
+        if (which == 0) {
+            t = log1p(map->iterations[i]) / log1p(max_iter);
+        } else {
+            double r = map->residual[i] > 1e-16 ? map->residual[i] : 1e-16;
+            t = (log10(r) + 16.0) / 16.0;
+        }
+        t = t < 0 ? 0 : (t > 1 ? 1 : t);
+
+        int k = (int) (t * 4);
+        if (k > 3) {
+            k = 3;
+        }
+        double u = t * 4 - k;
+        for (int c = 0; c < 3; c++) {
+            rgb[i * 3 + c] = (unsigned char) ((1 - u) * ramp[k][c] + u * ramp[k + 1][c] + 0.5);
+        }
+    }
+}
+
+// --- サンプリング ---
+// 8ビットの画像のバイリニア補間は、1ピクセルのチャンネル (最大4つ) を32bit整数4つのベクトルにして、4つの隣のピクセルを一度に混ぜる。
+// 重みは固定小数点で、ピクセル内の位置を 1/4096 単位に丸め、4つの重みの合計を 2^24 にする。
+// (Σ 色 * 重み + 2^23) >> 24 で四捨五入するので、結果と正確なバイリニア補間の値との差は 0.5 + 0.04 以内
+// (1/4096 は 255 * 2^24 が32bitに収まる一番細かい単位)
+// 16ビットと float の画像は 65535 * 2^24 が32bitに収まらないので、チャンネルを float 4つのベクトルにして混ぜる。
+// 描く関数はチャンネルの型 (ImagePixel) もチャンネル数と同じく定数で受け取り、型ごとの読み書きを展開させる
+
+#define INVERSE_MAP_WEIGHT_BITS 12
+
+// simd_complex.h と同じく、ベクトル型の引数によるABIの警告はこのヘッダの中だけで無効にする
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+typedef unsigned char simd_vu8x4 __attribute__((vector_size(4)));    // uint8 x 4 (1ピクセル)
+typedef unsigned short simd_vu16x4 __attribute__((vector_size(8)));  // uint16 x 4 (1ピクセル)
+typedef unsigned int simd_vu32x4 __attribute__((vector_size(16)));   // uint32 x 4
+typedef float simd_vf4 __attribute__((vector_size(16)));             // float x 4 (1ピクセルのチャンネル)
+
+// 1ピクセル分のチャンネルを読んで、チャンネルごとに1レーンずつ並べる (足りないチャンネルは0)
+SIMD_INLINE simd_vu32x4 inverse_map_load_pixel(const unsigned char *p, int channels) {
+    simd_vu8x4 v = {0, 0, 0, 0};
+    memcpy(&v, p, channels);
+    return __builtin_convertvector(v, simd_vu32x4);
+}
+
+// inverse_map_load_pixel の float 版 (チャンネルの型は type)
+SIMD_INLINE simd_vf4 inverse_map_load_pixel_f(const unsigned char *p, ImagePixel type, int channels) {
+    if (type == IMAGE_PIXEL_F32) {
+        simd_vf4 v = {0, 0, 0, 0};
+        memcpy(&v, p, channels * sizeof(float));
+        return v;
+    }
+    if (type == IMAGE_PIXEL_U16) {
+        simd_vu16x4 v = {0, 0, 0, 0};
+        memcpy(&v, p, channels * sizeof(unsigned short));
+        return __builtin_convertvector(v, simd_vf4);
+    }
+    simd_vu8x4 v = {0, 0, 0, 0};
+    memcpy(&v, p, channels);
+    return __builtin_convertvector(v, simd_vf4);
+}
+
+// 不透明のアルファ (と白) の値
+SIMD_INLINE float inverse_map_pixel_one(ImagePixel type) {
+    return type == IMAGE_PIXEL_U8 ? 255.0f : type == IMAGE_PIXEL_U16 ? 65535.0f : 1.0f;
+}
+
+// 整数の型は、積和の最初に 0.5 を足しておいて書くときに切り捨てることで四捨五入する (float はそのまま)
+SIMD_INLINE float inverse_map_pixel_bias(ImagePixel type) {
+    return type == IMAGE_PIXEL_F32 ? 0.0f : 0.5f;
+}
+
+// チャンネルの値 v (inverse_map_pixel_bias を足したもの) を型の範囲に収めて dest に書く
+// 双3次と Lanczos は負の重みがあるので、どの型も0より小さくはしない (float は1を超えてもよい)
+SIMD_INLINE void inverse_map_store_pixel(unsigned char *dest, ImagePixel type, int channels, simd_vf4 v) {
+    float hi = type == IMAGE_PIXEL_F32 ? FLT_MAX : inverse_map_pixel_one(type);
+    float c[4];
+    memcpy(c, &v, sizeof(c));
+    for (int k = 0; k < channels; k++) {
+        c[k] = c[k] < 0 ? 0 : c[k] > hi ? hi : c[k];
+    }
+    if (type == IMAGE_PIXEL_F32) {
+        memcpy(dest, c, channels * sizeof(float));
+    } else if (type == IMAGE_PIXEL_U16) {
+        unsigned short out[4];
+        for (int k = 0; k < channels; k++) {
+            out[k] = (unsigned short) c[k];
+        }
+        memcpy(dest, out, channels * sizeof(unsigned short));
+    } else {
+        unsigned char out[4];
+        for (int k = 0; k < channels; k++) {
+            out[k] = (unsigned char) c[k];
+        }
+        memcpy(dest, out, channels);
+    }
+}
+
+// 範囲外のピクセルを黒 (アルファは不透明) で塗る
+SIMD_INLINE void inverse_map_store_black(unsigned char *dest, ImagePixel type, int channels) {
+    simd_vf4 black = {0, 0, 0, inverse_map_pixel_one(type)};
+    inverse_map_store_pixel(dest, type, channels, black);
+}
+
+// 16ピクセル分の元画像の座標 *v を、軸の扱い b に従って読める位置 (0 <= v < size) にする
+// 黒で塗るレーン (範囲外で扱いが IMAGE_BORDER_CONSTANT、または座標が無限大やNaN) は返すマスクが0
+SIMD_INLINE simd_vi inverse_map_border_apply(const InverseMapBorder *b, simd_vf *v) {
+    simd_vf x = *v;
+    // 係数は先にベクトルにしておく (スカラーのまま式に混ぜると、展開したあとにレーンごとの比較に分解されることがある)
+    simd_vf period = (simd_vf) {} + b->period, fold = (simd_vf) {} + b->fold;
+    simd_vf lo = (simd_vf) {} + b->lo, hi = (simd_vf) {} + b->hi;
+    simd_vf draw_lo = (simd_vf) {} + b->draw_lo, draw_hi = (simd_vf) {} + b->draw_hi;
+    // 描く範囲に収めても変わらないレーンだけを描く (NaN はどの比較も偽なので変わらなくても == が偽になる)
+    simd_vi draw = svf_select(x < draw_lo, draw_lo, svf_select(x > draw_hi, draw_hi, x)) == x;
+    x = x - svf_floor(x * b->inv_period) * period;
+    x = svf_select(x < fold - x, x, fold - x);
+    x = svf_select(x < lo, lo, x);
+    *v = svf_select(x > hi, hi, x);
+    return draw;
+}
+
+// inverse_map_border_apply の1点版。黒で塗るなら0を返す
+// (描く関数の中に展開させて、libm の floor を呼ばずに整数への変換で切り捨てる)
+SIMD_INLINE int inverse_map_border_point(const InverseMapBorder *b, double *v) {
+    double x = *v;
+    if (!(x - x == 0.0) || (b->constant && !(x >= 0.0 && x < b->size))) {
+        return 0;
+    }
+    double t = x * b->inv_period;
+    t = t < -1e15 ? -1e15 : t > 1e15 ? 1e15 : t; // 整数に変換できる範囲に収める (どうせ最後に範囲に収める)
+    double q = (double) (long) t;
+    q -= q > t; // 負の数は0の方へ切り捨てられるので1つ戻す
+    x -= q * b->period;
+    x = x < b->fold - x ? x : b->fold - x;
+    *v = x < b->lo ? b->lo : x > b->hi ? b->hi : x;
+    return 1;
+}
+
+// マップの i 番目のピクセルが写る元画像の座標を、画像の外の扱いに従って読める位置 (*sx, *sy) にする。黒で塗るなら0を返す
+// 両方の軸が既定の扱い (範囲外は黒) なら座標はそのままで、描くかどうかは valid を見るだけで済む
+SIMD_INLINE int inverse_map_border_lookup(const InverseMap *map, long i, float *sx, float *sy) {
+    if (map->border_x.constant && map->border_y.constant) {
+        *sx = map->sx[i];
+        *sy = map->sy[i];
+        return map->valid[i];
+    }
+    double x = map->sx[i], y = map->sy[i];
+    if (!inverse_map_border_point(&map->border_x, &x) || !inverse_map_border_point(&map->border_y, &y)) {
+        return 0;
+    }
+    *sx = (float) x;
+    *sy = (float) y;
+    return 1;
+}
+
+// マップの base + offsets[k] 番目 (offsetsがNULLなら base + k 番目) のピクセルを k = 0, ..., count - 1 の順に描く
+// (チャンネルの型は type、数は1〜4)。type と channels は定数で呼んで、ピクセルごとの処理を型とチャンネル数ごとに展開させる
+SIMD_INLINE void inverse_map_bilinear_span_n(const InverseMap *map, const ImageBuffer *src,
+                                             unsigned char *dest_img, ImagePixel type, int channels,
+                                             long base, const int *offsets, long count) {
+    const float one = 1 << INVERSE_MAP_WEIGHT_BITS;
+    const int px = channels * image_pixel_size(type); // 1ピクセルのバイト数
+    const unsigned char *src_img = src->pixels;
+    long stride = src->stride;
+    const long *col = map->source_col, *row = map->source_row; // NULLなら元画像は行順
+    // 両方の軸が既定の扱い (範囲外は黒) なら座標はそのまま読め、描くかどうかは valid にある。
+    // AVX2 と汎用では16レーンの float の比較がレーンごとに分解されて遅いので、そのときは扱いの式を通さない
+    int plain = map->border_x.constant && map->border_y.constant;
+
+    for (long k0 = 0; k0 < count; k0 += SIMD_LANES_F) {
+        int n = count - k0 < SIMD_LANES_F ? (int) (count - k0) : SIMD_LANES_F;
+        long index[SIMD_LANES_F];
+        int draw[SIMD_LANES_F];
+        float sx[SIMD_LANES_F] = {0}, sy[SIMD_LANES_F] = {0};
+        for (int k = 0; k < n; k++) {
+            index[k] = base + (offsets ? offsets[k0 + k] : k0 + k);
+            sx[k] = map->sx[index[k]];
+            sy[k] = map->sy[index[k]];
+            draw[k] = map->valid[index[k]];
+        }
+
+        // 16ピクセル分の座標を画像の外の扱いに従って元画像の中に収め、整数部分と重みをまとめて求める
+        simd_vf vx = svf_load(sx), vy = svf_load(sy);
+        if (!plain) {
+            // 両方の軸で描くレーンだけが -1 + -1 = -2 になる (2つのマスクを & でつなぐとレーンごとの比較に分解されることがある)
+            simd_vi ok = inverse_map_border_apply(&map->border_x, &vx) + inverse_map_border_apply(&map->border_y, &vy) == -2;
+            memcpy(draw, &ok, sizeof(draw));
+        }
+        simd_vi ix = __builtin_convertvector(vx, simd_vi), iy = __builtin_convertvector(vy, simd_vi);
+        simd_vf tx = vx - __builtin_convertvector(ix, simd_vf), ty = vy - __builtin_convertvector(iy, simd_vf);
+        int x1[SIMD_LANES_F], y1[SIMD_LANES_F], wx[SIMD_LANES_F], wy[SIMD_LANES_F];
+        float fx[SIMD_LANES_F], fy[SIMD_LANES_F];
+        memcpy(x1, &ix, sizeof(x1));
+        memcpy(y1, &iy, sizeof(y1));
+        if (type == IMAGE_PIXEL_U8) {
+            simd_vi qx = __builtin_convertvector(tx * one + 0.5f, simd_vi);
+            simd_vi qy = __builtin_convertvector(ty * one + 0.5f, simd_vi);
+            memcpy(wx, &qx, sizeof(wx));
+            memcpy(wy, &qy, sizeof(wy));
+        } else {
+            memcpy(fx, &tx, sizeof(fx));
+            memcpy(fy, &ty, sizeof(fy));
+        }
+
+        for (int k = 0; k < n; k++) {
+            unsigned char *dest = dest_img + index[k] * px;
+            if (!draw[k]) {
+                inverse_map_store_black(dest, type, channels);
+                continue;
+            }
+            const unsigned char *p00, *p10, *p01, *p11;
+            if (col) {
+                p00 = src_img + (col[x1[k]] + row[y1[k]]) * px;
+                p10 = src_img + (col[x1[k] + 1] + row[y1[k]]) * px;
+                p01 = src_img + (col[x1[k]] + row[y1[k] + 1]) * px;
+                p11 = src_img + (col[x1[k] + 1] + row[y1[k] + 1]) * px;
+            } else {
+                p00 = src_img + y1[k] * stride + (long) x1[k] * px;
+                p10 = p00 + px;
+                p01 = p00 + stride;
+                p11 = p01 + px;
+            }
+            if (type == IMAGE_PIXEL_U8) {
+                unsigned int ux = (unsigned int) one - wx[k], uy = (unsigned int) one - wy[k];
+                simd_vu32x4 acc = inverse_map_load_pixel(p00, channels) * (ux * uy) +
+                                  inverse_map_load_pixel(p10, channels) * (wx[k] * uy) +
+                                  inverse_map_load_pixel(p01, channels) * (ux * wy[k]) +
+                                  inverse_map_load_pixel(p11, channels) * (wx[k] * wy[k]);
+                acc = (acc + (1U << (2 * INVERSE_MAP_WEIGHT_BITS - 1))) >> (2 * INVERSE_MAP_WEIGHT_BITS);
+                simd_vu8x4 out = __builtin_convertvector(acc, simd_vu8x4);
+                memcpy(dest, &out, channels);
+            } else {
+                float ux = 1 - fx[k], uy = 1 - fy[k];
+                simd_vf4 acc = (simd_vf4) {} + inverse_map_pixel_bias(type);
+                acc += inverse_map_load_pixel_f(p00, type, channels) * (ux * uy) +
+                       inverse_map_load_pixel_f(p10, type, channels) * (fx[k] * uy) +
+                       inverse_map_load_pixel_f(p01, type, channels) * (ux * fy[k]) +
+                       inverse_map_load_pixel_f(p11, type, channels) * (fx[k] * fy[k]);
+                inverse_map_store_pixel(dest, type, channels, acc);
+            }
+        }
+    }
+}
+
+typedef unsigned char simd_vu8x16 __attribute__((vector_size(16)));   // uint8 x 16
+typedef unsigned short simd_vu16x16 __attribute__((vector_size(32))); // uint16 x 16
+
+// 1行分のチャンネルのうち、p から n 個 (16以下) を16レーンの float のベクトルに読み込む (残りのレーンは0)
+SIMD_INLINE simd_vf inverse_map_load_row(const unsigned char *p, ImagePixel type, int n) {
+    if (type == IMAGE_PIXEL_F32) {
+        simd_vf v = {0};
+        memcpy(&v, p, n * sizeof(float));
+        return v;
+    }
+    if (type == IMAGE_PIXEL_U16) {
+        simd_vu16x16 v = {0};
+        memcpy(&v, p, n * sizeof(unsigned short));
+        return __builtin_convertvector(v, simd_vf);
+    }
+    simd_vu8x16 v = {0};
+    memcpy(&v, p, n);
+    return __builtin_convertvector(v, simd_vf);
+}
+
+// inverse_map_bilinear_span_n の双3次・Lanczos版 (1方向に taps ピクセル、taps x taps ピクセルを読む)
+// 1行分の taps ピクセルのチャンネル (taps * channels 個、最大24) を16レーンのfloatのベクトル2つに読み込み、
+// まず縦の重みで taps 行を足し合わせてから、最後に横の重みをかけてチャンネルごとに足す。
+// 横の重みは行によらないので、積和は1行あたりベクトル1〜2回で済む
+SIMD_INLINE void inverse_map_filter_span_n(const InverseMap *map, const ImageBuffer *src,
+                                           unsigned char *dest_img, ImagePixel type, int channels, int taps,
+                                           long base, const int *offsets, long count) {
+    const int size = image_pixel_size(type), px = channels * size;
+    const unsigned char *src_img = src->pixels;
+    const float *weights = map->filter->weights;
+    const long *col = map->source_col, *row = map->source_row; // NULLなら元画像は行順
+    const int row_n = taps * channels;
+    const int lo_n = row_n < 16 ? row_n : 16, hi_n = row_n - lo_n;
+    int first = -(taps / 2 - 1);
+    for (long k = 0; k < count; k++) {
+        long i = base + (offsets ? offsets[k] : k);
+        unsigned char *dest = dest_img + i * px;
+        float sx, sy;
+        if (!inverse_map_border_lookup(map, i, &sx, &sy)) {
+            inverse_map_store_black(dest, type, channels);
+            continue;
+        }
+        int x0 = (int) sx, y0 = (int) sy;
+        const float *wx = weights + (int) ((sx - x0) * RESAMPLE_PHASES + 0.5f) * taps;
+        const float *wy = weights + (int) ((sy - y0) * RESAMPLE_PHASES + 0.5f) * taps;
+
+        // はみ出すところも余白 (タイルとモートン順では表の画像の外の部分) から読めるので、
+        // 行順の元画像なら1行の taps ピクセルはいつもメモリ上で連続している
+        int xs = x0 + first;
+        long xo[RESAMPLE_MAX_TAPS], yo[RESAMPLE_MAX_TAPS];
+        if (col) {
+            for (int t = 0; t < taps; t++) {
+                xo[t] = col[xs + t];
+                yo[t] = row[y0 + first + t];
+            }
+        }
+
+        simd_vf lo = {0}, hi = {0};
+        for (int j = 0; j < taps; j++) {
+            unsigned char gathered[2 * 16 * sizeof(float)];
+            const unsigned char *p;
+            if (!col) {
+                p = src_img + (long) (y0 + first + j) * src->stride + (long) xs * px;
+            } else {
+                for (int t = 0; t < taps; t++) {
+                    memcpy(gathered + t * px, src_img + (xo[t] + yo[j]) * px, px);
+                }
+                p = gathered;
+            }
+            lo += inverse_map_load_row(p, type, lo_n) * wy[j];
+            if (hi_n > 0) {
+                hi += inverse_map_load_row(p + 16 * size, type, hi_n) * wy[j];
+            }
+        }
+
+        // 横の重みをかけてチャンネルごとに足す
+        // (t 番目のピクセルのチャンネルを4レーンのベクトルとして取り出す。チャンネルが4未満なら余りのレーンは使わない)
+        float line[2 * 16 + 4];
+        memcpy(line, &lo, sizeof(lo));
+        memcpy(line + 16, &hi, sizeof(hi));
+        simd_vf4 acc = (simd_vf4) {} + inverse_map_pixel_bias(type);
+        for (int t = 0; t < taps; t++) {
+            simd_vf4 p;
+            memcpy(&p, line + t * channels, sizeof(p));
+            acc += p * wx[t];
+        }
+        inverse_map_store_pixel(dest, type, channels, acc);
+    }
+}
+
+// inverse_map_bilinear_span_n のミップマップ版。出力ピクセルごとに f' から段を選び、トライリニア補間で描く
+// (元画像はミップマップの0段目を読むので、src と並べ方の設定は使わない。ミップマップは8ビットだけ)
+SIMD_INLINE void inverse_map_mip_span_n(const InverseMap *map, const ImageBuffer *src,
+                                        unsigned char *dest_img, ImagePixel type, int channels,
+                                        long base, const int *offsets, long count) {
+    (void) src;
+    for (long k = 0; k < count; k++) {
+        long i = base + (offsets ? offsets[k] : k);
+        unsigned char *dest = dest_img + i * channels;
+        float sx, sy;
+        if (!inverse_map_border_lookup(map, i, &sx, &sy)) {
+            inverse_map_store_black(dest, type, channels);
+            continue;
+        }
+        // 出力1ピクセルが元画像の 1/|f'(z)| ピクセルに当たるので、LOD = -log2|f'(z)|
+        double complex z = inverse_map_source_point(map, map->sx[i], map->sy[i]);
+        float lod = (float) -log2(cabs(map->scale_df(z)));
+        mip_pyramid_sample(map->mip, sx, sy, lod, dest);
+    }
+}
+
+SIMD_INLINE void inverse_map_cubic_span_n(const InverseMap *map, const ImageBuffer *src,
+                                          unsigned char *dest_img, ImagePixel type, int channels,
+                                          long base, const int *offsets, long count) {
+    inverse_map_filter_span_n(map, src, dest_img, type, channels, 4, base, offsets, count);
+}
+
+SIMD_INLINE void inverse_map_lanczos_span_n(const InverseMap *map, const ImageBuffer *src,
+                                            unsigned char *dest_img, ImagePixel type, int channels,
+                                            long base, const int *offsets, long count) {
+    inverse_map_filter_span_n(map, src, dest_img, type, channels, 6, base, offsets, count);
+}
+
+// --- 描く関数の表 ---
+// 補間の方法 (サンプラ)、チャンネルの型とチャンネル数の組み合わせごとに、型とチャンネル数を定数にした関数を
+// AVX-512 / AVX2 / 汎用の3通り作っておき、描くときは表から1つ選んで呼ぶ。
+// 関数の中ではチャンネルの型と数、読むピクセル数が定数なので、ピクセルごとのループが展開され、
+// 画素ごとにチャンネルの型や数、フィルタの種類で分岐しない
+
+typedef enum {
+    INVERSE_SAMPLER_BILINEAR, // バイリニア補間 (8ビットは固定小数点)
+    INVERSE_SAMPLER_CUBIC,    // 4x4 ピクセルの双3次 (Catmull-Rom, Mitchell)
+    INVERSE_SAMPLER_LANCZOS,  // 6x6 ピクセルの Lanczos-3
+    INVERSE_SAMPLER_MIP,      // ミップマップのトライリニア補間 (8ビットだけ)
+    INVERSE_SAMPLER_COUNT
+} InverseSampler;
+
+#define INVERSE_MAP_PIXEL_u8 IMAGE_PIXEL_U8
+#define INVERSE_MAP_PIXEL_u16 IMAGE_PIXEL_U16
+#define INVERSE_MAP_PIXEL_f32 IMAGE_PIXEL_F32
+
+// sampler の型 pixel (u8, u16, f32)、n チャンネル用の関数を、inverse_map_<sampler>_<pixel>_<n>_{avx512,avx2,generic} として作る
+#define INVERSE_MAP_DEFINE_SPAN(sampler, pixel, n)                                                           \
+    SIMD_INLINE void inverse_map_##sampler##_##pixel##_##n##_body(const InverseMap *map, const ImageBuffer *src, \
+                                                                  unsigned char *dest_img, long base,         \
+                                                                  const int *offsets, long count) {           \
+        inverse_map_##sampler##_span_n(map, src, dest_img, INVERSE_MAP_PIXEL_##pixel, n, base, offsets, count); \
+    }                                                                                                        \
+    SIMD_DEFINE_KERNEL(inverse_map_##sampler##_##pixel##_##n,                                                \
+                       (const InverseMap *map, const ImageBuffer *src, unsigned char *dest_img,              \
+                        long base, const int *offsets, long count),                                          \
+                       (map, src, dest_img, base, offsets, count))
+
+#define INVERSE_MAP_DEFINE_SPANS(sampler, pixel) \
+    INVERSE_MAP_DEFINE_SPAN(sampler, pixel, 1)   \
+    INVERSE_MAP_DEFINE_SPAN(sampler, pixel, 2)   \
+    INVERSE_MAP_DEFINE_SPAN(sampler, pixel, 3)   \
+    INVERSE_MAP_DEFINE_SPAN(sampler, pixel, 4)
+
+INVERSE_MAP_DEFINE_SPANS(bilinear, u8)
+INVERSE_MAP_DEFINE_SPANS(cubic, u8)
+INVERSE_MAP_DEFINE_SPANS(lanczos, u8)
+INVERSE_MAP_DEFINE_SPANS(mip, u8)
+INVERSE_MAP_DEFINE_SPANS(bilinear, u16)
+INVERSE_MAP_DEFINE_SPANS(cubic, u16)
+INVERSE_MAP_DEFINE_SPANS(lanczos, u16)
+INVERSE_MAP_DEFINE_SPANS(bilinear, f32)
+INVERSE_MAP_DEFINE_SPANS(cubic, f32)
+INVERSE_MAP_DEFINE_SPANS(lanczos, f32)
+
+// 1〜4チャンネルの関数を並べた表の1行
+#define INVERSE_MAP_SPAN_ROW(sampler, pixel, level)                                                    \
+    {inverse_map_##sampler##_##pixel##_1_##level, inverse_map_##sampler##_##pixel##_2_##level,        \
+     inverse_map_##sampler##_##pixel##_3_##level, inverse_map_##sampler##_##pixel##_4_##level}
+
+// ミップマップは8ビットだけなので、16ビットと float ではバイリニア補間の関数を置いておく
+#define INVERSE_MAP_SPAN_TABLE(level)                                                                    \
+    {{INVERSE_MAP_SPAN_ROW(bilinear, u8, level), INVERSE_MAP_SPAN_ROW(cubic, u8, level),                \
+      INVERSE_MAP_SPAN_ROW(lanczos, u8, level), INVERSE_MAP_SPAN_ROW(mip, u8, level)},                  \
+     {INVERSE_MAP_SPAN_ROW(bilinear, u16, level), INVERSE_MAP_SPAN_ROW(cubic, u16, level),              \
+      INVERSE_MAP_SPAN_ROW(lanczos, u16, level), INVERSE_MAP_SPAN_ROW(bilinear, u16, level)},           \
+     {INVERSE_MAP_SPAN_ROW(bilinear, f32, level), INVERSE_MAP_SPAN_ROW(cubic, f32, level),              \
+      INVERSE_MAP_SPAN_ROW(lanczos, f32, level), INVERSE_MAP_SPAN_ROW(bilinear, f32, level)}}
+
+// inverse_map_span_funcs[simd_level()][チャンネルの型][サンプラ][チャンネル数 - 1]
+static const inverse_map_span_func inverse_map_span_funcs[3][IMAGE_PIXEL_COUNT][INVERSE_SAMPLER_COUNT][4] = {
+    INVERSE_MAP_SPAN_TABLE(generic), INVERSE_MAP_SPAN_TABLE(avx2), INVERSE_MAP_SPAN_TABLE(avx512)};
+
+// マップの設定 (ミップマップ、フィルタ) から使うサンプラを決める
+static inline InverseSampler inverse_map_sampler(const InverseMap *map) {
+    if (map->mip) {
+        return INVERSE_SAMPLER_MIP;
+    }
+    if (map->filter) {
+        return map->filter->taps == 6 ? INVERSE_SAMPLER_LANCZOS : INVERSE_SAMPLER_CUBIC;
+    }
+    return INVERSE_SAMPLER_BILINEAR;
+}
+
+// チャンネルの型が type で channels チャンネルの画像を描く関数を表から選ぶ
+static inline inverse_map_span_func inverse_map_span_func_for(const InverseMap *map, ImagePixel type, int channels) {
+    return inverse_map_span_funcs[simd_level()][type][inverse_map_sampler(map)][channels - 1];
+}
+
+// 元画像の座標 (x, y) をバイリニア補間し、重み weight をかけて acc に足す (範囲外は画像の外の扱いに従う)
+static inline void inverse_map_accumulate(const InverseMap *map, const ImageBuffer *src,
+                                          double x, double y, float weight, simd_vf4 *acc) {
+    const unsigned char *src_img = src->pixels;
+    ImagePixel type = src->type;
+    int channels = src->channels, px = src->pixel_bytes;
+    if (!inverse_map_border_point(&map->border_x, &x) || !inverse_map_border_point(&map->border_y, &y)) {
+        simd_vf4 black = {0, 0, 0, inverse_map_pixel_one(type)};
+        *acc += black * weight;
+        return;
+    }
+    int x0 = (int) x, y0 = (int) y;
+    float fx = (float) (x - x0), fy = (float) (y - y0);
+    const unsigned char *p00, *p10, *p01, *p11;
+    if (map->source_col) {
+        const long *col = map->source_col, *row = map->source_row;
+        p00 = src_img + (col[x0] + row[y0]) * px;
+        p10 = src_img + (col[x0 + 1] + row[y0]) * px;
+        p01 = src_img + (col[x0] + row[y0 + 1]) * px;
+        p11 = src_img + (col[x0 + 1] + row[y0 + 1]) * px;
+    } else {
+        long stride = src->stride;
+        p00 = src_img + y0 * stride + (long) x0 * px;
+        p10 = p00 + px;
+        p01 = p00 + stride;
+        p11 = p01 + px;
+    }
+    float w00 = (1 - fx) * (1 - fy) * weight, w10 = fx * (1 - fy) * weight;
+    float w01 = (1 - fx) * fy * weight, w11 = fx * fy * weight;
+    *acc += inverse_map_load_pixel_f(p00, type, channels) * w00 + inverse_map_load_pixel_f(p10, type, channels) * w10 +
+            inverse_map_load_pixel_f(p01, type, channels) * w01 + inverse_map_load_pixel_f(p11, type, channels) * w11;
+}
+
+// マップの i 番目のピクセルを元画像から描くか (黒で塗るなら0)
+static inline int inverse_map_drawn(const InverseMap *map, long i) {
+    float x, y;
+    return inverse_map_border_lookup(map, i, &x, &y);
+}
+
+// inverse_map_sample_span で描いたピクセルのうち、縮んで写るピクセルだけを n x n 点の平均で描き直す
+static inline void inverse_map_supersample_span(const InverseMap *map, const ImageBuffer *src, unsigned char *dest_img,
+                                                long base, const int *offsets, long count) {
+    const double c = 0.8944271909999159, s = 0.4472135954999579; // cos, sin(atan(1/2))
+    double dx = map->view.scale_re; // 1ピクセルの幅 (複素平面)
+    double dy = map->view.scale_im;
+    for (long k = 0; k < count; k++) {
+        long i = base + (offsets ? offsets[k] : k);
+        if (!inverse_map_drawn(map, i)) {
+            continue;
+        }
+        // 正則な写像は局所的に等方的なので、横の隣とのずれの大きさが縮小率の目安になる
+        // 左右の隣とも1ピクセル以内しか離れていなければ、f' を計算せずに済ませる
+        int nx = (int) (i % map->width);
+        double spread = -1;
+        for (int d = -1; d <= 1; d += 2) {
+            long j = i + d;
+            if (nx + d >= 0 && nx + d < map->width && inverse_map_drawn(map, j)) {
+                float ex = map->sx[j] - map->sx[i], ey = map->sy[j] - map->sy[i];
+                spread = ex * ex + ey * ey > spread ? ex * ex + ey * ey : spread; // 距離の2乗
+            }
+        }
+        if (spread >= 0 && spread <= 1) {
+            continue;
+        }
+        double complex z = inverse_map_source_point(map, map->sx[i], map->sy[i]);
+        double complex jac = 1.0 / map->scale_df(z); // dz/dw
+        double scale = cabs(jac);
+        if (!isfinite(scale)) {
+            continue; // f'(z) = 0 の点ではずれが求まらないので、1点で描いたままにする
+        }
+        int n = 1;
+        while (n < scale && n < map->supersample) {
+            n *= 2;
+        }
+        if (n == 1) {
+            continue;
+        }
+
+        simd_vf4 acc = {0, 0, 0, 0};
+        float weight = 1.0f / (n * n);
+        for (int q = 0; q < n * n; q++) {
+            // ピクセルの中心からのずれ (出力ピクセル単位) を回転格子に置き、1/f'(z) で元画像のずれにする
+            double gx = ((q % n) + 0.5) / n - 0.5, gy = ((q / n) + 0.5) / n - 0.5;
+            double complex dz = ((c * gx - s * gy) * dx + (s * gx + c * gy) * dy * I) * jac;
+            inverse_map_accumulate(map, src, map->sx[i] + creal(dz) / dx, map->sy[i] + cimag(dz) / dy, weight, &acc);
+        }
+        inverse_map_store_pixel(dest_img + i * src->pixel_bytes, src->type, src->channels,
+                                acc + inverse_map_pixel_bias(src->type));
+    }
+}
+
+// マップの base + offsets[k] 番目 (offsetsがNULLなら base + k 番目) のピクセルを描く
+// span は inverse_map_span_func_for で選んだ関数 (描き始める前に1回だけ選べばよい)
+static inline void inverse_map_sample_span(const InverseMap *map, inverse_map_span_func span,
+                                           const ImageBuffer *src, unsigned char *dest_img,
+                                           long base, const int *offsets, long count) {
+    span(map, src, dest_img, base, offsets, count);
+    if (map->supersample > 1 && !map->mip) {
+        inverse_map_supersample_span(map, src, dest_img, base, offsets, count);
+    }
+}
+
+// 範囲内の t 番目のタイルを描く (inverse_map_sample_rows の仕事1つ分)
+static inline void inverse_map_sample_tile_task(void *ctx, int t) {
+    const InverseMapJob *job = ctx;
+    const InverseMap *map = job->map;
+    int width = map->width;
+    int tile_w = map->tile_size > 0 ? map->tile_size : INVERSE_MAP_SAMPLE_CHUNK;
+    int tile_h = map->tile_size > 0 ? map->tile_size : 1;
+    int x0 = (t % job->n_cols) * tile_w, y0 = (job->row_begin / tile_h + t / job->n_cols) * tile_h;
+    int x1 = x0 + tile_w < width ? x0 + tile_w : width;
+    int y1 = y0 + tile_h < job->row_end ? y0 + tile_h : job->row_end;
+    if (y0 < job->row_begin) {
+        y0 = job->row_begin;
+    }
+    if (map->tile_order && x1 - x0 == tile_w && y1 - y0 == tile_h) {
+        inverse_map_sample_span(map, job->span, job->src, job->dest_img,
+                                (long) y0 * width + x0, map->tile_order, (long) tile_w * tile_h);
+    } else {
+        for (int y = y0; y < y1; y++) {
+            inverse_map_sample_span(map, job->span, job->src, job->dest_img,
+                                    (long) y * width + x0, NULL, x1 - x0);
+        }
+    }
+}
+
+// マップを使って、row_begin行目からrow_end行目の手前までを元画像からバイリニア補間で描く
+// (マップは事前にその行まで計算しておくこと)
+// inverse_map_use_tiles でタイルの大きさが設定されていれば、タイルごとに進む
+// 元画像 src は行順なら INVERSE_MAP_SOURCE_BORDER 以上の余白を付けて image_buffer_load で読み込んだもの、
+// inverse_map_use_source_layout で並べ方を変えたときは inverse_map_layout_source で並べ替えたものを渡す
+// 出力 dest_img は src と同じチャンネルの型と数で、行順に隙間なく並べる
+// (inverse_map_use_mip でミップマップを設定したときは src は使わない。ミップマップは8ビットの画像だけ)
+// (タイルの格子は画像の左上から固定。範囲で切れたタイルの中は行順に進む)
+static inline void inverse_map_sample_rows(const InverseMap *map,
+                                           const ImageBuffer *src, unsigned char *dest_img,
+                                           int row_begin, int row_end) {
+    int channels = src->channels;
+    // タイルを使わないときは、1行を INVERSE_MAP_SAMPLE_CHUNK ずつに分けた高さ1のタイルにする
+    int tile_w = map->tile_size > 0 ? map->tile_size : INVERSE_MAP_SAMPLE_CHUNK;
+    int tile_h = map->tile_size > 0 ? map->tile_size : 1;
+    if (row_end <= row_begin) {
+        return;
+    }
+    InverseMapJob job = {.map = (InverseMap *) map, .row_begin = row_begin, .row_end = row_end,
+                         .n_cols = (map->width + tile_w - 1) / tile_w,
+                         .src = src, .dest_img = dest_img, .channels = channels,
+                         .span = inverse_map_span_func_for(map, src->type, channels)};
+    int n_tile_rows = (row_end - 1) / tile_h - row_begin / tile_h + 1;
+    tile_pool_run(tile_pool_shared(), job.n_cols * n_tile_rows, inverse_map_sample_tile_task, &job);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
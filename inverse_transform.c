@@ -7,90 +7,197 @@
 #include <stdlib.h>
 #include <string.h>
 #include <complex.h>
-#include <math.h> // floorのため
+#include <math.h>
+#include "inverse_map.h"
+#include "image_file.h"
+#include "viewport.h"
 
-// 線形補間を行うヘルパー関数
-// v0とv1の間をt(0.0〜1.0)の割合で混ぜる
-unsigned char lerp(double v0, double v1, double t) {
-    return (unsigned char)((1 - t) * v0 + t * v1);
+// 逆写像で使う関数 (w = z*z の逆関数は z = sqrt(w))
+double complex f_inv(double complex w) {
+    return csqrt(w);
+}
+
+// 元の関数 w = z*z の導関数 (超標本化で縮小率を求めるのに使う)
+double complex df(double complex z) {
+    return 2 * z;
 }
 
 int main(int argc, char *argv[]) {
 
-    if (argc < 2) {
-        printf("画像ファイル名を入力してください。 \n");
+    // 先頭のオプション
+    //   --tile N   出力を N x N のタイルごとに描く
+    //   --morton   タイルの中をモートン順に進む (N は2のべき乗)
+    //   --source-layout L  読む元画像の並べ方 (linear, tiled, morton)
+    //   --supersample N    縮んで写るピクセルだけを、縦横最大 N 点ずつ取って平均する (N は2のべき乗に切り上げる。8まで)
+    //   --filter F         補間フィルタ (bilinear, catmull-rom, mitchell, lanczos3)
+    //   --border X[,Y]     元画像の外の扱い (constant, clamp, wrap, mirror。横と縦で別々にも指定できる)
+    //   --depth D          読んで描いて書く1チャンネルの型 (8, 16, float)。指定しなければ画像ファイルごとにそのままの型
+    //   --center RE,IM     画像の中心に置く複素数 (デフォルトは0)
+    //   --zoom Z           複素平面の範囲を 1/Z にして拡大する (デフォルトは1で、範囲は(-2, -2)から(2, 2))
+    int tile = 0, morton = 0, supersample = 1;
+    InverseSourceLayout layout = INVERSE_SOURCE_LINEAR;
+    ResampleFilter filter = RESAMPLE_BILINEAR;
+    ImageBorder border_x = IMAGE_BORDER_CONSTANT, border_y = IMAGE_BORDER_CONSTANT;
+    ImagePixel depth = IMAGE_PIXEL_U8;
+    int fixed_depth = 0;
+    double complex center = 0;
+    double zoom = 1.0;
+    int first = 1;
+    for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+        if (strcmp(argv[first], "--tile") == 0 && first + 1 < argc) {
+            tile = atoi(argv[++first]);
+            if (tile < 1) {
+                printf("--tile は1以上にしてください\n");
+                return 1;
+            }
+        } else if (strcmp(argv[first], "--morton") == 0) {
+            morton = 1;
+        } else if (strcmp(argv[first], "--filter") == 0 && first + 1 < argc) {
+            if (resample_filter_find(argv[++first], &filter) != 0) {
+                printf("--filter は bilinear, catmull-rom, mitchell, lanczos3 のどれかにしてください\n");
+                return 1;
+            }
+        } else if (strcmp(argv[first], "--supersample") == 0 && first + 1 < argc) {
+            supersample = atoi(argv[++first]);
+            if (supersample < 1 || supersample > INVERSE_MAP_MAX_SUPERSAMPLE) {
+                printf("--supersample は1から%dまでにしてください\n", INVERSE_MAP_MAX_SUPERSAMPLE);
+                return 1;
+            }
+        } else if (strcmp(argv[first], "--border") == 0 && first + 1 < argc) {
+            if (image_border_parse(argv[++first], &border_x, &border_y) != 0) {
+                printf("--border は constant, clamp, wrap, mirror のどれか (横と縦で変えるときは X,Y) にしてください\n");
+                return 1;
+            }
+        } else if (strcmp(argv[first], "--depth") == 0 && first + 1 < argc) {
+            if (image_pixel_find(argv[++first], &depth) != 0) {
+                printf("--depth は 8, 16, float のどれかにしてください\n");
+                return 1;
+            }
+            fixed_depth = 1;
+        } else if (strcmp(argv[first], "--center") == 0 && first + 1 < argc) {
+            if (viewport_parse_center(argv[++first], &center) != 0) {
+                printf("--center は RE,IM の形 (例: 0.5,-1) にしてください\n");
+                return 1;
+            }
+        } else if (strcmp(argv[first], "--zoom") == 0 && first + 1 < argc) {
+            zoom = atof(argv[++first]);
+            if (!(zoom > 0)) {
+                printf("--zoom は0より大きくしてください\n");
+                return 1;
+            }
+        } else if (strcmp(argv[first], "--source-layout") == 0 && first + 1 < argc) {
+            const char *l = argv[++first];
+            if (strcmp(l, "linear") == 0) {
+                layout = INVERSE_SOURCE_LINEAR;
+            } else if (strcmp(l, "tiled") == 0) {
+                layout = INVERSE_SOURCE_TILED;
+            } else if (strcmp(l, "morton") == 0) {
+                layout = INVERSE_SOURCE_MORTON;
+            } else {
+                printf("--source-layout は linear, tiled, morton のどれかにしてください\n");
+                return 1;
+            }
+        } else {
+            printf("不明なオプション: %s\n", argv[first]);
+            return 1;
+        }
+    }
+    if (supersample > 1 && filter != RESAMPLE_BILINEAR) {
+        printf("--supersample と bilinear 以外の --filter は同時に使えません\n");
         return 1;
     }
+    if (morton && tile == 0) {
+        tile = 32;
+    }
 
-    int width, height, channels;
-    char *input_file;
-    input_file = argv[1];
-    unsigned char *input_img = stbi_load(input_file, &width, &height, &channels, 0);
-    if (input_img == NULL) { /* エラー処理 */ return 1; }
-
-    size_t img_size = width * height * channels;
-    unsigned char *output_img = malloc(img_size);
-    if (output_img == NULL) { /* エラー処理 */ return 1; }
-    
-    // --- 逆写像による変換処理 ---
-    // 出力画像の全ピクセル(nx, ny)を走査
-    for (int ny = 0; ny < height; ny++) {
-        for (int nx = 0; nx < width; nx++) {
-            // 1. 出力座標(nx, ny)を複素数wに変換
-            double complex w = ((double)nx / width * 4.0 - 2.0) +
-                               ((double)ny / height * 4.0 - 2.0) * I;
-
-            // 2. 逆関数を使って、wがどのzから来たのかを計算
-            //   w = z*z  の逆関数は z = sqrt(w)
-            double complex z = csqrt(w);
-
-            // 3. 複素数zを入力画像の座標(sx, sy)に変換 (sはsourceのs)
-            double sx = (creal(z) + 2.0) / 4.0 * width;
-            double sy = (cimag(z) + 2.0) / 4.0 * height;
+    if (first >= argc) {
+        printf("画像ファイル名を入力してください。 \n");
+        return 1;
+    }
 
-            // 出力画像の(nx, ny)に書き込む色を決定
-            unsigned char color[4] = {0, 0, 0, 255}; // デフォルトは黒
+    // 座標マップは画像に依存しないので、同じサイズの画像が続く限り使い回す
+    InverseMap map = {0};
 
-            // 4. バイリニア補間
-            // 元画像の座標(sx, sy)が範囲内にある場合のみ色を計算
-            if (sx >= 0 && sx < width -1 && sy >= 0 && sy < height -1) {
-                // 周囲4ピクセルの座標
-                int x1 = (int)floor(sx);
-                int y1 = (int)floor(sy);
-                int x2 = x1 + 1;
-                int y2 = y1 + 1;
+    for (int n = first; n < argc; n++) {
+        int width, height, channels;
+        char *input_file;
+        input_file = argv[n];
+        // 16ビットのPNGやHDRは8ビットに落とさずに、そのままの型で読んで描いて書く
+        ImagePixel type = fixed_depth ? depth : image_file_pixel(input_file);
+        void *input_img = image_file_load(input_file, type, &width, &height, &channels);
+        if (input_img == NULL) { /* エラー処理 */ return 1; }
 
-                // 4ピクセル間の距離(0.0-1.0)
-                double x_diff = sx - x1;
-                double y_diff = sy - y1;
+        size_t img_size = (size_t) width * height * channels * image_pixel_size(type);
+        unsigned char *output_img = malloc(img_size);
+        if (output_img == NULL) { /* エラー処理 */ return 1; }
 
-                // 4ピクセルのアドレスを計算
-                int p1_idx = (y1 * width + x1) * channels; //左上
-                int p2_idx = (y1 * width + x2) * channels; //右上
-                int p3_idx = (y2 * width + x1) * channels; //左下
-                int p4_idx = (y2 * width + x2) * channels; //右下
+        // --- 逆写像による変換処理 ---
+        // 出力座標(nx, ny)を複素数wに変換し、逆関数でwがどのzから来たのかを計算して
+        // 元画像の座標(sx, sy)を求める。複素平面の範囲は(-2, -2)から(2, 2) を --center, --zoom で動かしたもの
+        Viewport view;
+        viewport_init(&view, -2.0, 2.0, -2.0, 2.0, width, height);
+        if (zoom != 1.0 || center != 0) {
+            viewport_zoom(&view, center, zoom);
+        }
+        if (!inverse_map_matches(&map, f_inv, &view)) {
+            inverse_map_free(&map);
+            if (inverse_map_init(&map, f_inv, &view) != 0) {
+                printf("メモリ確保エラー\n");
+                return 1;
+            }
+            if (inverse_map_use_tiles(&map, tile, morton) != 0) {
+                printf("--morton のタイルの大きさは2のべき乗にしてください\n");
+                return 1;
+            }
+            if (inverse_map_use_source_layout(&map, layout) != 0) {
+                printf("メモリ確保エラー\n");
+                return 1;
+            }
+            inverse_map_use_supersample(&map, supersample, df);
+            inverse_map_use_filter(&map, filter);
+            inverse_map_use_border(&map, border_x, border_y);
+            inverse_map_build(&map);
+        }
 
-                // 各チャンネル(R, G, B)ごとに補間を行う
-                for (int i = 0; i < channels; i++) {
-                    // 上段の2ピクセルを水平方向に補間
-                    double top_val = lerp(input_img[p1_idx + i], input_img[p2_idx + i], x_diff);
-                    // 下段の2ピクセルを水平方向に補間
-                    double bottom_val = lerp(input_img[p3_idx + i], input_img[p4_idx + i], x_diff);
-                    // 上下段の結果を垂直方向に補間
-                    color[i] = lerp(top_val, bottom_val, y_diff);
-                }
+        // 元画像を余白付きにコピーし、決めた並べ方にする
+        ImageBuffer source = {0}, laid_out = {0};
+        const ImageBuffer *sample_src = &source;
+        if (image_buffer_load(&source, input_img, width, height, channels, type,
+                              INVERSE_MAP_SOURCE_BORDER, border_x, border_y) != 0) {
+            printf("メモリ確保エラー\n");
+            return 1;
+        }
+        if (layout != INVERSE_SOURCE_LINEAR) {
+            if (inverse_map_layout_source(&map, &source, &laid_out) != 0) {
+                printf("メモリ確保エラー\n");
+                return 1;
             }
+            sample_src = &laid_out;
+        }
+
+        // 出力画像の全ピクセルをバイリニア補間 (--filter で選んだフィルタ) で描く
+        inverse_map_sample_rows(&map, sample_src, output_img, 0, height);
 
-            // 計算した色を出力画像に書き込む
-            int dest_index = (ny * width + nx) * channels;
-            memcpy(output_img + dest_index, color, channels);
+        // 1枚目は output_inverse.png、2枚目以降は output_inverse_2.png, ... に保存
+        // (16ビットは16ビットのPNG、float は output_inverse.hdr などの Radiance HDR)
+        char output_file[64];
+        if (n > first) {
+            snprintf(output_file, sizeof(output_file), "output_inverse_%d.%s", n - first + 1, image_file_extension(type));
+        } else {
+            snprintf(output_file, sizeof(output_file), "output_inverse.%s", image_file_extension(type));
         }
+        printf("逆写像とバイリニア補間を使って高品質な変換を行いました。\n");
+        if (!image_file_write(output_file, type, width, height, channels, output_img)) {
+            printf("%s を書き込めませんでした\n", output_file);
+            return 1;
+        }
+
+        image_buffer_free(&source);
+        image_buffer_free(&laid_out);
+        stbi_image_free(input_img);
+        free(output_img);
     }
-    
-    printf("逆写像とバイリニア補間を使って高品質な変換を行いました。\n");
-    stbi_write_png("output_inverse.png", width, height, channels, output_img, 0);
 
-    stbi_image_free(input_img);
-    free(output_img);
+    inverse_map_free(&map);
     return 0;
-}
\ No newline at end of file
+}
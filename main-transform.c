@@ -2,9 +2,18 @@
 #include <stdlib.h>
 #include <complex.h>
 #include <SDL2/SDL.h>
-#include <omp.h>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+#include "inverse_map.h"
+#include "map_cache.h"
+#include "forward_map.h"
+#include "forward_mesh.h"
+#include "newton.h"
+#include "complex_funcs.h"
+#include "expr.h"
+#include "viewport.h"
 #define PI 3.1415926535
 
 // プログラムの状態を定義する
@@ -19,6 +28,10 @@ typedef enum {
     STATE_DONE                    // 完成、静止画表示
 } ProgramState;
 
+// 経過時間を測るための時刻 (秒)
+double now_seconds(void) {
+    return (double) SDL_GetPerformanceCounter() / SDL_GetPerformanceFrequency();
+}
 
 
 // -----------------------------------------------
@@ -36,6 +49,7 @@ double complex f(double complex z) {
 }
 
 //変換に使用した複素関数の１階導関数をここに記入
+//(導関数を書きたくなければ、--expr で式を指定すれば自動微分で求める)
 double complex df(double complex z) {
     return cexp(z);
 
@@ -47,32 +61,212 @@ double complex df(double complex z) {
     // return 1 / (ccosh(z) * ccosh(z));
 }  
 
-// 逆関数 (ニュートン法)
-double complex f_inv(double complex w) {
+//ニュートン法で使う、f(z) を返して f'(z) を *dz に入れる関数
+//上の f, df から作るので、関数を変えるときは f, df だけを書き換えればよい
+//(CUSTOM_FUSED_FDF を定義してコンパイルすると、f と f' で共通の部分を1回だけ計算する下の手書き版を使う。
+// そのときは f, df と同じ関数になるように、こちらも合わせて書き換えること)
+double complex f_and_df(double complex z, double complex *dz) {
+#ifdef CUSTOM_FUSED_FDF
+    double complex e = cexp(z);
+    *dz = e;
+    return e;
+
+    //-----サンプル-----
+    // double complex a = cexp(z), b = cexp(-z); *dz = a - b; return a + b;
+    // *dz = 2 * z; return z * z;
+    // *dz = ccos(z); return csin(z);
+    // *dz = 3 * z * z; return cpow(z, 3);
+    // double complex c = ccosh(z); *dz = 1 / (c * c); return ctanh(z);
+#else
+    *dz = df(z);
+    return f(z);
+#endif
+}
 
+// 上の f, df (と f_and_df) を使う関数 (--func を指定しなければこれを使う)
+// (座標マップのキャッシュは実行ファイルのハッシュで区別するので、f, df を書き換えて再コンパイルすれば作り直される)
+const ComplexFunction custom_func = {"custom", "f(z)", f, df, f_and_df, NULL, SIMD_FUNC_NONE};
+
+// --expr で指定した式 (バイトコードにコンパイルして使う。f' は自動微分で求める)
+ExprProgram expr_prog;
+double complex expr_f(double complex z) { return expr_eval(&expr_prog, z); }
+double complex expr_df(double complex z) {
+    double complex d;
+    expr_eval_dual(&expr_prog, z, &d);
+    return d;
+}
+double complex expr_fdf(double complex z, double complex *dz) { return expr_eval_dual(&expr_prog, z, dz); }
+ComplexFunction expr_func = {"expr", NULL, expr_f, expr_df, expr_fdf, NULL, SIMD_FUNC_NONE};
+
+// 変換に使う関数と、逆関数の枝 (コマンドライン引数で変更できる)
+const ComplexFunction *func = &custom_func;
+int func_branch = 0;
+int force_newton = 0;  // 解析的な逆関数があってもニュートン法で解く
+int use_simd = 1;      // SIMD版があれば使う
+double adaptive_tol = 0;  // 0より大きければ、粗い格子だけ解いて誤差がこれ以下のセルは補間する
+int adaptive_cell = 32;   // 適応的に計算するときの最初のセルの大きさ
+int sample_tile = 0;      // 0より大きければ、逆写像の出力をこの大きさのタイルごとに描く
+int sample_morton = 0;    // タイルの中をモートン順 (Z字) に進む
+InverseSourceLayout source_layout = INVERSE_SOURCE_LINEAR; // 逆写像で読む元画像の並べ方
+int forward_splat = 0;    // 順写像でスプラットし、逆写像の代わりに穴を埋めて仕上げる
+int forward_mesh = 0;     // 逆写像の代わりに、三角形メッシュを順写像して塗って仕上げる
+int sample_mip = 0;       // 逆写像で元画像のミップマップから縮小率に合わせて描く
+ResampleFilter sample_filter = RESAMPLE_BILINEAR; // 逆写像で描くときの補間フィルタ
+int supersample = 1;      // 1より大きければ、逆写像で縮んで写るピクセルを最大でこの数の2乗の点で平均する
+ImageBorder border_x = IMAGE_BORDER_CONSTANT, border_y = IMAGE_BORDER_CONSTANT; // 逆写像で元画像の外を読むときの扱い
+double complex view_center = 0; // 複素平面の範囲の中心
+double view_zoom = 1.0;         // 複素平面の範囲の倍率 (2なら範囲が縦横半分になり、拡大して描かれる)
+
+// ニュートン法の設定 (コマンドライン引数で変更できる)
+NewtonParams newton_params = NEWTON_DEFAULT_PARAMS;
+
+// 逆関数 (解析的な逆関数があればそれを使い、なければニュートン法で z = w から解く)
+double complex f_inv(double complex w) {
+    if (func->inv && !force_newton) {
+        return func->inv(w, func_branch);
+    }
     double complex z = w;
-     for (int i = 0; i < 100; i++) {
-        double complex f_z = f(z);
-        double complex df_z = df(z);
-            
-        // ゼロ除算を避ける
-        if (cabs(df_z) < 1e-6) {
-            break;
-        }
+    newton_solve(func->fdf, &newton_params, w, &z, newton_params.max_iter, NULL);
+    return z;
+}
+
+// EXPR_BLOCK ピクセル分の w = f(z) をまとめて計算する (SIMD版の関数か、--expr の式)
+void eval_block(SimdFuncKind simd, const double *zre, const double *zim, double *wre, double *wim) {
+    if (func == &expr_func) {
+        expr_eval_block(&expr_prog, EXPR_BLOCK, zre, zim, wre, wim, NULL, NULL);
+        return;
+    }
+    for (int k = 0; k < EXPR_BLOCK; k += SIMD_LANES) {
+        simd_eval_block(simd, zre + k, zim + k, wre + k, wim + k, NULL, NULL);
+    }
+}
 
-        // ニュートン法の更新式: z_new = z - (f(z)-w) / f'(z)
-        z = z - (f_z - w) / df_z;
-     }
-     return z;
+// 順写像の行き先を求める仕事のデータ
+typedef struct {
+    ForwardMap *map;
+    int begin, end;      // 元ピクセルの番号の範囲
+    SimdFuncKind simd;
+    int block_eval;      // SIMD版か式なら EXPR_BLOCK ピクセルずつまとめて計算する
+} ForwardTargetJob;
+
+// 元ピクセルの区間 (FORWARD_MAP_CHUNK ずつ) の行き先 w = f(z) を求める
+void forward_target_task(void *ctx, int chunk) {
+    const ForwardTargetJob *job = ctx;
+    ForwardMap *map = job->map;
+    int begin = job->begin + chunk * FORWARD_MAP_CHUNK;
+    int end = begin + FORWARD_MAP_CHUNK < job->end ? begin + FORWARD_MAP_CHUNK : job->end;
+    // 元ピクセルの複素数 z は、区間の先頭から行順に足し算だけで進めて求める
+    ViewportCursor cur = viewport_cursor(&map->view, begin);
+
+    for (int p0 = begin; p0 < end; p0 += EXPR_BLOCK) {
+        int n = end - p0 < EXPR_BLOCK ? end - p0 : EXPR_BLOCK;
+        if (job->block_eval) {
+            double zre[EXPR_BLOCK], zim[EXPR_BLOCK], wre[EXPR_BLOCK], wim[EXPR_BLOCK];
+            for (int k = 0; k < EXPR_BLOCK; k++) {
+                zre[k] = cur.re; // 余ったところは最後のピクセルを繰り返す
+                zim[k] = cur.im;
+                if (k < n - 1) {
+                    viewport_cursor_next(&map->view, &cur);
+                }
+            }
+            viewport_cursor_next(&map->view, &cur); // 次のブロックの先頭
+            eval_block(job->simd, zre, zim, wre, wim);
+            for (int k = 0; k < n; k++) {
+                forward_map_set(map, p0 + k, wre[k] + wim[k] * I);
+            }
+        } else {
+            for (int p = p0; p < p0 + n; p++) {
+                forward_map_set(map, p, func->f(cur.re + cur.im * I));
+                viewport_cursor_next(&map->view, &cur);
+            }
+        }
+    }
 }
 
 // -----------------------------------------------
 
 
 
-// 線形補間
-unsigned char lerp(double v0, double v1, double t) {
-    return (unsigned char)((1 - t) * v0 + t * v1);
+// ニュートン法の反復回数と残差の集計を表示し、ヒートマップ画像を保存する
+void write_newton_stats(const InverseMap *map) {
+    long n = (long) map->width * map->height;
+    long total = 0, not_converged = 0;
+    int max_iter = 0;
+
+    // 収束したかはニュートン法の判定をそのまま使う (float で解いたときは float の許容値で判定してある)
+    for (long i = 0; i < n; i++) {
+        total += map->iterations[i];
+        if (map->iterations[i] > max_iter) {
+            max_iter = map->iterations[i];
+        }
+        if (!map->converged[i]) {
+            not_converged++;
+        }
+    }
+    printf("ニュートン法: 平均反復回数 %.2f, 最大反復回数 %d, 収束しなかったピクセル %ld / %ld\n",
+           (double) total / n, max_iter, not_converged, n);
+
+    unsigned char *rgb = malloc(n * 3);
+    if (!rgb) {
+        printf("メモリ確保エラー\n");
+        return;
+    }
+    inverse_map_stats_heatmap(map, 0, rgb);
+    stbi_write_png("newton_iterations.png", map->width, map->height, 3, rgb, 0);
+    inverse_map_stats_heatmap(map, 1, rgb);
+    stbi_write_png("newton_residual.png", map->width, map->height, 3, rgb, 0);
+    printf("newton_iterations.png, newton_residual.png として保存しました\n");
+    free(rgb);
+}
+
+// 逆写像の座標マップを確保し、計算方法を設定する (ニュートン法の設定は params)
+// 成功すれば0、メモリ確保に失敗すれば-1を返す
+int setup_inverse_map(InverseMap *map, const NewtonParams *params, SimdFuncKind simd, int block_eval,
+                      const Viewport *view) {
+    if (inverse_map_init(map, f_inv, view) != 0) {
+        return -1;
+    }
+    if (!func->inv || force_newton) {
+        // 解析的な逆関数がなければ、隣のピクセルの解を初期値にしてニュートン法で解く
+        inverse_map_use_newton(map, func->fdf, params);
+    }
+    if (simd != SIMD_FUNC_NONE) {
+        // SIMD版があれば8ピクセルずつまとめて計算する
+        inverse_map_use_simd(map, simd, func_branch);
+    } else if (block_eval) {
+        // 式は8ピクセルずつバイトコードで計算する
+        inverse_map_use_block_func(map, expr_block_func, &expr_prog);
+    }
+    if (adaptive_tol > 0 && inverse_map_use_adaptive(map, adaptive_cell, adaptive_tol) != 0) {
+        inverse_map_free(map);
+        return -1;
+    }
+    return 0;
+}
+
+// 同じ条件で double だけで計算したマップと比べて、精度の違いによる誤差と計算時間を表示する
+void report_accuracy(const InverseMap *map, double seconds, SimdFuncKind simd, int block_eval) {
+    static const char *names[] = {"double", "float", "混合精度"};
+    NewtonParams params = newton_params;
+    params.precision = NEWTON_PRECISION_DOUBLE;
+
+    InverseMap ref;
+    if (setup_inverse_map(&ref, &params, simd, block_eval, &map->view) != 0) {
+        printf("メモリ確保エラー\n");
+        return;
+    }
+    double start = now_seconds();
+    inverse_map_build(&ref);
+    double ref_seconds = now_seconds() - start;
+
+    InverseMapDiff diff;
+    inverse_map_compare(map, &ref, &diff);
+    printf("精度の比較 (%s / double): 最大誤差 %.2e ピクセル, 平均誤差 %.2e ピクセル (%ld ピクセル)\n",
+           names[newton_params.precision], diff.max_error, diff.mean_error, diff.compared);
+    printf("  別の枝の解 %ld ピクセル, 範囲内かどうかが違う %ld ピクセル\n",
+           diff.branch_mismatch, diff.valid_mismatch);
+    printf("  マップの計算時間 %.3f 秒 (double: %.3f 秒)\n", seconds, ref_seconds);
+    inverse_map_free(&ref);
 }
 
 int main(int argc, char* argv[]) {
@@ -82,6 +276,155 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    // オプション
+    //   --func NAME     complex_funcs.h の関数を使う (指定しなければ上の f, df, f_and_df)
+    //   --expr EXPR     式で関数を指定する (例: "z^3 - 1"、書き方は expr.h)
+    //   --branch K      解析的な逆関数で何番目の枝を使うか (0が主値)
+    //   --stats         ピクセルごとの反復回数と残差を記録してヒートマップを保存する
+    //   --max-iter N    z = w から解くときの反復回数の上限
+    //   --warm-iter N   隣のピクセルの解から解くときの反復回数の上限
+    //   --tol R         残差の許容値 (|f(z) - w| <= R * (1 + |w|) で収束)
+    //   --step-tol S    更新量の許容値 (|Δz| <= S * (1 + |z|) で収束)
+    //   --newton        解析的な逆関数があってもニュートン法で解く
+    //   --no-simd       SIMD版の関数を使わない
+    //   --adaptive E    粗い格子だけを解き、補間の誤差が E ピクセル以下のところは補間する
+    //   --cell N        --adaptive の最初のセルの大きさ (ピクセル)
+    //   --precision P   SIMD版のニュートン法の精度 (double, float, mixed)
+    //   --accuracy      double だけで計算したマップとの誤差と計算時間を表示する
+    //   --tile N        逆写像の出力を N x N のタイルごとに描く
+    //   --morton        タイルの中をモートン順に進む (N は2のべき乗)
+    //   --source-layout L  逆写像で読む元画像の並べ方 (linear, tiled, morton)
+    //   --splat         順写像でスプラットして穴を埋め、逆写像 (ニュートン法) を使わずに仕上げる
+    //   --mesh          三角形メッシュを順写像して塗り、逆写像 (ニュートン法) を使わずに仕上げる
+    //   --mip           逆写像で縮んで写るところを、元画像のミップマップからトライリニア補間で描く
+    //   --supersample N 逆写像で縮んで写るピクセルだけを、縦横最大 N 点ずつ (N x N 点) 取って平均する
+    //   --filter F      逆写像で描くときの補間フィルタ (bilinear, catmull-rom, mitchell, lanczos3)
+    //   --border X[,Y]  逆写像で元画像の外を読むときの扱い (constant, clamp, wrap, mirror。横と縦で別々にも指定できる)
+    //   --center RE,IM  画像の中心に置く複素数 (デフォルトは0)
+    //   --zoom Z        複素平面の範囲を 1/Z にして拡大する (デフォルトは1で、範囲は(-π, -π)から(π, π))
+    int show_stats = 0;
+    int check_accuracy = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--func") == 0 && i + 1 < argc) {
+            func = complex_function_find(argv[++i]);
+            if (!func) {
+                printf("不明な関数: %s\n使える関数:\n", argv[i]);
+                complex_function_print_list();
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--expr") == 0 && i + 1 < argc) {
+            char error[256];
+            if (expr_compile(&expr_prog, argv[++i], error, sizeof(error)) != 0) {
+                printf("式のエラー: %s\n", error);
+                return 1;
+            }
+            expr_func.expr = argv[i];
+            func = &expr_func;
+        } else if (strcmp(argv[i], "--branch") == 0 && i + 1 < argc) {
+            func_branch = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            show_stats = 1;
+        } else if (strcmp(argv[i], "--max-iter") == 0 && i + 1 < argc) {
+            newton_params.max_iter = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--warm-iter") == 0 && i + 1 < argc) {
+            newton_params.warm_iter = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tol") == 0 && i + 1 < argc) {
+            newton_params.res_tol = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--step-tol") == 0 && i + 1 < argc) {
+            newton_params.step_tol = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--newton") == 0) {
+            force_newton = 1;
+        } else if (strcmp(argv[i], "--no-simd") == 0) {
+            use_simd = 0;
+        } else if (strcmp(argv[i], "--adaptive") == 0 && i + 1 < argc) {
+            adaptive_tol = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--cell") == 0 && i + 1 < argc) {
+            adaptive_cell = atoi(argv[++i]);
+            if (adaptive_cell < 2) {
+                printf("--cell は2以上にしてください\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--precision") == 0 && i + 1 < argc) {
+            const char *p = argv[++i];
+            if (strcmp(p, "double") == 0) {
+                newton_params.precision = NEWTON_PRECISION_DOUBLE;
+            } else if (strcmp(p, "float") == 0) {
+                newton_params.precision = NEWTON_PRECISION_FLOAT;
+            } else if (strcmp(p, "mixed") == 0) {
+                newton_params.precision = NEWTON_PRECISION_MIXED;
+            } else {
+                printf("--precision は double, float, mixed のどれかにしてください\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--accuracy") == 0) {
+            check_accuracy = 1;
+        } else if (strcmp(argv[i], "--tile") == 0 && i + 1 < argc) {
+            sample_tile = atoi(argv[++i]);
+            if (sample_tile < 1) {
+                printf("--tile は1以上にしてください\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--morton") == 0) {
+            sample_morton = 1;
+        } else if (strcmp(argv[i], "--splat") == 0) {
+            forward_splat = 1;
+        } else if (strcmp(argv[i], "--mesh") == 0) {
+            forward_mesh = 1;
+        } else if (strcmp(argv[i], "--mip") == 0) {
+            sample_mip = 1;
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            if (resample_filter_find(argv[++i], &sample_filter) != 0) {
+                printf("--filter は bilinear, catmull-rom, mitchell, lanczos3 のどれかにしてください\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--border") == 0 && i + 1 < argc) {
+            if (image_border_parse(argv[++i], &border_x, &border_y) != 0) {
+                printf("--border は constant, clamp, wrap, mirror のどれか (横と縦で変えるときは X,Y) にしてください\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--center") == 0 && i + 1 < argc) {
+            if (viewport_parse_center(argv[++i], &view_center) != 0) {
+                printf("--center は RE,IM の形 (例: 0.5,-1) にしてください\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--zoom") == 0 && i + 1 < argc) {
+            view_zoom = atof(argv[++i]);
+            if (!(view_zoom > 0)) {
+                printf("--zoom は0より大きくしてください\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--supersample") == 0 && i + 1 < argc) {
+            supersample = atoi(argv[++i]);
+            if (supersample < 1 || supersample > INVERSE_MAP_MAX_SUPERSAMPLE) {
+                printf("--supersample は1から%dまでにしてください\n", INVERSE_MAP_MAX_SUPERSAMPLE);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--source-layout") == 0 && i + 1 < argc) {
+            const char *l = argv[++i];
+            if (strcmp(l, "linear") == 0) {
+                source_layout = INVERSE_SOURCE_LINEAR;
+            } else if (strcmp(l, "tiled") == 0) {
+                source_layout = INVERSE_SOURCE_TILED;
+            } else if (strcmp(l, "morton") == 0) {
+                source_layout = INVERSE_SOURCE_MORTON;
+            } else {
+                printf("--source-layout は linear, tiled, morton のどれかにしてください\n");
+                return 1;
+            }
+        } else {
+            printf("不明なオプション: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (sample_mip && (supersample > 1 || sample_filter != RESAMPLE_BILINEAR)) {
+        printf("--mip と --supersample, --filter は同時に使えません\n");
+        return 1;
+    }
+    if (supersample > 1 && sample_filter != RESAMPLE_BILINEAR) {
+        printf("--supersample と bilinear 以外の --filter は同時に使えません\n");
+        return 1;
+    }
+
     char *input_file = argv[1];
     int width, height, channels;
     unsigned char *original_img = stbi_load(input_file, &width, &height, &channels, 0);
@@ -105,6 +448,95 @@ int main(int argc, char* argv[]) {
     memset(holey_dest_img, 0, img_size);             // 穴あき画像を黒で初期化
     memcpy(final_img, holey_dest_img, img_size);   // 最終画像も最初は穴あき画像
 
+    // 画像に対応させる複素平面の範囲 ((-π, -π)から(π, π)を --center, --zoom で動かしたもの)
+    // 元画像と出力画像は同じ範囲に対応させる
+    Viewport view;
+    viewport_init(&view, -PI, PI, -PI, PI, width, height);
+    if (view_zoom != 1.0 || view_center != 0) {
+        viewport_zoom(&view, view_center, view_zoom);
+    }
+
+    // 順写像の作業用
+    ForwardMap fwd_map;
+    if (forward_map_init(&fwd_map, &view) != 0 ||
+        (forward_splat && forward_map_enable_splat(&fwd_map, channels) != 0)) {
+        printf("メモリ確保エラー\n");
+        return -1;
+    }
+
+    // 逆写像の座標マップ (関数・範囲・サイズが同じ限り、計算結果を使い回す)
+    // 以前に保存したキャッシュファイルがあれば、ニュートン法を使わずにそれを読み込む
+    // (--stats, --accuracy のときは反復回数や計算時間を調べるため、キャッシュを使わずに計算する)
+    InverseMap inv_map;
+    SimdFuncKind simd = use_simd ? func->simd : SIMD_FUNC_NONE;
+    int block_eval = simd != SIMD_FUNC_NONE || (use_simd && func == &expr_func);
+    double func_key[10] = {func_branch, newton_params.max_iter, newton_params.warm_iter,
+                           newton_params.res_tol, newton_params.step_tol, force_newton, block_eval,
+                           adaptive_tol, adaptive_tol > 0 ? adaptive_cell : 0, newton_params.precision};
+    // --func, --expr の関数は名前と式で区別できるが、上の f() はソースを書き換えても名前が変わらないので、
+    // 実行ファイルのハッシュでも区別する (読めなければキャッシュを使わない)
+    const char *func_id = func == &expr_func ? func->expr : func->name;
+    uint64_t code_id = 0;
+    int cacheable = func != &custom_func || map_cache_build_id(&code_id) == 0;
+    uint64_t map_key = map_cache_key(func_id, code_id, func->f, func->df, func_key, 10, &view);
+    double map_seconds = 0.0; // マップの計算にかかった時間
+    if (cacheable && !show_stats && !check_accuracy &&
+        map_cache_load(&inv_map, map_key, f_inv, &view) == 0) {
+        printf("座標マップをキャッシュから読み込みました\n");
+    } else if (setup_inverse_map(&inv_map, &newton_params, simd, block_eval, &view) == 0) {
+        if (block_eval) {
+            printf("SIMD: %s\n", simd_level_name());
+        }
+        if (newton_params.precision != NEWTON_PRECISION_DOUBLE &&
+            (!inv_map.fdf || inverse_map_simd_lanes(&inv_map) != SIMD_LANES_F)) {
+            printf("float で計算できるのはSIMD版の関数のニュートン法だけなので、double で計算します\n");
+        }
+        if (show_stats && inverse_map_enable_stats(&inv_map) != 0) {
+            printf("メモリ確保エラー\n");
+            return -1;
+        }
+    } else {
+        printf("メモリ確保エラー\n");
+        return -1;
+    }
+    if (sample_morton && sample_tile == 0) {
+        sample_tile = 32;
+    }
+    if (inverse_map_use_tiles(&inv_map, sample_tile, sample_morton) != 0) {
+        printf("--morton のタイルの大きさは2のべき乗にしてください\n");
+        return 1;
+    }
+
+    // 逆写像で読む元画像 (余白付きのコピー。並べ方を変えるときはさらに並べ替えたコピー)
+    ImageBuffer source_buf = {0}, layout_buf = {0};
+    const ImageBuffer *sample_src = &source_buf;
+    if (image_buffer_load(&source_buf, original_img, width, height, channels, IMAGE_PIXEL_U8,
+                          INVERSE_MAP_SOURCE_BORDER, border_x, border_y) != 0) {
+        printf("メモリ確保エラー\n");
+        return -1;
+    }
+    if (source_layout != INVERSE_SOURCE_LINEAR) {
+        if (inverse_map_use_source_layout(&inv_map, source_layout) != 0 ||
+            inverse_map_layout_source(&inv_map, &source_buf, &layout_buf) != 0) {
+            printf("メモリ確保エラー\n");
+            return -1;
+        }
+        sample_src = &layout_buf;
+    }
+
+    // 逆写像で読むミップマップ (段は出力ピクセルごとに f' から選ぶ)
+    MipPyramid mip = {0};
+    if (sample_mip) {
+        if (mip_pyramid_build(&mip, original_img, width, height, channels) != 0) {
+            printf("メモリ確保エラー\n");
+            return -1;
+        }
+        inverse_map_use_mip(&inv_map, &mip, func->df);
+    }
+    inverse_map_use_supersample(&inv_map, supersample, func->df);
+    inverse_map_use_filter(&inv_map, sample_filter);
+    inverse_map_use_border(&inv_map, border_x, border_y);
+
     SDL_Init(SDL_INIT_VIDEO);
 
     // ウィンドウ、レンダラー、テクスチャのポインタを準備
@@ -155,25 +587,21 @@ int main(int argc, char* argv[]) {
                 break;
 
             case STATE_FORWARD_MAPPING:
-                // 順写像を少しずつ進める
+                // 順写像を少しずつ進める (行き先を並列に求めてから、並列に書き込む)
                 int pixels_per_frame = width * 5; // 速度調整
-                for (int i = 0; i < pixels_per_frame && forward_progress < width * height; i++) {
-                    int x = forward_progress % width;
-                    int y = forward_progress / width;
-                    
-                    double complex z = ((double) x / width * (2 * PI) - PI) + ((double) y / height * (2 * PI) - PI) * I;
-                    double complex w = f(z);
-                    int nx = (int) ((creal(w) + PI) / (2 * PI) * width);
-                    int ny = (int) ((cimag(w) + PI) / (2 * PI) * height);
-
-                    int src_idx = (y * width + x) * channels;
-                    if (nx >= 0 && nx < width && ny >= 0 && ny < height) {
-                        int dest_idx = (ny * width + nx) * channels;
-                        memcpy(holey_dest_img + dest_idx, source_work_img + src_idx, channels);
-                    }
-                    memset(source_work_img + src_idx, 0, channels); // 元画像のピクセルを黒くする
-                    forward_progress++;
+                int forward_end = forward_progress + pixels_per_frame < width * height ?
+                                  forward_progress + pixels_per_frame : width * height;
+                ForwardTargetJob target_job = {&fwd_map, forward_progress, forward_end, simd, block_eval};
+                tile_pool_run(tile_pool_shared(), (forward_end - forward_progress + FORWARD_MAP_CHUNK - 1) / FORWARD_MAP_CHUNK,
+                              forward_target_task, &target_job);
+                forward_map_scatter(&fwd_map, forward_progress, forward_end, source_work_img, holey_dest_img, channels);
+                if (forward_splat) {
+                    forward_map_splat(&fwd_map, forward_progress, forward_end, source_work_img);
                 }
+                // 元画像のピクセルを黒くする
+                memset(source_work_img + (size_t) forward_progress * channels, 0,
+                       (size_t) (forward_end - forward_progress) * channels);
+                forward_progress = forward_end;
                 if (forward_progress >= width * height) {
                     currentState = STATE_CLEANUP_FORWARD;
                 }
@@ -205,38 +633,64 @@ int main(int argc, char* argv[]) {
                 break;
 
             case STATE_INVERSE_MAPPING:
+                if (forward_splat) {
+                    // スプラットした色を重みで割り、穴を埋めて仕上げる (逆写像は使わない)
+                    if (forward_map_resolve_splat(&fwd_map, final_img) != 0) {
+                        printf("メモリ確保エラー\n");
+                        memcpy(final_img, holey_dest_img, img_size);
+                    }
+                    currentState = STATE_DONE;
+                    SDL_SetWindowTitle(win_main, "変換完了！");
+                    break;
+                }
+                if (forward_mesh) {
+                    // 三角形メッシュを写して塗る (穴あき画像の上に重ねる。逆写像は使わない)
+                    ForwardMesh mesh;
+                    double mesh_start = now_seconds();
+                    if (forward_mesh_build(&mesh, func->f, func->df, &view) != 0 ||
+                        forward_mesh_render(&mesh, original_img, final_img, channels) != 0) {
+                        printf("メモリ確保エラー\n");
+                    } else if (show_stats) {
+                        printf("メッシュ: セル %ld, 三角形 %ld, %.3f 秒\n", mesh.n_cells, mesh.n_triangles,
+                               now_seconds() - mesh_start);
+                    }
+                    forward_mesh_free(&mesh);
+                    currentState = STATE_DONE;
+                    SDL_SetWindowTitle(win_main, "変換完了！");
+                    break;
+                }
                 SDL_SetWindowTitle(win_main, "修復中...");
                 // 逆写像を少しずつ進める
                 int rows_per_frame = 5; // 速度調整
-                for (int i = 0; i < rows_per_frame && inverse_row < height; i++) {
-                    int ny = inverse_row;
-
-                    #pragma omp parallel for
-                    for (int nx = 0; nx < width; nx++) {
-                        double complex w = ((double) nx / width * (2 * PI) - PI) + ((double) ny / height * (2 * PI) - PI) * I;
-                        double complex z = f_inv(w);
-                        double sx = (creal(z) + PI) / (2 * PI) * width;
-                        double sy = (cimag(z) + PI) / (2 * PI) * height;
-                        
-                        unsigned char color[] = {0, 0, 0, 255};
-                        if (sx >= 0 && sx < width - 1 && sy >= 0 && sy < height - 1) {
-                            // バイリニア補間
-                            int x1 = (int) sx, y1 = (int) sy;
-                            double xd = sx - x1, yd = sy - y1;
-                            for(int c = 0; c < channels; c++) {
-                                double p1 = original_img[(y1 * width + x1) * channels + c];
-                                double p2 = original_img[(y1 * width + x1 + 1) * channels + c];
-                                double p3 = original_img[((y1 + 1) * width + x1) * channels + c];
-                                double p4 = original_img[((y1 + 1) * width + x1 + 1) * channels + c];
-                                double top = lerp(p1, p2, xd), bot = lerp(p3 ,p4 ,xd);
-                                color[c] = lerp(top, bot, yd);
-                            }
-                        }
-                        memcpy(final_img + (ny * width + nx) * channels, color, channels);
-                    }
-                    inverse_row++;
+                int row_end = inverse_row + rows_per_frame;
+                if (inv_map.tile_size > 0) {
+                    // タイルごとに描くときは、タイルが途中で切れないように帯の高さをタイルの倍数にそろえる
+                    row_end = (row_end + inv_map.tile_size - 1) / inv_map.tile_size * inv_map.tile_size;
                 }
+                if (row_end > height) {
+                    row_end = height;
+                }
+                // 座標マップを計算し (計算済みなら何もしない)、バイリニア補間 (--filter で選んだフィルタ) で描く
+                double start = now_seconds();
+                inverse_map_build_rows(&inv_map, row_end);
+                map_seconds += now_seconds() - start;
+                inverse_map_sample_rows(&inv_map, sample_src, final_img, inverse_row, row_end);
+                inverse_row = row_end;
                 if (inverse_row >= height) {
+                    // 次回の起動用にマップを保存しておく
+                    if (cacheable && !inv_map.mapping && map_cache_save(&inv_map, map_key) != 0) {
+                        printf("座標マップのキャッシュを保存できませんでした\n");
+                    }
+                    if (show_stats && inv_map.fdf) {
+                        write_newton_stats(&inv_map);
+                    }
+                    if (show_stats && inv_map.adaptive_cell > 0) {
+                        printf("適応的な計算: 厳密に解いた点 %ld / %ld (%.1f%%)\n", inv_map.exact_solves,
+                               (long) width * height, 100.0 * inv_map.exact_solves / ((double) width * height));
+                    }
+                    if (check_accuracy) {
+                        report_accuracy(&inv_map, map_seconds, simd, block_eval);
+                    }
                     currentState = STATE_DONE;
                     SDL_SetWindowTitle(win_main, "変換完了！");
                 }
@@ -268,10 +722,15 @@ int main(int argc, char* argv[]) {
     }
 
     // --- 4. 終了処理 ---
+    image_buffer_free(&source_buf);
+    image_buffer_free(&layout_buf);
     stbi_image_free(original_img);
     free(source_work_img);
     free(holey_dest_img);
     free(final_img);
+    inverse_map_free(&inv_map);
+    mip_pyramid_free(&mip);
+    forward_map_free(&fwd_map);
 
     // まだ破棄されていない可能性のあるリソースを安全に破棄
     if (win_src) { 
@@ -0,0 +1,217 @@
+// 逆写像の座標マップをファイルに保存し、次回以降はmmapで読み込むキャッシュ
+// ファイル名は (関数ID, 関数のコードのID, 関数の値, パラメータ, 複素平面の範囲, 画像サイズ) のハッシュから決める。
+// コンパイルして埋め込んだ関数 (main-transform.c の f()) のコードのIDは実行ファイルの中身のハッシュで、
+// f() を書き換えて再コンパイルすれば別のキーになる。関数の値 (範囲の四隅と中の数点での f, f') は念のための確認に使う。
+// 読み込んだマップは読み取り専用で共有されるので、複数のプロセスで同じファイルを使える。
+//
+// ファイル形式 (すべて実行環境のバイトオーダー)
+//   MapCacheHeader (64バイト)
+//   float sx[width * height]
+//   float sy[width * height]
+//   unsigned char valid[width * height]
+#ifndef MAP_CACHE_H
+#define MAP_CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "inverse_map.h"
+
+#define MAP_CACHE_MAGIC "CTIMAP\0"
+#define MAP_CACHE_VERSION 5
+
+typedef struct {
+    char magic[8];           // "CTIMAP"
+    uint32_t version;        // 形式や計算方法を変えたら MAP_CACHE_VERSION を上げる
+    uint32_t header_size;    // sizeof(MapCacheHeader)
+    uint64_t key;            // map_cache_key() のハッシュ値
+    int32_t width, height;
+    double re_min, re_max;
+    double im_min, im_max;
+} MapCacheHeader;
+
+// FNV-1a (64bit) でバイト列をハッシュに混ぜる
+static inline uint64_t map_cache_hash(uint64_t h, const void *data, size_t size) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// 実行中のプログラムの実行ファイル (/proc/self/exe) の中身のハッシュを *id に入れる
+// 成功すれば0、読めなければ-1を返す
+static inline int map_cache_build_id(uint64_t *id) {
+    int fd = open("/proc/self/exe", O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return -1;
+    }
+    void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        return -1;
+    }
+    *id = map_cache_hash(0xcbf29ce484222325ULL, mem, st.st_size);
+    munmap(mem, st.st_size);
+    return 0;
+}
+
+// f と f' (NULLなら f だけ) の値をキーに混ぜる
+// 範囲の四隅と、中の格子からずらした数点で計算する (関数のIDやコードのIDが同じなのに値が違えば、別のキーになる)
+static inline uint64_t map_cache_hash_func(uint64_t h, complex_func f, complex_func df, const Viewport *view) {
+    static const double probes[8][2] = {
+        {0, 0}, {1, 0}, {0, 1}, {1, 1}, {0.5, 0.5}, {0.3183, 0.7071}, {0.7391, 0.1414}, {0.1618, 0.4142},
+    };
+    for (int k = 0; k < 8; k++) {
+        double complex z = viewport_point(view, probes[k][0] * view->width, probes[k][1] * view->height);
+        double complex fz = f(z);
+        double complex dfz = df ? df(z) : 0;
+        double value[4] = {creal(fz), cimag(fz), creal(dfz), cimag(dfz)};
+        h = map_cache_hash(h, value, sizeof(value));
+    }
+    return h;
+}
+
+// キャッシュのキーを計算する
+// func_idは関数を区別する文字列、code_idは関数のコードを区別する値 (名前や式だけで決まる関数は0、
+// コンパイルして埋め込んだ関数は map_cache_build_id() の値)、f, df は写像とその導関数 (df は無ければNULL)、
+// paramsは関数のパラメータ (無ければNULL, 0)
+static inline uint64_t map_cache_key(const char *func_id, uint64_t code_id, complex_func f, complex_func df,
+                                     const double *params, int n_params, const Viewport *view) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint32_t version = MAP_CACHE_VERSION;
+    double domain[4] = {view->re_min, view->re_max, view->im_min, view->im_max};
+    int32_t size[2] = {view->width, view->height};
+
+    h = map_cache_hash(h, &version, sizeof(version));
+    h = map_cache_hash(h, func_id, strlen(func_id) + 1);
+    h = map_cache_hash(h, &code_id, sizeof(code_id));
+    h = map_cache_hash_func(h, f, df, view);
+    h = map_cache_hash(h, &n_params, sizeof(n_params));
+    if (n_params > 0) {
+        h = map_cache_hash(h, params, n_params * sizeof(double));
+    }
+    h = map_cache_hash(h, domain, sizeof(domain));
+    h = map_cache_hash(h, size, sizeof(size));
+    return h;
+}
+
+// キャッシュファイルのパス (環境変数 CTIMAP_CACHE_DIR があればそのディレクトリ、なければカレント)
+static inline void map_cache_path(char *path, size_t path_size, uint64_t key) {
+    const char *dir = getenv("CTIMAP_CACHE_DIR");
+    if (dir == NULL || dir[0] == '\0') {
+        dir = ".";
+    }
+    snprintf(path, path_size, "%s/map_%016llx.ctmap", dir, (unsigned long long) key);
+}
+
+static inline size_t map_cache_file_size(int width, int height) {
+    size_t n = (size_t) width * height;
+    return sizeof(MapCacheHeader) + n * 2 * sizeof(float) + n;
+}
+
+// キャッシュファイルがあればmmapしてマップとして使う
+// 見つかれば0、無い・壊れている・条件が違う場合は-1を返す (mapは変更しない)
+static inline int map_cache_load(InverseMap *map, uint64_t key, complex_func inv, const Viewport *view) {
+    int width = view->width, height = view->height;
+    char path[4096];
+    map_cache_path(path, sizeof(path), key);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    size_t size = map_cache_file_size(width, height);
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size != size) {
+        close(fd);
+        return -1;
+    }
+
+    void *mem = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // mmapした後はファイルを閉じても領域は残る
+    if (mem == MAP_FAILED) {
+        return -1;
+    }
+
+    const MapCacheHeader *header = mem;
+    if (memcmp(header->magic, MAP_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != MAP_CACHE_VERSION || header->header_size != sizeof(MapCacheHeader) ||
+        header->key != key || header->width != width || header->height != height ||
+        header->re_min != view->re_min || header->re_max != view->re_max ||
+        header->im_min != view->im_min || header->im_max != view->im_max) {
+        munmap(mem, size);
+        return -1;
+    }
+
+    size_t n = (size_t) width * height;
+    char *data = (char *) mem + sizeof(MapCacheHeader);
+    inverse_map_defaults(map, inv, view);
+    map->sx = (float *) data;
+    map->sy = (float *) (data + n * sizeof(float));
+    map->valid = (unsigned char *) (data + n * 2 * sizeof(float));
+    map->built_rows = height; // 全行計算済み
+    map->mapping = mem;
+    map->mapping_size = size;
+    return 0;
+}
+
+// 計算し終わったマップをキャッシュファイルに保存する
+// 他のプロセスが書きかけのファイルを読まないように、一時ファイルに書いてからrenameする
+// 成功すれば0、失敗すれば-1を返す
+static inline int map_cache_save(const InverseMap *map, uint64_t key) {
+    if (map->mapping || map->built_rows < map->height) {
+        return -1; // キャッシュから読んだマップや、計算途中のマップは保存しない
+    }
+
+    char path[4096], tmp_path[4200];
+    map_cache_path(path, sizeof(path), key);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long) getpid());
+
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    MapCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAP_CACHE_MAGIC, sizeof(header.magic));
+    header.version = MAP_CACHE_VERSION;
+    header.header_size = sizeof(MapCacheHeader);
+    header.key = key;
+    header.width = map->width;
+    header.height = map->height;
+    header.re_min = map->view.re_min;
+    header.re_max = map->view.re_max;
+    header.im_min = map->view.im_min;
+    header.im_max = map->view.im_max;
+
+    size_t n = (size_t) map->width * map->height;
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+             fwrite(map->sx, sizeof(float), n, fp) == n &&
+             fwrite(map->sy, sizeof(float), n, fp) == n &&
+             fwrite(map->valid, 1, n, fp) == n;
+    if (fclose(fp) != 0) {
+        ok = 0;
+    }
+
+    if (!ok || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+#endif
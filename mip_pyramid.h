@@ -0,0 +1,134 @@
+// 元画像のミップマップ (縦横を半分ずつに縮小した画像の列)
+// 写像で元画像が縮んで写るところでは、出力の1ピクセルに元画像の何ピクセルも入るので、
+// 元画像から1点だけバイリニア補間するとモアレ (エイリアス) が出る。
+// 縮小率に合った段 (LOD = log2(縮小率)) から読めば、前もって平均した色になる。
+// LOD の小数部分で上下の段を混ぜる (トライリニア補間) ので、段の境目も目立たない。
+#ifndef MIP_PYRAMID_H
+#define MIP_PYRAMID_H
+
+#include <stdlib.h>
+#include <math.h>
+#include "tile_pool.h"
+
+#define MIP_PYRAMID_MAX_LEVELS 16
+
+typedef struct {
+    int levels;                                  // 段数 (0段目は元画像そのもの)
+    int channels;
+    int width[MIP_PYRAMID_MAX_LEVELS], height[MIP_PYRAMID_MAX_LEVELS];
+    const unsigned char *pixels[MIP_PYRAMID_MAX_LEVELS]; // 各段の画像 (行順)
+    unsigned char *buffer;                       // 1段目以降をまとめて確保した領域
+} MipPyramid;
+
+// スレッドプールに配る仕事のデータ
+typedef struct {
+    MipPyramid *pyr;
+    int level;      // 作る段
+} MipPyramidJob;
+
+// level 段目の y 行目を、1つ上の段の 2x2 ピクセルの平均で作る
+// (幅や高さが奇数のときは、はみ出した分は端のピクセルを繰り返す)
+static inline void mip_pyramid_row_task(void *ctx, int y) {
+    const MipPyramidJob *job = ctx;
+    const MipPyramid *pyr = job->pyr;
+    int ch = pyr->channels, level = job->level;
+    int src_w = pyr->width[level - 1], src_h = pyr->height[level - 1];
+    const unsigned char *src = pyr->pixels[level - 1];
+    unsigned char *dest = (unsigned char *) pyr->pixels[level] + (long) y * pyr->width[level] * ch;
+    int y0 = 2 * y, y1 = 2 * y + 1 < src_h ? 2 * y + 1 : src_h - 1;
+    const unsigned char *r0 = src + (long) y0 * src_w * ch, *r1 = src + (long) y1 * src_w * ch;
+
+    for (int x = 0; x < pyr->width[level]; x++) {
+        int x0 = 2 * x, x1 = 2 * x + 1 < src_w ? 2 * x + 1 : src_w - 1;
+        for (int c = 0; c < ch; c++) {
+            int sum = r0[x0 * ch + c] + r0[x1 * ch + c] + r1[x0 * ch + c] + r1[x1 * ch + c];
+            dest[x * ch + c] = (unsigned char) ((sum + 2) >> 2);
+        }
+    }
+}
+
+// 元画像 (行順) からミップマップを作る。1x1 になるまで縮小する
+// 0段目は src をそのまま指すので、使い終わるまで src を解放しないこと
+// 成功すれば0、メモリ確保に失敗すれば-1を返す
+static inline int mip_pyramid_build(MipPyramid *pyr, const unsigned char *src, int width, int height, int channels) {
+    size_t total = 0;
+    pyr->channels = channels;
+    pyr->width[0] = width;
+    pyr->height[0] = height;
+    pyr->pixels[0] = src;
+    pyr->levels = 1;
+    while (pyr->levels < MIP_PYRAMID_MAX_LEVELS &&
+           (pyr->width[pyr->levels - 1] > 1 || pyr->height[pyr->levels - 1] > 1)) {
+        int l = pyr->levels++;
+        pyr->width[l] = (pyr->width[l - 1] + 1) / 2;
+        pyr->height[l] = (pyr->height[l - 1] + 1) / 2;
+        total += (size_t) pyr->width[l] * pyr->height[l] * channels;
+    }
+
+    pyr->buffer = malloc(total > 0 ? total : 1);
+    if (!pyr->buffer) {
+        pyr->levels = 0;
+        return -1;
+    }
+    unsigned char *p = pyr->buffer;
+    for (int l = 1; l < pyr->levels; l++) {
+        pyr->pixels[l] = p;
+        p += (size_t) pyr->width[l] * pyr->height[l] * channels;
+        MipPyramidJob job = {pyr, l};
+        tile_pool_run(tile_pool_shared(), pyr->height[l], mip_pyramid_row_task, &job);
+    }
+    return 0;
+}
+
+static inline void mip_pyramid_free(MipPyramid *pyr) {
+    free(pyr->buffer);
+    pyr->buffer = NULL;
+    pyr->levels = 0;
+}
+
+// level 段目をバイリニア補間し、重み weight をかけて acc に足す
+// (x, y) は0段目のピクセル単位の座標 (整数のところがピクセルの中心)。段の外は端のピクセルを使う
+static inline void mip_pyramid_accumulate(const MipPyramid *pyr, int level, float x, float y, float weight,
+                                          float *acc) {
+    float scale = 1.0f / (float) (1 << level);
+    int w = pyr->width[level], h = pyr->height[level], ch = pyr->channels;
+    float lx = (x + 0.5f) * scale - 0.5f, ly = (y + 0.5f) * scale - 0.5f;
+    lx = lx < 0 ? 0 : lx > w - 1 ? (float) (w - 1) : lx;
+    ly = ly < 0 ? 0 : ly > h - 1 ? (float) (h - 1) : ly;
+    int x0 = (int) lx, y0 = (int) ly;
+    int x1 = x0 + 1 < w ? x0 + 1 : x0, y1 = y0 + 1 < h ? y0 + 1 : y0;
+    float fx = lx - x0, fy = ly - y0;
+
+    const unsigned char *img = pyr->pixels[level];
+    const unsigned char *p00 = img + ((long) y0 * w + x0) * ch, *p10 = img + ((long) y0 * w + x1) * ch;
+    const unsigned char *p01 = img + ((long) y1 * w + x0) * ch, *p11 = img + ((long) y1 * w + x1) * ch;
+    float w00 = (1 - fx) * (1 - fy) * weight, w10 = fx * (1 - fy) * weight;
+    float w01 = (1 - fx) * fy * weight, w11 = fx * fy * weight;
+    for (int c = 0; c < ch; c++) {
+        acc[c] += p00[c] * w00 + p10[c] * w10 + p01[c] * w01 + p11[c] * w11;
+    }
+}
+
+// 0段目の座標 (x, y) を、詳細度 lod (0なら元画像、1なら半分に縮小した段、…) でトライリニア補間して out に書く
+static inline void mip_pyramid_sample(const MipPyramid *pyr, float x, float y, float lod, unsigned char *out) {
+    float acc[4] = {0, 0, 0, 0};
+    if (!(lod > 0)) {
+        lod = 0; // NaN も0段目にする
+    }
+    if (lod >= pyr->levels - 1) {
+        mip_pyramid_accumulate(pyr, pyr->levels - 1, x, y, 1.0f, acc);
+    } else {
+        int level = (int) lod;
+        float t = lod - level;
+        mip_pyramid_accumulate(pyr, level, x, y, 1.0f - t, acc);
+        if (t > 0) {
+            mip_pyramid_accumulate(pyr, level + 1, x, y, t, acc);
+        }
+    }
+    for (int c = 0; c < pyr->channels; c++) {
+        float v = acc[c] + 0.5f;
+        out[c] = (unsigned char) (v > 255 ? 255 : v);
+    }
+}
+
+#endif
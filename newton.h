@@ -0,0 +1,91 @@
+// ニュートン法で f(z) = w を解く
+#ifndef NEWTON_H
+#define NEWTON_H
+
+#include <complex.h>
+
+typedef double complex (*complex_func)(double complex);
+
+// f(z) を返し、f'(z) を *df に入れる関数 (共通の部分を1回だけ計算できる)
+typedef double complex (*complex_func_dual)(double complex z, double complex *df);
+
+// SIMD版のニュートン法 (inverse_map.h) で反復に使う精度
+typedef enum {
+    NEWTON_PRECISION_DOUBLE,  // double で反復する
+    NEWTON_PRECISION_FLOAT,   // float で反復する (simd_float.h、SIMDの幅が倍になる)
+    NEWTON_PRECISION_MIXED    // float で反復し、最後に double で1回だけ更新する
+} NewtonPrecision;
+
+// ニュートン法の設定
+typedef struct {
+    int max_iter;      // z = w から始めたときの反復回数の上限
+    int warm_iter;     // 隣のピクセルの解から始めたときの反復回数の上限
+    double res_tol;    // |f(z) - w| <= res_tol * (1 + |w|) になれば収束とみなす
+    double step_tol;   // 更新量 |Δz| <= step_tol * (1 + |z|) になり、残差も NEWTON_STEP_RES_SCALE 倍の許容値以下なら収束とみなす
+    NewtonPrecision precision; // SIMD版で反復に使う精度 (newton_solve はいつも double)
+} NewtonParams;
+
+#define NEWTON_DEFAULT_PARAMS {100, 20, 1e-10, 1e-12, NEWTON_PRECISION_DOUBLE}
+
+// 更新量が小さくなって止まったときに、収束とみなす残差の上限 (res_tol の何倍か)
+// f' が0に近いところで反復が進まなくなっただけの点を、収束したことにしないため
+#define NEWTON_STEP_RES_SCALE 1e3
+
+// 1回の解の計算にかかった反復回数と、最後の残差 |f(z) - w|、収束したか (1/0)
+typedef struct {
+    int iterations;
+    double residual;
+    int converged;
+} NewtonStats;
+
+// *zを初期値としてニュートン法で f(z) = w を解き、結果を*zに入れる
+// fdf は f(z) と f'(z) を同時に計算する関数
+// 収束すれば1、max_iter回で収束しなければ0を返す (そのときも最後のzを入れる)
+// statsがNULLでなければ反復回数と最後の残差、収束したかを入れる
+static inline int newton_solve(complex_func_dual fdf, const NewtonParams *params,
+                               double complex w, double complex *z, int max_iter, NewtonStats *stats) {
+    double tol = params->res_tol * (1.0 + cabs(w));
+    double complex x = *z;
+    double complex df_x;
+    double complex f_x = fdf(x, &df_x);
+    double complex r = f_x - w;
+    int converged = 0;
+    int i = 0;
+
+    while (i < max_iter) {
+        if (cabs(r) <= tol) {
+            converged = 1;
+            break;
+        }
+
+        // ゼロ除算を避ける
+        if (cabs(df_x) < 1e-6) {
+            break;
+        }
+
+        // ニュートン法の更新式: z_new = z - (f(z)-w) / f'(z)
+        double complex step = r / df_x;
+        x = x - step;
+        f_x = fdf(x, &df_x);
+        r = f_x - w;
+        i++;
+
+        if (cabs(step) <= params->step_tol * (1.0 + cabs(x)) && cabs(r) <= NEWTON_STEP_RES_SCALE * tol) {
+            converged = 1;
+            break;
+        }
+    }
+    if (!converged) {
+        converged = cabs(r) <= tol;
+    }
+
+    *z = x;
+    if (stats) {
+        stats->iterations = i;
+        stats->residual = cabs(r);
+        stats->converged = converged;
+    }
+    return converged;
+}
+
+#endif
@@ -9,18 +9,13 @@
 #include <complex.h>
 #include <math.h> 
 #include <SDL2/SDL.h>
+#include "inverse_map.h"
 
 // 逆写像で使う関数 (今回は z*z で試します)
 double complex f_inv(double complex w) {
     return csqrt(w);
 }
 
-// 線形補間を行うヘルパー関数
-// v0とv1の間をt(0.0〜1.0)の割合で混ぜる
-unsigned char lerp(double v0, double v1, double t) {
-    return (unsigned char)((1 - t) * v0 + t * v1);
-}
-
 int main(int argc, char *argv[]) {
 
     if (argc < 2) {
@@ -28,6 +23,28 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    // オプション (画像ファイル名の後)
+    //   --tile N   出力を N x N のタイルごとに描く (1フレームにタイル1段ずつ進む)
+    //   --morton   タイルの中をモートン順に進む (N は2のべき乗)
+    int tile = 0, morton = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--tile") == 0 && i + 1 < argc) {
+            tile = atoi(argv[++i]);
+            if (tile < 1) {
+                printf("--tile は1以上にしてください\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--morton") == 0) {
+            morton = 1;
+        } else {
+            printf("不明なオプション: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (morton && tile == 0) {
+        tile = 32;
+    }
+
     int width, height, channels;
     char *input_file;
     input_file = argv[1];
@@ -41,6 +58,27 @@ int main(int argc, char *argv[]) {
     // 最初は真っ黒な画像にしておく
     memset(output_img, 0, img_size);
 
+    // 逆写像で読む元画像 (余白付きのコピー)
+    ImageBuffer source;
+    if (image_buffer_load(&source, input_img, width, height, channels, IMAGE_PIXEL_U8,
+                          INVERSE_MAP_SOURCE_BORDER, IMAGE_BORDER_CONSTANT, IMAGE_BORDER_CONSTANT) != 0) {
+        printf("メモリ確保エラー\n");
+        return 1;
+    }
+
+    // 逆写像の座標マップ (複素平面の範囲は(-2, -2)から(2, 2))
+    Viewport view;
+    viewport_init(&view, -2.0, 2.0, -2.0, 2.0, width, height);
+    InverseMap map;
+    if (inverse_map_init(&map, f_inv, &view) != 0) {
+        printf("メモリ確保エラー\n");
+        return 1;
+    }
+    if (inverse_map_use_tiles(&map, tile, morton) != 0) {
+        printf("--morton のタイルの大きさは2のべき乗にしてください\n");
+        return 1;
+    }
+
     // --- 2. SDLの初期化とウィンドウ作成 ---
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         printf("SDL初期化エラー: %s\n", SDL_GetError());
@@ -70,33 +108,18 @@ int main(int argc, char *argv[]) {
         // --- 画像変換処理 (1フレームに数行ずつ進める) ---
         if (current_row < height) {
             int rows_per_frame = 1; // 1フレームあたりに計算する行数 (この値で速度調整)
-            for (int i = 0; i < rows_per_frame && current_row < height; i++) {
-                int ny = current_row;
-                for (int nx = 0; nx < width; nx++) {
-                    // (ここから下は inverse_transform.c とほぼ同じロジック)
-                    double complex w = ((double)nx / width * 4.0 - 2.0) + ((double)ny / height * 4.0 - 2.0) * I;
-                    double complex z = f_inv(w);
-                    double sx = (creal(z) + 2.0) / 4.0 * width;
-                    double sy = (cimag(z) + 2.0) / 4.0 * height;
-
-                    unsigned char color[4] = {0, 0, 0, 255};
-                    if (sx >= 0 && sx < width - 1 && sy >= 0 && sy < height - 1) {
-                        int x1 = (int)sx, y1 = (int)sy;
-                        double x_diff = sx - x1, y_diff = sy - y1;
-                        for (int ch = 0; ch < channels; ch++) {
-                            double v1 = input_img[(y1*width+x1)*channels+ch];
-                            double v2 = input_img[(y1*width+x1+1)*channels+ch];
-                            double v3 = input_img[((y1+1)*width+x1)*channels+ch];
-                            double v4 = input_img[((y1+1)*width+x1+1)*channels+ch];
-                            double top = lerp(v1, v2, x_diff);
-                            double bot = lerp(v3, v4, x_diff);
-                            color[ch] = lerp(top, bot, y_diff);
-                        }
-                    }
-                    memcpy(output_img + (ny * width + nx) * channels, color, channels);
-                }
-                current_row++;
+            int row_end = current_row + rows_per_frame;
+            if (tile > 0) {
+                // タイルの段ごとに進める (帯の途中でタイルを切らない)
+                row_end = (row_end + tile - 1) / tile * tile;
+            }
+            if (row_end > height) {
+                row_end = height;
             }
+            // (inverse_transform.c と同じマップを使ったロジック)
+            inverse_map_build_rows(&map, row_end);
+            inverse_map_sample_rows(&map, &source, output_img, current_row, row_end);
+            current_row = row_end;
         }
 
         // --- 描画処理 ---
@@ -108,7 +131,9 @@ int main(int argc, char *argv[]) {
 
     // --- 4. 終了処理 ---
     stbi_image_free(input_img);
+    image_buffer_free(&source);
     free(output_img);
+    inverse_map_free(&map);
     SDL_DestroyTexture(tex);
     SDL_DestroyRenderer(ren);
     SDL_DestroyWindow(win);
@@ -0,0 +1,103 @@
+// バイリニアより高品質な補間フィルタ (双3次補間とLanczos) の重みの表
+// どのフィルタも縦と横に分けて重みをかけられる (分離可能) ので、
+// 1次元の重みを、ピクセル内の位置 (小数部分) を RESAMPLE_PHASES 等分した点ごとに前もって計算しておく。
+// 描くときは位置を丸めて表を引くだけで済み、ピクセルごとに sin や3次式を計算しない。
+#ifndef RESAMPLE_FILTER_H
+#define RESAMPLE_FILTER_H
+
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#define RESAMPLE_PHASES 256   // ピクセル内の位置を何等分して重みを持っておくか
+#define RESAMPLE_MAX_TAPS 6   // 1方向に読むピクセル数の最大 (Lanczos-3)
+#define RESAMPLE_PI 3.14159265358979323846
+
+typedef enum {
+    RESAMPLE_BILINEAR,    // 2x2 ピクセル (inverse_map.h の固定小数点の補間を使う)
+    RESAMPLE_CATMULL_ROM, // 4x4 ピクセルの双3次補間 (B = 0, C = 1/2)。くっきりするが少し輪郭が出る
+    RESAMPLE_MITCHELL,    // 4x4 ピクセルの双3次補間 (B = C = 1/3)。輪郭とぼけの釣り合いがよい
+    RESAMPLE_LANCZOS3,    // 6x6 ピクセルの Lanczos-3。一番くっきりする
+    RESAMPLE_FILTER_COUNT
+} ResampleFilter;
+
+typedef struct {
+    int taps; // 1方向に読むピクセル数
+    // weights[p * taps + k]: ピクセル内の位置が p / RESAMPLE_PHASES のとき、
+    // 左 (上) から k 番目のピクセル (整数部分から k - (taps / 2 - 1) だけずれたピクセル) の重み。合計は1
+    float weights[(RESAMPLE_PHASES + 1) * RESAMPLE_MAX_TAPS];
+} ResampleKernel;
+
+// Mitchell-Netravali の双3次フィルタ
+static inline double resample_cubic(double x, double b, double c) {
+    x = fabs(x);
+    if (x < 1) {
+        return ((12 - 9 * b - 6 * c) * x * x * x + (-18 + 12 * b + 6 * c) * x * x + (6 - 2 * b)) / 6;
+    }
+    if (x < 2) {
+        return ((-b - 6 * c) * x * x * x + (6 * b + 30 * c) * x * x + (-12 * b - 48 * c) * x + (8 * b + 24 * c)) / 6;
+    }
+    return 0;
+}
+
+static inline double resample_lanczos(double x, int a) {
+    if (x == 0) {
+        return 1;
+    }
+    if (fabs(x) >= a) {
+        return 0;
+    }
+    double px = RESAMPLE_PI * x;
+    return a * sin(px) * sin(px / a) / (px * px);
+}
+
+static inline double resample_weight(ResampleFilter filter, double x) {
+    switch (filter) {
+        case RESAMPLE_CATMULL_ROM: return resample_cubic(x, 0, 0.5);
+        case RESAMPLE_MITCHELL:    return resample_cubic(x, 1.0 / 3, 1.0 / 3);
+        case RESAMPLE_LANCZOS3:    return resample_lanczos(x, 3);
+        default:                   return fabs(x) < 1 ? 1 - fabs(x) : 0;
+    }
+}
+
+static ResampleKernel resample_kernels[RESAMPLE_FILTER_COUNT];
+static pthread_once_t resample_kernels_once = PTHREAD_ONCE_INIT;
+
+static inline void resample_kernels_init(void) {
+    for (int f = 0; f < RESAMPLE_FILTER_COUNT; f++) {
+        ResampleKernel *kernel = &resample_kernels[f];
+        kernel->taps = f == RESAMPLE_LANCZOS3 ? 6 : f == RESAMPLE_BILINEAR ? 2 : 4;
+        int first = -(kernel->taps / 2 - 1); // 整数部分から見た一番左のピクセル
+        for (int p = 0; p <= RESAMPLE_PHASES; p++) {
+            double t = (double) p / RESAMPLE_PHASES, sum = 0;
+            float *w = &kernel->weights[p * kernel->taps];
+            for (int k = 0; k < kernel->taps; k++) {
+                sum += resample_weight((ResampleFilter) f, first + k - t);
+            }
+            // 表の位置に丸めても明るさが変わらないように、合計を1にそろえる
+            for (int k = 0; k < kernel->taps; k++) {
+                w[k] = (float) (resample_weight((ResampleFilter) f, first + k - t) / sum);
+            }
+        }
+    }
+}
+
+// filter の重みの表 (最初に使うときに作る)
+static inline const ResampleKernel *resample_kernel(ResampleFilter filter) {
+    pthread_once(&resample_kernels_once, resample_kernels_init);
+    return &resample_kernels[filter];
+}
+
+// 名前 (bilinear, catmull-rom, mitchell, lanczos3) からフィルタを探す。見つからなければ-1を返す
+static inline int resample_filter_find(const char *name, ResampleFilter *filter) {
+    static const char *names[RESAMPLE_FILTER_COUNT] = {"bilinear", "catmull-rom", "mitchell", "lanczos3"};
+    for (int f = 0; f < RESAMPLE_FILTER_COUNT; f++) {
+        if (strcmp(name, names[f]) == 0) {
+            *filter = (ResampleFilter) f;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+#endif
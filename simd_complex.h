@@ -0,0 +1,647 @@
+// 8ピクセル分の複素数をまとめて計算するSIMDカーネル
+// 実部と虚部を別々のベクトルに入れ (SoA)、exp, log, sin, cos, sqrt, pow もベクトルのまま計算する。
+// GCCのベクトル拡張で1回だけ書き、AVX-512 / AVX2 / 汎用 の3通りにコンパイルして
+// 実行時にCPUが対応している一番速いものを選ぶ。
+//
+// 精度はピクセル座標に使うのに十分な程度 (相対誤差 1e-15 程度) で、
+// sin, cos は |x| が 1e5 程度までを想定している。
+#ifndef SIMD_COMPLEX_H
+#define SIMD_COMPLEX_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "newton.h"
+
+// ベクトル型を引数や戻り値に使うと出るABIの警告 (すべてインライン展開されるので問題ない)
+// このヘッダの中だけで無効にする (インクルードした側には影響しない)。
+// ただしGCCは「64バイト境界の引数のABIが GCC 4.6 で変わった」という注意 (note) を
+// pragma に関係なく1回出すので、消すにはコンパイル時に -Wno-psabi を付ける (README のコマンドを参照)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+#define SIMD_LANES 8
+
+typedef double simd_vd __attribute__((vector_size(64)));    // double x 8
+typedef long long simd_vl __attribute__((vector_size(64))); // int64 x 8 (比較結果のマスクにも使う)
+
+typedef struct {
+    simd_vd re, im;
+} simd_vc;
+
+// SIMDで計算できる関数の種類 (complex_funcs.h の関数に対応する)
+typedef enum {
+    SIMD_FUNC_NONE,    // SIMD版なし
+    SIMD_FUNC_EXP,     // exp(z)
+    SIMD_FUNC_COSH2,   // exp(z) + exp(-z)
+    SIMD_FUNC_SQUARE,  // z^2
+    SIMD_FUNC_CUBE,    // z^3
+    SIMD_FUNC_SIN,     // sin(z)
+    SIMD_FUNC_TANH     // tanh(z)
+} SimdFuncKind;
+
+// 実行時に作る関数 (expr.h の式など) を8ピクセル分の配列で計算する関数
+// ctxはその関数のデータ。f'が不要ならdre, dimにはNULLを渡す
+typedef void (*simd_block_func)(const void *ctx, const double *zre, const double *zim,
+                                double *fre, double *fim, double *dre, double *dim);
+
+#define SIMD_INLINE static inline __attribute__((always_inline))
+#define SIMD_PI 3.14159265358979323846
+
+// --- 実数ベクトルの基本操作 ---
+
+SIMD_INLINE simd_vd sv_load(const double *p) {
+    simd_vd v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+SIMD_INLINE void sv_store(double *p, simd_vd v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+// マスクが立っているレーンはa、それ以外はb
+SIMD_INLINE simd_vd sv_select(simd_vl mask, simd_vd a, simd_vd b) {
+    return (simd_vd) (((simd_vl) a & mask) | ((simd_vl) b & ~mask));
+}
+
+SIMD_INLINE int sv_any(simd_vl mask) {
+    long long acc = 0;
+    for (int i = 0; i < SIMD_LANES; i++) {
+        acc |= mask[i];
+    }
+    return acc != 0;
+}
+
+SIMD_INLINE simd_vd sv_abs(simd_vd x) {
+    return (simd_vd) ((simd_vl) x & 0x7fffffffffffffffLL);
+}
+
+// yの符号をxにつける
+SIMD_INLINE simd_vd sv_copysign(simd_vd x, simd_vd y) {
+    simd_vl sign = (simd_vl) y & (long long) 0x8000000000000000ULL;
+    return (simd_vd) (((simd_vl) x & 0x7fffffffffffffffLL) | sign);
+}
+
+// 最も近い整数に丸める (|x| < 2^51)
+SIMD_INLINE simd_vd sv_round(simd_vd x) {
+    const double magic = 6755399441055744.0; // 1.5 * 2^52
+    return (x + magic) - magic;
+}
+
+// 平方根 (ビット操作の初期値 + 逆平方根のニュートン法)
+SIMD_INLINE simd_vd sv_sqrt(simd_vd x) {
+    // 非正規化数に近い値は 2^600 倍してから計算し、結果を 2^-300 倍する
+    simd_vl tiny = x < 1e-300;
+    simd_vd xs = sv_select(tiny, x * 0x1p600, x);
+
+    simd_vd y = (simd_vd) (0x5fe6eb50c7b537a9LL - ((simd_vl) xs >> 1)); // 1/sqrt(x) の近似
+    for (int i = 0; i < 4; i++) {
+        y = y * (1.5 - 0.5 * xs * y * y);
+    }
+    simd_vd s = xs * y;
+    s = 0.5 * (s + xs / s); // 最後に1回 sqrt を直接補正する
+    s = sv_select(tiny, s * 0x1p-300, s);
+    s = sv_select(x == 0.0, x, s);
+    s = sv_select(x == __builtin_inf(), x, s);
+    return sv_select(x < 0.0, (simd_vd) {} + __builtin_nan(""), s);
+}
+
+// e^x
+SIMD_INLINE simd_vd sv_exp(simd_vd x) {
+    const double ln2_hi = 6.93147180369123816490e-01;
+    const double ln2_lo = 1.90821492927058770002e-10;
+    simd_vd xc = sv_select(x > 709.79, (simd_vd) {} + 709.79, x);
+    xc = sv_select(xc < -745.2, (simd_vd) {} - 745.2, xc);
+
+    // x = n*log(2) + r, |r| <= log(2)/2
+    simd_vd n = sv_round(xc * 1.44269504088896340736);
+    simd_vd r = xc - n * ln2_hi - n * ln2_lo;
+
+    // e^r をテイラー展開 (13次)
+    simd_vd p = 1.0 / 6227020800.0 + 0.0 * r;
+    static const double coef[] = {
+        1.0 / 479001600.0, 1.0 / 39916800.0, 1.0 / 3628800.0, 1.0 / 362880.0,
+        1.0 / 40320.0, 1.0 / 5040.0, 1.0 / 720.0, 1.0 / 120.0, 1.0 / 24.0, 1.0 / 6.0,
+        0.5, 1.0, 1.0
+    };
+    for (int i = 0; i < 13; i++) {
+        p = p * r + coef[i];
+    }
+
+    // 2^n を指数部に直接作る (nが指数部の範囲を超えないよう2回に分けて掛ける)
+    simd_vl ni = __builtin_convertvector(n, simd_vl);
+    simd_vl n1 = ni >> 1, n2 = ni - n1;
+    simd_vd y = p * (simd_vd) ((n1 + 1023) << 52) * (simd_vd) ((n2 + 1023) << 52);
+    y = sv_select(x > 709.78, (simd_vd) {} + __builtin_inf(), y);
+    y = sv_select(x < -745.2, (simd_vd) {}, y);
+    return sv_select(x != x, x, y); // NaNはそのまま
+}
+
+// log(x)
+SIMD_INLINE simd_vd sv_log(simd_vd x) {
+    // 非正規化数は 2^54 倍してから計算する
+    simd_vl tiny = x < 2.2250738585072014e-308;
+    simd_vd xs = sv_select(tiny, x * 18014398509481984.0, x);
+    simd_vd e_adj = sv_select(tiny, (simd_vd) {} + 54.0, (simd_vd) {});
+
+    // x = m * 2^e, m は [sqrt(2)/2, sqrt(2)) に入れる
+    simd_vl bits = (simd_vl) xs;
+    simd_vl e = ((bits >> 52) & 0x7ff) - 1023;
+    simd_vd m = (simd_vd) ((bits & 0x000fffffffffffffLL) | 0x3ff0000000000000LL);
+    simd_vl big = m > 1.41421356237309504880;
+    m = sv_select(big, m * 0.5, m);
+    e = e - big; // bigは-1なので、引くと1増える
+
+    // log(m) = 2 atanh(s), s = (m-1)/(m+1), |s| <= 0.172
+    simd_vd s = (m - 1.0) / (m + 1.0);
+    simd_vd s2 = s * s;
+    simd_vd p = (simd_vd) {} + 1.0 / 21.0;
+    for (int k = 19; k >= 1; k -= 2) {
+        p = p * s2 + 1.0 / k;
+    }
+    simd_vd y = 2.0 * s * p + (__builtin_convertvector(e, simd_vd) - e_adj) * 0.69314718055994530942;
+
+    y = sv_select(x == 0.0, (simd_vd) {} - __builtin_inf(), y);
+    y = sv_select(x == __builtin_inf(), x, y);
+    return sv_select((x < 0.0) | (x != x), (simd_vd) {} + __builtin_nan(""), y);
+}
+
+// sin(x) と cos(x) を同時に計算する
+SIMD_INLINE void sv_sincos(simd_vd x, simd_vd *s, simd_vd *c) {
+    // x = n*(π/2) + r, |r| <= π/4 (π/2 を3つに分けて引く)
+    const double pio2_1 = 1.57079632673412561417e+00;
+    const double pio2_2 = 6.07710050630396597660e-11;
+    const double pio2_3 = 2.02226624879595063154e-21;
+    simd_vd n = sv_round(x * 0.63661977236758134308);
+    simd_vd r = ((x - n * pio2_1) - n * pio2_2) - n * pio2_3;
+    simd_vd z = r * r;
+
+    // Cephes の多項式
+    simd_vd ps = 1.58962301576546568060e-10 + 0.0 * z;
+    ps = ps * z - 2.50507477628578072866e-8;
+    ps = ps * z + 2.75573136213857245213e-6;
+    ps = ps * z - 1.98412698295895385996e-4;
+    ps = ps * z + 8.33333333332211858878e-3;
+    ps = ps * z - 1.66666666666666307295e-1;
+    simd_vd sin_r = r + r * z * ps;
+
+    simd_vd pc = -1.13585365213876817300e-11 + 0.0 * z;
+    pc = pc * z + 2.08757008419747316778e-9;
+    pc = pc * z - 2.75573141792967388112e-7;
+    pc = pc * z + 2.48015872888517045348e-5;
+    pc = pc * z - 1.38888888888730564116e-3;
+    pc = pc * z + 4.16666666666665929218e-2;
+    simd_vd cos_r = 1.0 - 0.5 * z + z * z * pc;
+
+    // 象限で入れ替えと符号を決める
+    simd_vl q = __builtin_convertvector(n, simd_vl) & 3;
+    simd_vl swap = (q & 1) != 0;
+    simd_vd sv = sv_select(swap, cos_r, sin_r);
+    simd_vd cv = sv_select(swap, sin_r, cos_r);
+    *s = sv_select(q >= 2, -sv, sv);
+    *c = sv_select((q == 1) | (q == 2), -cv, cv);
+}
+
+// atan(x) (Cephes)
+SIMD_INLINE simd_vd sv_atan(simd_vd x) {
+    simd_vd ax = sv_abs(x);
+    simd_vl big = ax > 2.41421356237309504880;  // tan(3π/8)
+    simd_vl mid = (ax > 0.66) & ~big;
+
+    simd_vd t = sv_select(big, -1.0 / ax, sv_select(mid, (ax - 1.0) / (ax + 1.0), ax));
+    simd_vd base = sv_select(big, (simd_vd) {} + SIMD_PI / 2,
+                             sv_select(mid, (simd_vd) {} + SIMD_PI / 4, (simd_vd) {}));
+    simd_vd more = sv_select(big, (simd_vd) {} + 6.123233995736765886130e-17,
+                             sv_select(mid, (simd_vd) {} + 3.061616997868382943065e-17, (simd_vd) {}));
+
+    simd_vd z = t * t;
+    simd_vd p = -8.750608600031904122785e-1 + 0.0 * z;
+    p = p * z - 1.615753718733365076637e1;
+    p = p * z - 7.500855792314704667340e1;
+    p = p * z - 1.228866684490136173410e2;
+    p = p * z - 6.485021904942025371773e1;
+    simd_vd q = z + 2.485846490142306297962e1;
+    q = q * z + 1.650270098316988542046e2;
+    q = q * z + 4.328810604912902668951e2;
+    q = q * z + 4.853903996359136964868e2;
+    q = q * z + 1.945506571482613964425e2;
+
+    simd_vd y = base + (t * z * p / q + t) + more;
+    return sv_copysign(y, x);
+}
+
+// atan2(y, x)
+SIMD_INLINE simd_vd sv_atan2(simd_vd y, simd_vd x) {
+    simd_vd ax = sv_abs(x), ay = sv_abs(y);
+    simd_vl swap = ay > ax;
+    simd_vd num = sv_select(swap, ax, ay);
+    simd_vd den = sv_select(swap, ay, ax);
+    simd_vd a = sv_atan(sv_select(den == 0.0, (simd_vd) {}, num / den));
+    a = sv_select(swap, SIMD_PI / 2 - a, a);
+    a = sv_select((simd_vl) x < 0, SIMD_PI - a, a); // 符号ビットを見るので x = -0.0 も左半平面
+    return sv_copysign(a, y);
+}
+
+// --- 複素数ベクトル ---
+
+SIMD_INLINE simd_vc sc_load(const double *re, const double *im) {
+    simd_vc z = {sv_load(re), sv_load(im)};
+    return z;
+}
+
+SIMD_INLINE void sc_store(double *re, double *im, simd_vc z) {
+    sv_store(re, z.re);
+    sv_store(im, z.im);
+}
+
+SIMD_INLINE simd_vc sc_make(simd_vd re, simd_vd im) {
+    simd_vc z = {re, im};
+    return z;
+}
+
+SIMD_INLINE simd_vc sc_add(simd_vc a, simd_vc b) {
+    return sc_make(a.re + b.re, a.im + b.im);
+}
+
+SIMD_INLINE simd_vc sc_sub(simd_vc a, simd_vc b) {
+    return sc_make(a.re - b.re, a.im - b.im);
+}
+
+SIMD_INLINE simd_vc sc_scale(simd_vc a, double s) {
+    return sc_make(a.re * s, a.im * s);
+}
+
+SIMD_INLINE simd_vc sc_mul(simd_vc a, simd_vc b) {
+    return sc_make(a.re * b.re - a.im * b.im, a.re * b.im + a.im * b.re);
+}
+
+// 割り算 (ライブラリの __divdc3 を使わず、a * conj(b) / |b|^2 で計算する)
+SIMD_INLINE simd_vc sc_div(simd_vc a, simd_vc b) {
+    simd_vd d = 1.0 / (b.re * b.re + b.im * b.im);
+    return sc_make((a.re * b.re + a.im * b.im) * d, (a.im * b.re - a.re * b.im) * d);
+}
+
+SIMD_INLINE simd_vd sc_abs2(simd_vc a) {
+    return a.re * a.re + a.im * a.im;
+}
+
+SIMD_INLINE simd_vc sc_select(simd_vl mask, simd_vc a, simd_vc b) {
+    return sc_make(sv_select(mask, a.re, b.re), sv_select(mask, a.im, b.im));
+}
+
+SIMD_INLINE simd_vc sc_exp(simd_vc z) {
+    simd_vd e = sv_exp(z.re), s, c;
+    sv_sincos(z.im, &s, &c);
+    return sc_make(e * c, e * s);
+}
+
+// 主値の log (虚部は -π〜π)
+SIMD_INLINE simd_vc sc_log(simd_vc z) {
+    return sc_make(0.5 * sv_log(sc_abs2(z)), sv_atan2(z.im, z.re));
+}
+
+// 主値の sqrt (実部は0以上)
+SIMD_INLINE simd_vc sc_sqrt(simd_vc z) {
+    simd_vd m = sv_sqrt(sc_abs2(z));
+    simd_vd t = sv_sqrt(0.5 * (m + sv_abs(z.re)));
+    simd_vd u = sv_select(t == 0.0, (simd_vd) {}, 0.5 * sv_abs(z.im) / t);
+    simd_vl right = z.re >= 0.0;
+    simd_vd re = sv_select(right, t, u);
+    simd_vd im = sv_select(right, u, t);
+    return sc_make(re, sv_copysign(im, z.im));
+}
+
+// z^p (pは実数、主値)
+SIMD_INLINE simd_vc sc_pow(simd_vc z, double p) {
+    simd_vc r = sc_exp(sc_scale(sc_log(z), p));
+    simd_vl zero = sc_abs2(z) == 0.0;
+    return sc_select(zero, sc_make((simd_vd) {}, (simd_vd) {}), r);
+}
+
+// sin(z) と cos(z)
+SIMD_INLINE void sc_sincos(simd_vc z, simd_vc *s, simd_vc *c) {
+    simd_vd sx, cx;
+    sv_sincos(z.re, &sx, &cx);
+    simd_vd ep = sv_exp(z.im), em = sv_exp(-z.im);
+    simd_vd ch = 0.5 * (ep + em), sh = 0.5 * (ep - em);
+    *s = sc_make(sx * ch, cx * sh);
+    *c = sc_make(cx * ch, -sx * sh);
+}
+
+// tanh(x+iy) = (sinh 2x + i sin 2y) / (cosh 2x + cos 2y)
+SIMD_INLINE simd_vc sc_tanh(simd_vc z) {
+    simd_vd x2 = 2.0 * z.re, s2, c2;
+    sv_sincos(2.0 * z.im, &s2, &c2);
+    simd_vd ep = sv_exp(x2), em = sv_exp(-x2);
+    simd_vd d = 0.5 * (ep + em) + c2;
+    simd_vc t = sc_make(0.5 * (ep - em) / d, s2 / d);
+    // |x| が大きいと inf/inf になるので ±1 にする
+    simd_vl far = sv_abs(z.re) > 20.0;
+    return sc_select(far, sc_make(sv_copysign((simd_vd) {} + 1.0, z.re), (simd_vd) {}), t);
+}
+
+// --- 関数ごとの計算 ---
+
+// f(z) と f'(z) を同時に計算する
+SIMD_INLINE void simd_func_eval(SimdFuncKind kind, simd_vc z, simd_vc *f, simd_vc *df) {
+    switch (kind) {
+        case SIMD_FUNC_EXP:
+            *f = sc_exp(z);
+            *df = *f;
+            break;
+        case SIMD_FUNC_COSH2: {
+            simd_vc ep = sc_exp(z);
+            simd_vc em = sc_div(sc_make((simd_vd) {} + 1.0, (simd_vd) {}), ep);
+            *f = sc_add(ep, em);
+            *df = sc_sub(ep, em);
+            break;
+        }
+        case SIMD_FUNC_SQUARE:
+            *f = sc_mul(z, z);
+            *df = sc_scale(z, 2.0);
+            break;
+        case SIMD_FUNC_CUBE: {
+            simd_vc z2 = sc_mul(z, z);
+            *f = sc_mul(z2, z);
+            *df = sc_scale(z2, 3.0);
+            break;
+        }
+        case SIMD_FUNC_SIN:
+            sc_sincos(z, f, df);
+            break;
+        case SIMD_FUNC_TANH: {
+            // f' = 1 - tanh^2
+            simd_vc t = sc_tanh(z);
+            *f = t;
+            *df = sc_sub(sc_make((simd_vd) {} + 1.0, (simd_vd) {}), sc_mul(t, t));
+            break;
+        }
+        default:
+            *f = z;
+            *df = sc_make((simd_vd) {} + 1.0, (simd_vd) {});
+            break;
+    }
+}
+
+// 解析的な逆関数 (complex_funcs.h と同じ枝の選び方)
+SIMD_INLINE simd_vc simd_func_inverse(SimdFuncKind kind, int branch, const simd_vc *wp) {
+    simd_vc w = *wp;
+    simd_vc one = sc_make((simd_vd) {} + 1.0, (simd_vd) {});
+    int parity = ((branch % 2) + 2) % 2;
+
+    switch (kind) {
+        case SIMD_FUNC_EXP: {
+            // log(w) + 2πik
+            simd_vc z = sc_log(w);
+            z.im = z.im + 2 * SIMD_PI * branch;
+            return z;
+        }
+        case SIMD_FUNC_COSH2: {
+            // ±acosh(w/2) + 2πik、acosh(u) = log(u + sqrt(u+1) sqrt(u-1))
+            simd_vc u = sc_scale(w, 0.5);
+            simd_vc z = sc_log(sc_add(u, sc_mul(sc_sqrt(sc_add(u, one)), sc_sqrt(sc_sub(u, one)))));
+            if (parity) {
+                z = sc_scale(z, -1.0);
+            }
+            z.im = z.im + SIMD_PI * (branch - parity);
+            return z;
+        }
+        case SIMD_FUNC_SQUARE: {
+            simd_vc z = sc_sqrt(w);
+            return parity ? sc_scale(z, -1.0) : z;
+        }
+        case SIMD_FUNC_CUBE: {
+            // w^(1/3) * exp(2πik/3)
+            simd_vc z = sc_log(w);
+            z = sc_scale(z, 1.0 / 3);
+            z.im = z.im + 2 * SIMD_PI * branch / 3;
+            return sc_select(sc_abs2(w) == 0.0, sc_make((simd_vd) {}, (simd_vd) {}), sc_exp(z));
+        }
+        case SIMD_FUNC_SIN: {
+            // (-1)^k asin(w) + πk、asin(w) = -i log(iw + sqrt(1 - w^2))
+            // 分岐線上で casin と同じ値になるよう、1 - w^2 の虚部は -2xy として符号つきゼロを保つ
+            simd_vc iw = sc_make(-w.im, w.re);
+            simd_vc one_minus_w2 = sc_make(1.0 - (w.re * w.re - w.im * w.im), -2.0 * w.re * w.im);
+            simd_vc l = sc_log(sc_add(iw, sc_sqrt(one_minus_w2)));
+            simd_vc z = sc_make(l.im, -l.re);
+            if (parity) {
+                z = sc_scale(z, -1.0);
+            }
+            z.re = z.re + SIMD_PI * branch;
+            return z;
+        }
+        case SIMD_FUNC_TANH: {
+            // atanh(w) + πik、atanh(w) = (log(1 + w) - log(1 - w)) / 2
+            // (1 - w の虚部は -Im(w) として符号つきゼロを保つ)
+            simd_vc one_minus_w = sc_make(1.0 - w.re, -w.im);
+            simd_vc z = sc_scale(sc_sub(sc_log(sc_add(one, w)), sc_log(one_minus_w)), 0.5);
+            z.im = z.im + SIMD_PI * branch;
+            return z;
+        }
+        default:
+            return w;
+    }
+}
+
+// --- ブロック単位のカーネル (ISAごとにコンパイルされる本体) ---
+
+SIMD_INLINE void simd_eval_body(SimdFuncKind kind, const double *zre, const double *zim,
+                                double *fre, double *fim, double *dre, double *dim) {
+    simd_vc f, df;
+    simd_func_eval(kind, sc_load(zre, zim), &f, &df);
+    sc_store(fre, fim, f);
+    if (dre) {
+        sc_store(dre, dim, df);
+    }
+}
+
+SIMD_INLINE void simd_inverse_body(SimdFuncKind kind, int branch, const double *wre,
+                                   const double *wim, double *zre, double *zim) {
+    simd_vc w = sc_load(wre, wim);
+    sc_store(zre, zim, simd_func_inverse(kind, branch, &w));
+}
+
+// ニュートン法で使う f, f' (funcがあればそれを、なければkindの関数を使う)
+SIMD_INLINE void simd_newton_eval(SimdFuncKind kind, simd_block_func func, const void *ctx,
+                                  simd_vc z, simd_vc *f, simd_vc *df) {
+    if (func) {
+        double zre[SIMD_LANES], zim[SIMD_LANES], fre[SIMD_LANES], fim[SIMD_LANES];
+        double dre[SIMD_LANES], dim[SIMD_LANES];
+        sc_store(zre, zim, z);
+        func(ctx, zre, zim, fre, fim, dre, dim);
+        *f = sc_load(fre, fim);
+        *df = sc_load(dre, dim);
+    } else {
+        simd_func_eval(kind, z, f, df);
+    }
+}
+
+// レーンごとにマスクをかけたニュートン法 (newton_solve と同じ終了条件)
+// 収束したレーンは止めたまま、全レーンが止まるまで反復する
+SIMD_INLINE void simd_newton_body(SimdFuncKind kind, simd_block_func func, const void *ctx,
+                                  const NewtonParams *params, int max_iter,
+                                  const double *wre, const double *wim, double *zre, double *zim,
+                                  int *iterations, double *residual, int *converged) {
+    simd_vc w = sc_load(wre, wim);
+    simd_vc z = sc_load(zre, zim);
+    simd_vd tol = params->res_tol * (1.0 + sv_sqrt(sc_abs2(w)));
+    simd_vd tol2 = tol * tol;
+    simd_vd step_res2 = tol2 * (NEWTON_STEP_RES_SCALE * NEWTON_STEP_RES_SCALE);
+    simd_vd step_tol = (simd_vd) {} + params->step_tol;
+
+    simd_vc f, df;
+    simd_newton_eval(kind, func, ctx, z, &f, &df);
+    simd_vc r = sc_sub(f, w);
+
+    simd_vl active = (simd_vl) {} - 1;
+    simd_vl conv = (simd_vl) {};
+    simd_vl iters = (simd_vl) {};
+
+    for (int i = 0; i < max_iter; i++) {
+        simd_vl done = active & (sc_abs2(r) <= tol2);
+        conv |= done;
+        active &= ~done;
+        // ゼロ除算を避ける
+        active &= ~(sc_abs2(df) < 1e-12);
+        if (!sv_any(active)) {
+            break;
+        }
+
+        // ニュートン法の更新式: z_new = z - (f(z)-w) / f'(z)
+        simd_vc step = sc_div(r, df);
+        z = sc_select(active, sc_sub(z, step), z);
+        iters -= active; // activeは-1なので1増える
+
+        simd_vc f_new, df_new;
+        simd_newton_eval(kind, func, ctx, z, &f_new, &df_new);
+        r = sc_select(active, sc_sub(f_new, w), r);
+        df = sc_select(active, df_new, df);
+
+        simd_vd lim = step_tol * (1.0 + sv_sqrt(sc_abs2(z)));
+        done = active & (sc_abs2(step) <= lim * lim) & (sc_abs2(r) <= step_res2);
+        conv |= done;
+        active &= ~done;
+    }
+    conv |= sc_abs2(r) <= tol2;
+
+    sc_store(zre, zim, z);
+    simd_vd res = sv_sqrt(sc_abs2(r));
+    for (int i = 0; i < SIMD_LANES; i++) {
+        if (iterations) {
+            iterations[i] = (int) iters[i];
+        }
+        if (residual) {
+            residual[i] = res[i];
+        }
+        converged[i] = conv[i] != 0;
+    }
+}
+
+// 同じ本体を AVX-512 / AVX2 / 汎用 向けにコンパイルする
+#define SIMD_DEFINE_KERNEL(name, params, args)                                  \
+    __attribute__((target("avx512f,avx512dq"))) static void name##_avx512 params { \
+        name##_body args;                                                         \
+    }                                                                             \
+    __attribute__((target("avx2,fma"))) static void name##_avx2 params {          \
+        name##_body args;                                                         \
+    }                                                                             \
+    static void name##_generic params {                                           \
+        name##_body args;                                                         \
+    }
+
+SIMD_DEFINE_KERNEL(simd_eval,
+                   (SimdFuncKind kind, const double *zre, const double *zim,
+                    double *fre, double *fim, double *dre, double *dim),
+                   (kind, zre, zim, fre, fim, dre, dim))
+SIMD_DEFINE_KERNEL(simd_inverse,
+                   (SimdFuncKind kind, int branch, const double *wre, const double *wim,
+                    double *zre, double *zim),
+                   (kind, branch, wre, wim, zre, zim))
+SIMD_DEFINE_KERNEL(simd_newton,
+                   (SimdFuncKind kind, simd_block_func func, const void *ctx,
+                    const NewtonParams *params, int max_iter,
+                    const double *wre, const double *wim, double *zre, double *zim,
+                    int *iterations, double *residual, int *converged),
+                   (kind, func, ctx, params, max_iter, wre, wim, zre, zim, iterations, residual, converged))
+
+// --- 実行時の選択 ---
+
+static int simd_level_detected;
+static pthread_once_t simd_level_once = PTHREAD_ONCE_INIT;
+
+static inline void simd_level_init(void) {
+    int detected = 0;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) {
+        detected = 2;
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        detected = 1;
+    }
+    const char *env = getenv("CTIMAP_SIMD");
+    if (env && strcmp(env, "generic") == 0) {
+        detected = 0;
+    } else if (env && strcmp(env, "avx2") == 0 && detected > 1) {
+        detected = 1;
+    }
+    simd_level_detected = detected;
+}
+
+// 2: AVX-512, 1: AVX2, 0: 汎用 (環境変数 CTIMAP_SIMD=avx2/generic で下げられる)
+// 最初に呼ばれたときに調べる (プールのスレッドから同時に呼ばれてもよい)
+static inline int simd_level(void) {
+    pthread_once(&simd_level_once, simd_level_init);
+    return simd_level_detected;
+}
+
+static inline const char *simd_level_name(void) {
+    static const char *names[] = {"汎用", "AVX2", "AVX-512"};
+    return names[simd_level()];
+}
+
+// 8ピクセル分の f(z) と f'(z) を計算する (f'が不要ならdre, dimはNULL)
+static inline void simd_eval_block(SimdFuncKind kind, const double *zre, const double *zim,
+                                   double *fre, double *fim, double *dre, double *dim) {
+    switch (simd_level()) {
+        case 2:  simd_eval_avx512(kind, zre, zim, fre, fim, dre, dim); break;
+        case 1:  simd_eval_avx2(kind, zre, zim, fre, fim, dre, dim); break;
+        default: simd_eval_generic(kind, zre, zim, fre, fim, dre, dim); break;
+    }
+}
+
+// 8ピクセル分の解析的な逆関数を計算する
+static inline void simd_inverse_block(SimdFuncKind kind, int branch, const double *wre, const double *wim,
+                                      double *zre, double *zim) {
+    switch (simd_level()) {
+        case 2:  simd_inverse_avx512(kind, branch, wre, wim, zre, zim); break;
+        case 1:  simd_inverse_avx2(kind, branch, wre, wim, zre, zim); break;
+        default: simd_inverse_generic(kind, branch, wre, wim, zre, zim); break;
+    }
+}
+
+// 8ピクセル分を (zre, zim) を初期値にしてニュートン法で解く
+// funcがNULLならkindの関数、そうでなければ func(ctx, ...) で f, f' を計算する
+// iterations, residual はNULLでもよい。converged には各レーンが収束したか (1/0) を入れる
+static inline void simd_newton_block(SimdFuncKind kind, simd_block_func func, const void *ctx,
+                                     const NewtonParams *params, int max_iter,
+                                     const double *wre, const double *wim, double *zre, double *zim,
+                                     int *iterations, double *residual, int *converged) {
+    switch (simd_level()) {
+        case 2:
+            simd_newton_avx512(kind, func, ctx, params, max_iter, wre, wim, zre, zim,
+                               iterations, residual, converged);
+            break;
+        case 1:
+            simd_newton_avx2(kind, func, ctx, params, max_iter, wre, wim, zre, zim,
+                             iterations, residual, converged);
+            break;
+        default:
+            simd_newton_generic(kind, func, ctx, params, max_iter, wre, wim, zre, zim,
+                                iterations, residual, converged);
+            break;
+    }
+}
+
+#pragma GCC diagnostic pop
+
+#endif
@@ -0,0 +1,378 @@
+// 単精度 (float) 版のSIMDニュートン法
+// float は double の倍の16ピクセルを1本のベクトルで計算できる。
+// ニュートン法の反復は float で行い、必要なら最後に1回だけ double で更新して精度を戻す (混合精度)。
+// ニュートン法は2次収束なので、float で相対誤差 1e-6 程度まで近づいていれば、
+// double での1回の更新で double だけで解いたのとほぼ同じ解になる。
+//
+// float の反復は相対誤差 1e-6 程度 (幅16kピクセルの画像で 0.01 ピクセル程度) までしか
+// 収束しないので、許容値は SIMD_FLOAT_RES_TOL, SIMD_FLOAT_STEP_TOL より小さくしない。
+// 関数は simd_complex.h の SimdFuncKind のもの (exp, cosh2, square, cube, sin, tanh) だけ。
+#ifndef SIMD_FLOAT_H
+#define SIMD_FLOAT_H
+
+#include "simd_complex.h"
+
+#define SIMD_LANES_F 16
+#define SIMD_FLOAT_RES_TOL 1e-6   // float で収束とみなす残差の許容値の下限
+#define SIMD_FLOAT_STEP_TOL 1e-6  // float で収束とみなす更新量の許容値の下限
+
+// simd_complex.h と同じく、ベクトル型の引数によるABIの警告はこのヘッダの中だけで無効にする
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+typedef float simd_vf __attribute__((vector_size(64))); // float x 16
+typedef int simd_vi __attribute__((vector_size(64)));   // int32 x 16 (比較結果のマスクにも使う)
+
+typedef struct {
+    simd_vf re, im;
+} simd_vcf;
+
+// --- 実数ベクトルの基本操作 ---
+
+SIMD_INLINE simd_vf svf_load(const float *p) {
+    simd_vf v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+SIMD_INLINE void svf_store(float *p, simd_vf v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+// マスクが立っているレーンはa、それ以外はb
+SIMD_INLINE simd_vf svf_select(simd_vi mask, simd_vf a, simd_vf b) {
+    return (simd_vf) (((simd_vi) a & mask) | ((simd_vi) b & ~mask));
+}
+
+SIMD_INLINE int svf_any(simd_vi mask) {
+    int acc = 0;
+    for (int i = 0; i < SIMD_LANES_F; i++) {
+        acc |= mask[i];
+    }
+    return acc != 0;
+}
+
+SIMD_INLINE simd_vf svf_abs(simd_vf x) {
+    return (simd_vf) ((simd_vi) x & 0x7fffffff);
+}
+
+// yの符号をxにつける
+SIMD_INLINE simd_vf svf_copysign(simd_vf x, simd_vf y) {
+    simd_vi sign = (simd_vi) y & (int) 0x80000000U;
+    return (simd_vf) (((simd_vi) x & 0x7fffffff) | sign);
+}
+
+// 最も近い整数に丸める (|x| < 2^22)
+SIMD_INLINE simd_vf svf_round(simd_vf x) {
+    const float magic = 12582912.0f; // 1.5 * 2^23
+    return (x + magic) - magic;
+}
+
+// 切り捨て (|x| < 2^22)
+SIMD_INLINE simd_vf svf_floor(simd_vf x) {
+    simd_vf r = svf_round(x);
+    return r + __builtin_convertvector(r > x, simd_vf); // 切り上がったレーンはマスクの -1 を足す
+}
+
+// 平方根 (ビット操作の初期値 + 逆平方根のニュートン法)
+SIMD_INLINE simd_vf svf_sqrt(simd_vf x) {
+    // 非正規化数に近い値は 2^64 倍してから計算し、結果を 2^-32 倍する
+    simd_vi tiny = x < 1e-30f;
+    simd_vf xs = svf_select(tiny, x * 0x1p64f, x);
+
+    simd_vf y = (simd_vf) (0x5f3759df - ((simd_vi) xs >> 1)); // 1/sqrt(x) の近似
+    for (int i = 0; i < 3; i++) {
+        y = y * (1.5f - 0.5f * xs * y * y);
+    }
+    simd_vf s = xs * y;
+    s = 0.5f * (s + xs / s);
+    s = svf_select(tiny, s * 0x1p-32f, s);
+    s = svf_select(x == 0.0f, x, s);
+    s = svf_select(x == __builtin_inff(), x, s);
+    return svf_select(x < 0.0f, (simd_vf) {} + __builtin_nanf(""), s);
+}
+
+// e^x (Cephes の expf)
+SIMD_INLINE simd_vf svf_exp(simd_vf x) {
+    const float ln2_hi = 0.693359375f;
+    const float ln2_lo = -2.12194440e-4f;
+    simd_vf xc = svf_select(x > 88.72f, (simd_vf) {} + 88.72f, x);
+    xc = svf_select(xc < -103.9f, (simd_vf) {} - 103.9f, xc);
+
+    // x = n*log(2) + r, |r| <= log(2)/2
+    simd_vf n = svf_round(xc * 1.44269504088896341f);
+    simd_vf r = xc - n * ln2_hi - n * ln2_lo;
+
+    simd_vf p = 1.9875691500e-4f + 0.0f * r;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1.0f;
+
+    // 2^n を指数部に直接作る (nが指数部の範囲を超えないよう2回に分けて掛ける)
+    simd_vi ni = __builtin_convertvector(n, simd_vi);
+    simd_vi n1 = ni >> 1, n2 = ni - n1;
+    simd_vf y = p * (simd_vf) ((n1 + 127) << 23) * (simd_vf) ((n2 + 127) << 23);
+    y = svf_select(x > 88.72f, (simd_vf) {} + __builtin_inff(), y);
+    y = svf_select(x < -103.9f, (simd_vf) {}, y);
+    return svf_select(x != x, x, y); // NaNはそのまま
+}
+
+// sin(x) と cos(x) を同時に計算する (Cephes の sinf, cosf。|x| は 1e4 程度まで)
+SIMD_INLINE void svf_sincos(simd_vf x, simd_vf *s, simd_vf *c) {
+    // x = n*(π/2) + r, |r| <= π/4 (π/2 を3つに分けて引く)
+    const float pio2_1 = 1.5703125f;
+    const float pio2_2 = 4.837512969970703125e-4f;
+    const float pio2_3 = 7.54978995489188216e-8f;
+    simd_vf n = svf_round(x * 0.636619772367581343f);
+    simd_vf r = ((x - n * pio2_1) - n * pio2_2) - n * pio2_3;
+    simd_vf z = r * r;
+
+    simd_vf ps = -1.9515295891e-4f + 0.0f * z;
+    ps = ps * z + 8.3321608736e-3f;
+    ps = ps * z - 1.6666654611e-1f;
+    simd_vf sin_r = r + r * z * ps;
+
+    simd_vf pc = 2.443315711809948e-5f + 0.0f * z;
+    pc = pc * z - 1.388731625493765e-3f;
+    pc = pc * z + 4.166664568298827e-2f;
+    simd_vf cos_r = 1.0f - 0.5f * z + z * z * pc;
+
+    // 象限で入れ替えと符号を決める
+    simd_vi q = __builtin_convertvector(n, simd_vi) & 3;
+    simd_vi swap = (q & 1) != 0;
+    simd_vf sv = svf_select(swap, cos_r, sin_r);
+    simd_vf cv = svf_select(swap, sin_r, cos_r);
+    *s = svf_select(q >= 2, -sv, sv);
+    *c = svf_select((q == 1) | (q == 2), -cv, cv);
+}
+
+// --- 複素数ベクトル ---
+
+SIMD_INLINE simd_vcf scf_make(simd_vf re, simd_vf im) {
+    simd_vcf z = {re, im};
+    return z;
+}
+
+SIMD_INLINE simd_vcf scf_add(simd_vcf a, simd_vcf b) {
+    return scf_make(a.re + b.re, a.im + b.im);
+}
+
+SIMD_INLINE simd_vcf scf_sub(simd_vcf a, simd_vcf b) {
+    return scf_make(a.re - b.re, a.im - b.im);
+}
+
+SIMD_INLINE simd_vcf scf_scale(simd_vcf a, float s) {
+    return scf_make(a.re * s, a.im * s);
+}
+
+SIMD_INLINE simd_vcf scf_mul(simd_vcf a, simd_vcf b) {
+    return scf_make(a.re * b.re - a.im * b.im, a.re * b.im + a.im * b.re);
+}
+
+SIMD_INLINE simd_vcf scf_div(simd_vcf a, simd_vcf b) {
+    simd_vf d = 1.0f / (b.re * b.re + b.im * b.im);
+    return scf_make((a.re * b.re + a.im * b.im) * d, (a.im * b.re - a.re * b.im) * d);
+}
+
+SIMD_INLINE simd_vf scf_abs2(simd_vcf a) {
+    return a.re * a.re + a.im * a.im;
+}
+
+SIMD_INLINE simd_vcf scf_select(simd_vi mask, simd_vcf a, simd_vcf b) {
+    return scf_make(svf_select(mask, a.re, b.re), svf_select(mask, a.im, b.im));
+}
+
+SIMD_INLINE simd_vcf scf_exp(simd_vcf z) {
+    simd_vf e = svf_exp(z.re), s, c;
+    svf_sincos(z.im, &s, &c);
+    return scf_make(e * c, e * s);
+}
+
+// sin(z) と cos(z)
+SIMD_INLINE void scf_sincos(simd_vcf z, simd_vcf *s, simd_vcf *c) {
+    simd_vf sx, cx;
+    svf_sincos(z.re, &sx, &cx);
+    simd_vf ep = svf_exp(z.im), em = svf_exp(-z.im);
+    simd_vf ch = 0.5f * (ep + em), sh = 0.5f * (ep - em);
+    *s = scf_make(sx * ch, cx * sh);
+    *c = scf_make(cx * ch, -sx * sh);
+}
+
+// tanh(x+iy) = (sinh 2x + i sin 2y) / (cosh 2x + cos 2y)
+SIMD_INLINE simd_vcf scf_tanh(simd_vcf z) {
+    simd_vf x2 = 2.0f * z.re, s2, c2;
+    svf_sincos(2.0f * z.im, &s2, &c2);
+    simd_vf ep = svf_exp(x2), em = svf_exp(-x2);
+    simd_vf d = 0.5f * (ep + em) + c2;
+    simd_vcf t = scf_make(0.5f * (ep - em) / d, s2 / d);
+    // |x| が大きいと inf/inf になるので ±1 にする (float では |x| > 9 で tanh は1と区別できない)
+    simd_vi far = svf_abs(z.re) > 9.0f;
+    return scf_select(far, scf_make(svf_copysign((simd_vf) {} + 1.0f, z.re), (simd_vf) {}), t);
+}
+
+// f(z) と f'(z) を同時に計算する (simd_func_eval の float 版)
+SIMD_INLINE void simd_func_eval_f(SimdFuncKind kind, simd_vcf z, simd_vcf *f, simd_vcf *df) {
+    simd_vcf one = scf_make((simd_vf) {} + 1.0f, (simd_vf) {});
+    switch (kind) {
+        case SIMD_FUNC_EXP:
+            *f = scf_exp(z);
+            *df = *f;
+            break;
+        case SIMD_FUNC_COSH2: {
+            simd_vcf ep = scf_exp(z);
+            simd_vcf em = scf_div(one, ep);
+            *f = scf_add(ep, em);
+            *df = scf_sub(ep, em);
+            break;
+        }
+        case SIMD_FUNC_SQUARE:
+            *f = scf_mul(z, z);
+            *df = scf_scale(z, 2.0f);
+            break;
+        case SIMD_FUNC_CUBE: {
+            simd_vcf z2 = scf_mul(z, z);
+            *f = scf_mul(z2, z);
+            *df = scf_scale(z2, 3.0f);
+            break;
+        }
+        case SIMD_FUNC_SIN:
+            scf_sincos(z, f, df);
+            break;
+        case SIMD_FUNC_TANH: {
+            simd_vcf t = scf_tanh(z);
+            *f = t;
+            *df = scf_sub(one, scf_mul(t, t));
+            break;
+        }
+        default:
+            *f = z;
+            *df = one;
+            break;
+    }
+}
+
+// --- ブロック単位のカーネル ---
+
+// 16ピクセル分を float のニュートン法で解く (simd_newton_body と同じ終了条件)
+// refineが1なら、最後に double で1回だけニュートン法の更新をする (混合精度)
+SIMD_INLINE void simd_newton_f_body(SimdFuncKind kind, const NewtonParams *params, int max_iter, int refine,
+                                    const double *wre, const double *wim, double *zre, double *zim,
+                                    int *iterations, double *residual, int *converged) {
+    float buf[4][SIMD_LANES_F];
+    for (int k = 0; k < SIMD_LANES_F; k++) {
+        buf[0][k] = (float) wre[k];
+        buf[1][k] = (float) wim[k];
+        buf[2][k] = (float) zre[k];
+        buf[3][k] = (float) zim[k];
+    }
+    float res_tol = params->res_tol > SIMD_FLOAT_RES_TOL ? params->res_tol : SIMD_FLOAT_RES_TOL;
+    float step_tol = params->step_tol > SIMD_FLOAT_STEP_TOL ? params->step_tol : SIMD_FLOAT_STEP_TOL;
+
+    simd_vcf w = scf_make(svf_load(buf[0]), svf_load(buf[1]));
+    simd_vcf z = scf_make(svf_load(buf[2]), svf_load(buf[3]));
+    simd_vf tol = res_tol * (1.0f + svf_sqrt(scf_abs2(w)));
+    simd_vf tol2 = tol * tol;
+    simd_vf step_res2 = tol2 * (float) (NEWTON_STEP_RES_SCALE * NEWTON_STEP_RES_SCALE);
+
+    simd_vcf f, df;
+    simd_func_eval_f(kind, z, &f, &df);
+    simd_vcf r = scf_sub(f, w);
+
+    simd_vi active = (simd_vi) {} - 1;
+    simd_vi conv = (simd_vi) {};
+    simd_vi iters = (simd_vi) {};
+
+    for (int i = 0; i < max_iter; i++) {
+        simd_vi done = active & (scf_abs2(r) <= tol2);
+        conv |= done;
+        active &= ~done;
+        // ゼロ除算を避ける
+        active &= ~(scf_abs2(df) < 1e-12f);
+        if (!svf_any(active)) {
+            break;
+        }
+
+        simd_vcf step = scf_div(r, df);
+        z = scf_select(active, scf_sub(z, step), z);
+        iters -= active; // activeは-1なので1増える
+
+        simd_vcf f_new, df_new;
+        simd_func_eval_f(kind, z, &f_new, &df_new);
+        r = scf_select(active, scf_sub(f_new, w), r);
+        df = scf_select(active, df_new, df);
+
+        simd_vf lim = step_tol * (1.0f + svf_sqrt(scf_abs2(z)));
+        done = active & (scf_abs2(step) <= lim * lim) & (scf_abs2(r) <= step_res2);
+        conv |= done;
+        active &= ~done;
+    }
+    conv |= scf_abs2(r) <= tol2;
+
+    svf_store(buf[2], z.re);
+    svf_store(buf[3], z.im);
+    svf_store(buf[0], svf_sqrt(scf_abs2(r)));
+    for (int k = 0; k < SIMD_LANES_F; k++) {
+        zre[k] = buf[2][k];
+        zim[k] = buf[3][k];
+        if (iterations) {
+            iterations[k] = iters[k];
+        }
+        if (residual) {
+            residual[k] = buf[0][k];
+        }
+        converged[k] = conv[k] != 0;
+    }
+
+    if (refine) {
+        // double で1回だけ更新する (8レーンずつ2回)
+        for (int h = 0; h < SIMD_LANES_F; h += SIMD_LANES) {
+            simd_vc wd = sc_load(wre + h, wim + h);
+            simd_vc zd = sc_load(zre + h, zim + h);
+            simd_vc fd, dfd;
+            simd_func_eval(kind, zd, &fd, &dfd);
+            simd_vl ok = sc_abs2(dfd) >= 1e-12;
+            zd = sc_select(ok, sc_sub(zd, sc_div(sc_sub(fd, wd), dfd)), zd);
+            sc_store(zre + h, zim + h, zd);
+            if (residual) {
+                // 残差は更新後の z で計算し直す (記録するときだけ)
+                simd_func_eval(kind, zd, &fd, &dfd);
+                sv_store(residual + h, sv_sqrt(sc_abs2(sc_sub(fd, wd))));
+            }
+        }
+    }
+}
+
+SIMD_DEFINE_KERNEL(simd_newton_f,
+                   (SimdFuncKind kind, const NewtonParams *params, int max_iter, int refine,
+                    const double *wre, const double *wim, double *zre, double *zim,
+                    int *iterations, double *residual, int *converged),
+                   (kind, params, max_iter, refine, wre, wim, zre, zim, iterations, residual, converged))
+
+// 16ピクセル分を (zre, zim) を初期値にして float のニュートン法で解く
+// refineが1なら最後に double で1回だけ更新する。入出力は simd_newton_block と同じく double
+// iterations, residual はNULLでもよい。converged には各レーンが (float で) 収束したか (1/0) を入れる
+static inline void simd_newton_block_f(SimdFuncKind kind, const NewtonParams *params, int max_iter, int refine,
+                                       const double *wre, const double *wim, double *zre, double *zim,
+                                       int *iterations, double *residual, int *converged) {
+    switch (simd_level()) {
+        case 2:
+            simd_newton_f_avx512(kind, params, max_iter, refine, wre, wim, zre, zim,
+                                 iterations, residual, converged);
+            break;
+        case 1:
+            simd_newton_f_avx2(kind, params, max_iter, refine, wre, wim, zre, zim,
+                               iterations, residual, converged);
+            break;
+        default:
+            simd_newton_f_generic(kind, params, max_iter, refine, wre, wim, zre, zim,
+                                  iterations, residual, converged);
+            break;
+    }
+}
+
+#pragma GCC diagnostic pop
+
+#endif
@@ -0,0 +1,240 @@
+// 描画用のスレッドプール
+// スレッドは一度作ったら終了まで使い回し、仕事 (行の区間や2次元のタイルの番号) を
+// スレッドごとの区間に分けて配る。自分の区間がなくなったスレッドは、ほかのスレッドの
+// 区間の後ろ半分を盗んで続けるので、ニュートン法の反復回数が場所によって大きく違っても偏らない。
+// 1フレームに何行も描くときに、行ごとにスレッドを起こして待ち合わせる手間を減らす。
+#ifndef TILE_POOL_H
+#define TILE_POOL_H
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define TILE_POOL_MAX_THREADS 256
+#define TILE_POOL_SPIN 20000 // 仕事が終わってから眠るまでに次の仕事を待つ回数
+
+// 仕事1つ分を処理する関数 (task は 0, 1, ..., n_tasks - 1)
+typedef void (*tile_pool_func)(void *ctx, int task);
+
+typedef struct {
+    // 上位32ビットが区間の始まり、下位32ビットが終わり (begin, end)
+    // 持ち主は始まりから1つずつ取り、盗むスレッドは終わり側の半分を取る
+    unsigned long long range;
+    char pad[64 - sizeof(unsigned long long)]; // 別のスレッドの区間と同じキャッシュラインに載せない
+} TilePoolQueue;
+
+typedef struct {
+    int n_threads;                 // 呼び出したスレッドも含めたスレッド数
+    pthread_t threads[TILE_POOL_MAX_THREADS];
+    TilePoolQueue queues[TILE_POOL_MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+    unsigned long generation;      // 仕事を配るたびに1増やす
+    int running;                   // 仕事中のスレッド数 (呼び出したスレッド以外)
+    int quit;
+    tile_pool_func func;
+    void *ctx;
+} TilePool;
+
+static inline unsigned long long tile_pool_pack(int begin, int end) {
+    return (unsigned long long) (unsigned int) begin << 32 | (unsigned int) end;
+}
+
+// 自分の区間から仕事を1つ取る。なければ0を返す
+static inline int tile_pool_pop(TilePoolQueue *q, int *task) {
+    unsigned long long r = __atomic_load_n(&q->range, __ATOMIC_ACQUIRE);
+    for (;;) {
+        int begin = (int) (r >> 32), end = (int) (unsigned int) r;
+        if (begin >= end) {
+            return 0;
+        }
+        if (__atomic_compare_exchange_n(&q->range, &r, tile_pool_pack(begin + 1, end), 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *task = begin;
+            return 1;
+        }
+    }
+}
+
+// ほかのスレッドの区間の後ろ半分を盗む。盗めなければ0を返す
+static inline int tile_pool_steal(TilePoolQueue *q, int *begin, int *end) {
+    unsigned long long r = __atomic_load_n(&q->range, __ATOMIC_ACQUIRE);
+    for (;;) {
+        int b = (int) (r >> 32), e = (int) (unsigned int) r;
+        if (b >= e) {
+            return 0;
+        }
+        int mid = b + (e - b) / 2;
+        if (__atomic_compare_exchange_n(&q->range, &r, tile_pool_pack(b, mid), 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *begin = mid;
+            *end = e;
+            return 1;
+        }
+    }
+}
+
+// id 番目のスレッドとして、配られた仕事と盗んだ仕事がなくなるまで処理する
+static inline void tile_pool_work(TilePool *pool, int id) {
+    TilePoolQueue *own = &pool->queues[id];
+    for (;;) {
+        int task;
+        while (tile_pool_pop(own, &task)) {
+            pool->func(pool->ctx, task);
+        }
+        // 隣のスレッドから順に盗みに行く
+        int stolen = 0;
+        for (int k = 1; k < pool->n_threads && !stolen; k++) {
+            int begin, end;
+            if (tile_pool_steal(&pool->queues[(id + k) % pool->n_threads], &begin, &end)) {
+                __atomic_store_n(&own->range, tile_pool_pack(begin, end), __ATOMIC_RELEASE);
+                stolen = 1;
+            }
+        }
+        if (!stolen) {
+            return;
+        }
+    }
+}
+
+static inline void *tile_pool_thread(void *arg) {
+    TilePool *pool = arg;
+    int id;
+    unsigned long seen = 0;
+    // 自分の番号はスレッドを作った順 (threads[] の位置) から決める
+    pthread_mutex_lock(&pool->lock);
+    for (id = 1; id < pool->n_threads && !pthread_equal(pool->threads[id], pthread_self()); id++) {
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    for (;;) {
+        // 次の仕事はすぐ来ることが多いので、しばらくは眠らずに待つ
+        for (int spin = 0; spin < TILE_POOL_SPIN &&
+                           __atomic_load_n(&pool->generation, __ATOMIC_ACQUIRE) == seen &&
+                           !__atomic_load_n(&pool->quit, __ATOMIC_ACQUIRE); spin++) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen && !pool->quit) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->quit) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        tile_pool_work(pool, id);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// n_threads 個 (0以下なら環境変数 CTIMAP_THREADS、なければCPUの数) のスレッドでプールを作る
+// 成功すれば0、スレッドを作れなければ-1を返す
+static inline int tile_pool_init(TilePool *pool, int n_threads) {
+    if (n_threads <= 0) {
+        const char *env = getenv("CTIMAP_THREADS");
+        n_threads = env ? atoi(env) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (n_threads < 1) {
+        n_threads = 1;
+    }
+    if (n_threads > TILE_POOL_MAX_THREADS) {
+        n_threads = TILE_POOL_MAX_THREADS;
+    }
+    pool->n_threads = n_threads;
+    pool->generation = 0;
+    pool->running = 0;
+    pool->quit = 0;
+    pool->func = NULL;
+    pool->ctx = NULL;
+    for (int i = 0; i < n_threads; i++) {
+        pool->queues[i].range = 0;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    // 0番目は呼び出したスレッド自身
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 1; i < n_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, tile_pool_thread, pool) != 0) {
+            pool->n_threads = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return pool->n_threads == n_threads ? 0 : -1;
+}
+
+// n_tasks 個の仕事をすべて処理し終わるまで待つ (呼び出したスレッドも処理する)
+// 仕事はスレッド数で等分した連続した区間として配るので、隣り合う仕事は同じスレッドで処理されやすい
+static inline void tile_pool_run(TilePool *pool, int n_tasks, tile_pool_func func, void *ctx) {
+    if (n_tasks <= 0) {
+        return;
+    }
+    if (pool->n_threads == 1 || n_tasks == 1) {
+        for (int task = 0; task < n_tasks; task++) {
+            func(ctx, task);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->func = func;
+    pool->ctx = ctx;
+    for (int i = 0; i < pool->n_threads; i++) {
+        int begin = (int) ((long) n_tasks * i / pool->n_threads);
+        int end = (int) ((long) n_tasks * (i + 1) / pool->n_threads);
+        __atomic_store_n(&pool->queues[i].range, tile_pool_pack(begin, end), __ATOMIC_RELAXED);
+    }
+    pool->running = pool->n_threads - 1;
+    __atomic_store_n(&pool->generation, pool->generation + 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    tile_pool_work(pool, 0);
+
+    // 盗まれた仕事が終わるまで待つ
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static inline void tile_pool_destroy(TilePool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->n_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+}
+
+// 描画で使う共有のプール (最初に使うときに作り、プログラムの終了まで使い回す)
+static TilePool tile_pool_shared_pool;
+static pthread_once_t tile_pool_shared_once = PTHREAD_ONCE_INIT;
+
+static inline void tile_pool_shared_init(void) {
+    tile_pool_init(&tile_pool_shared_pool, 0);
+}
+
+static inline TilePool *tile_pool_shared(void) {
+    pthread_once(&tile_pool_shared_once, tile_pool_shared_init);
+    return &tile_pool_shared_pool;
+}
+
+#endif
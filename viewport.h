@@ -0,0 +1,118 @@
+// 画像のピクセルと複素平面の範囲の対応 (ビューポート)
+// ピクセル(x, y)は複素数 (re_min + x * scale_re) + (im_min + y * scale_im) i に対応する。
+// 1ピクセルの幅と高さ (scale_re, scale_im) とその逆数は作るときに1回だけ求めるので、
+// ピクセルと複素数の変換で割り算をしない。行に沿って進むときは掛け算もせず、1ピクセルごとに scale_re を足していく。
+#ifndef VIEWPORT_H
+#define VIEWPORT_H
+
+#include <stdio.h>
+#include <complex.h>
+
+typedef struct {
+    double re_min, re_max;              // 複素平面の範囲 (実部)。0列目が re_min、width 列目が re_max
+    double im_min, im_max;              // 複素平面の範囲 (虚部)
+    int width, height;                  // 画像サイズ
+    double aspect;                      // 1ピクセルの縦横比 (複素平面での高さ / 幅。1なら正方形)
+    double scale_re, scale_im;          // 1ピクセルの幅と高さ (複素平面)
+    double inv_scale_re, inv_scale_im;  // その逆数 (複素平面の長さ → ピクセル数)
+} Viewport;
+
+// 複素平面の範囲 [re_min, re_max] x [im_min, im_max] を width x height の画像に対応させる
+static inline void viewport_init(Viewport *view, double re_min, double re_max, double im_min, double im_max,
+                                 int width, int height) {
+    view->re_min = re_min;
+    view->re_max = re_max;
+    view->im_min = im_min;
+    view->im_max = im_max;
+    view->width = width;
+    view->height = height;
+    view->scale_re = (re_max - re_min) / width;
+    view->scale_im = (im_max - im_min) / height;
+    view->inv_scale_re = width / (re_max - re_min);
+    view->inv_scale_im = height / (im_max - im_min);
+    view->aspect = view->scale_im / view->scale_re;
+}
+
+// 範囲の中心
+static inline double complex viewport_center(const Viewport *view) {
+    return 0.5 * (view->re_min + view->re_max) + 0.5 * (view->im_min + view->im_max) * I;
+}
+
+// 中心を center に移し、範囲を 1/zoom にする (ピクセルの縦横比は変えない)
+static inline void viewport_zoom(Viewport *view, double complex center, double zoom) {
+    double half_re = 0.5 * (view->re_max - view->re_min) / zoom;
+    double half_im = half_re * view->aspect * view->height / view->width;
+    viewport_init(view, creal(center) - half_re, creal(center) + half_re,
+                  cimag(center) - half_im, cimag(center) + half_im, view->width, view->height);
+}
+
+// 同じ範囲と大きさか
+static inline int viewport_equal(const Viewport *a, const Viewport *b) {
+    return a->re_min == b->re_min && a->re_max == b->re_max &&
+           a->im_min == b->im_min && a->im_max == b->im_max &&
+           a->width == b->width && a->height == b->height;
+}
+
+// x 列目の実部、y 行目の虚部 (x, y は小数でもよい)
+static inline double viewport_re(const Viewport *view, double x) {
+    return view->re_min + x * view->scale_re;
+}
+
+static inline double viewport_im(const Viewport *view, double y) {
+    return view->im_min + y * view->scale_im;
+}
+
+// ピクセル(x, y)に対応する複素数
+static inline double complex viewport_point(const Viewport *view, double x, double y) {
+    return viewport_re(view, x) + viewport_im(view, y) * I;
+}
+
+// 複素数の実部・虚部が何列目・何行目に当たるか (viewport_re, viewport_im の逆。小数のまま返す)
+static inline double viewport_pixel_x(const Viewport *view, double re) {
+    return (re - view->re_min) * view->inv_scale_re;
+}
+
+static inline double viewport_pixel_y(const Viewport *view, double im) {
+    return (im - view->im_min) * view->inv_scale_im;
+}
+
+// 行順にピクセルを1つずつ進みながら、対応する複素数を足し算だけで求める
+typedef struct {
+    int x, y;       // 今のピクセル
+    double re, im;  // 今のピクセルに対応する複素数
+} ViewportCursor;
+
+// 行順で p 番目のピクセルから始める
+static inline ViewportCursor viewport_cursor(const Viewport *view, long p) {
+    ViewportCursor c;
+    c.x = (int) (p % view->width);
+    c.y = (int) (p / view->width);
+    c.re = viewport_re(view, c.x);
+    c.im = viewport_im(view, c.y);
+    return c;
+}
+
+// 次のピクセルに進む (行の端で次の行の先頭に移る)
+static inline void viewport_cursor_next(const Viewport *view, ViewportCursor *c) {
+    if (++c->x < view->width) {
+        c->re += view->scale_re;
+        return;
+    }
+    c->x = 0;
+    c->y++;
+    c->re = view->re_min;
+    c->im = viewport_im(view, c->y);
+}
+
+// "RE,IM" (例: 0.5,-1) の形で中心を読む。読めなければ-1を返す
+static inline int viewport_parse_center(const char *arg, double complex *center) {
+    double re, im;
+    char rest;
+    if (sscanf(arg, "%lf,%lf%c", &re, &im, &rest) != 2) {
+        return -1;
+    }
+    *center = re + im * I;
+    return 0;
+}
+
+#endif